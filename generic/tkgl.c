@@ -14,6 +14,14 @@
 #include "tkgl.h"
 #include "tkglOptions.h" 
 #include <string.h>
+#ifndef _WIN32
+#  include <time.h>
+#  include <unistd.h>
+#endif
+#ifdef __linux__
+#  include <sys/timerfd.h>
+#  define HAVE_TIMERFD 1
+#endif
 
 /*
  * Declarations of static functions defined in this file:
@@ -21,12 +29,14 @@
 
 static void TkglDeletedProc(void *clientData);
 static int  TkglConfigure(Tcl_Interp *interp, Tkgl *tkglPtr);
-static void TkglDisplay(void *clientData);
 static void TkglObjEventProc(void *clientData, XEvent *eventPtr);
 static int  TkglWidgetObjCmd(void *clientData, Tcl_Interp *interp, int objc,
 			     Tcl_Obj * const objv[]);
 static int  ObjectIsEmpty(Tcl_Obj *objPtr);
 static void TkglPostRedisplay(Tkgl *tkglPtr);
+static void TkglPostDamage(Tkgl *tkglPtr, const int *rect);
+static int  TkglDamageObjCmd(Tkgl *tkglPtr, Tcl_Interp *interp, int objc,
+			     Tcl_Obj *const objv[]);
 static void TkglFrustum(const Tkgl *tkgl, GLdouble left, GLdouble right,
 			GLdouble bottom, GLdouble top, GLdouble zNear,
 			GLdouble zFar);
@@ -34,20 +44,37 @@ static void TkglOrtho(const Tkgl *tkgl, GLdouble left, GLdouble right,
 		       GLdouble bottom, GLdouble top, GLdouble zNear,
 		      GLdouble zFar);
 static int GetTkglFromObj(Tcl_Interp *interp, Tcl_Obj *obj, Tkgl **target);
+static Tcl_Obj *TkglGetStats(const Tkgl *tkglPtr);
+static void TkglUpdateTimer(Tkgl *tkglPtr);
+static void TkglStopTimer(Tkgl *tkglPtr);
+static void TkglUpdateVisibility(Tkgl *tkglPtr);
+
+/*
+ * The stubs table, defined in tkglStubInit.c.
+ */
+
+MODULE_SCOPE const TkglStubs tkglStubs;
 
 /*
- * The Tkgl package maintains a per-thread list of all Tkgl widgets.
+ * The Tkgl package maintains a per-thread registry of all Tkgl widgets,
+ * indexed by path name, by ident and by context.
  */
 
 typedef struct {
-    Tkgl *tkglHead;        /* Head of linked list of all Tkgl widgets. */
-    int nextContextTag;    /* Used to assign similar context tags. */
+    Tcl_HashTable pathTable;    /* Path name -> Tkgl */
+    Tcl_HashTable identTable;   /* Ident -> IdentUsers */
+    Tcl_HashTable contextTable; /* Context -> ContextUsers */
     int initialized;       /* Set to 1 when the struct is initialized. */ 
 } ThreadSpecificData;
 
 static Tcl_ThreadDataKey dataKey;
 static void addToList(Tkgl *t);
 static void removeFromList(Tkgl *t);
+static void updateIdent(Tkgl *t);
+static void RegisterContext(Tkgl *t);
+static Window TkglMakeWindow(Tk_Window tkwin, Window parent,
+			     void *instanceData);
+static void TkglRunCreateCallbacks(void *clientData);
 
 
 /*
@@ -91,15 +118,10 @@ TkglObjCmd(
     if (procs.size == 0) {
 	procs.size = sizeof(Tk_ClassProcs);
 	procs.worldChangedProc = Tkgl_WorldChanged;
-	procs.createProc = Tkgl_MakeWindow;
+	procs.createProc = TkglMakeWindow;
 	procs.modalProc = NULL;
     } 
    
-    ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
-	Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
-    if (!tsdPtr->initialized) {
-	tsdPtr->initialized = 1;
-    }
     if (objc < 2) {
 	Tcl_WrongNumArgs(interp, 1, objv, "pathName ?-option value ...?");
 	return TCL_ERROR;
@@ -126,6 +148,7 @@ TkglObjCmd(
 
     tkglPtr = (Tkgl *)ckalloc(sizeof(Tkgl));
     memset(tkglPtr, 0, sizeof(Tkgl));
+    tkglPtr->timerFd = -1;
     tkglPtr->tkwin = tkwin;
     tkglPtr->display = Tk_Display(tkwin);
     tkglPtr->interp = interp;
@@ -140,46 +163,144 @@ TkglObjCmd(
 	return TCL_ERROR;
     }
     Tk_SetClassProcs(tkglPtr->tkwin, &procs, tkglPtr);
-    Tk_CreateEventHandler(tkglPtr->tkwin, ExposureMask|StructureNotifyMask,
+    Tk_CreateEventHandler(tkglPtr->tkwin,
+	    ExposureMask|StructureNotifyMask|FocusChangeMask
+	    |VisibilityChangeMask,
 	 TkglObjEventProc, (void *) tkglPtr);
     if (Tk_SetOptions(interp, (void *) tkglPtr, optionTable, objc - 2,
 	    objv + 2, tkwin, NULL, NULL) != TCL_OK) {
 	goto error;
     }
-    /* Create a rendering context for drawing to the widget. */
-    if (Tkgl_CreateGLContext(tkglPtr) != TCL_OK) {
+    if (tkglPtr->pBufferFlag && tkglPtr->offscreen != OFFSCREEN_NONE) {
+	Tcl_SetResult(interp, "-pbuffer and -offscreen cannot be combined",
+	    TCL_STATIC);
+	goto error;
+    }
+    /*
+     * Create a rendering context for drawing to the widget, unless it is
+     * -lazy.  Then that waits until the widget is first shown or used.
+     */
+
+    if (tkglPtr->lazyFlag) {
+	tkglPtr->contextPending = True;
+    } else if (Tkgl_CreateGLContext(tkglPtr) != TCL_OK) {
          goto error;
+    } else {
+	/* Backends which share contexts have already joined a group. */
+	TkglGroupJoin(tkglPtr, NULL);
     }
     /* Configure the widget to match the specified options. */
     if (TkglConfigure(interp, tkglPtr) != TCL_OK) {
 	goto error;
     }
 
-    /* If defined, call Create and Reshape callbacks. */
-    if (tkglPtr->createProc) {
+    /*
+     * If defined, call the Create callback.  The Reshape callback runs on
+     * the first redraw, after the first ConfigureNotify has set the size.
+     */
+    if (tkglPtr->createProc && !tkglPtr->contextPending) {
         if (Tkgl_CallCallback(tkglPtr, tkglPtr->createProc) != TCL_OK) {
             goto error;
         }
     }
 
-    if (tkglPtr->reshapeProc) {
-        if (Tkgl_CallCallback(tkglPtr, tkglPtr->reshapeProc) != TCL_OK) {
-            goto error;
-        }
-    }
-
     /* Add this widget to the global list. */
     addToList(tkglPtr);
     Tcl_SetObjResult(interp,
 	Tcl_NewStringObj(Tk_PathName(tkglPtr->tkwin), TCL_INDEX_NONE));
     /* Make the widget's context current. */
-    Tkgl_MakeCurrent(tkglPtr);
+    if (!tkglPtr->contextPending) {
+	Tkgl_MakeCurrent(tkglPtr);
+    }
     return TCL_OK;
 
   error:
     Tk_DestroyWindow(tkglPtr->tkwin);
     return TCL_ERROR;
 }
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglCreateLazyContext --
+ *
+ *	Create the context of a -lazy widget, which TkglObjCmd skipped.  The
+ *	create and reshape callbacks which TkglObjCmd would have run are
+ *	queued, in that order, to run before the first redraw.  They run
+ *	sooner if the widget command needed the context.  The platform code
+ *	also calls this for a pending widget which another widget names with
+ *	-sharelist or -sharecontext.
+ *
+ * Results:
+ *	A standard Tcl result.  If the context could not be created the
+ *	widget is still pending, and the widget command reports the error
+ *	each time it needs the context.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglCreateLazyContext(
+    Tkgl *tkglPtr)
+{
+    if (Tkgl_CreateGLContext(tkglPtr) != TCL_OK) {
+	/* The widget stays pending, so the next use tries again. */
+	return TCL_ERROR;
+    }
+    tkglPtr->contextPending = False;
+    TkglGroupJoin(tkglPtr, NULL);
+    RegisterContext(tkglPtr);
+    if (tkglPtr->createProc) {
+	tkglPtr->callbacksPending = True;
+	Tcl_DoWhenIdle(TkglRunCreateCallbacks, tkglPtr);
+    }
+    return TCL_OK;
+}
+
+/*
+ * Run the queued create callback of a -lazy widget, if it has not run yet.
+ * The reshape callback waits for the next redraw, which still has the
+ * reshape of the first ConfigureNotify pending, as for other widgets.
+ */
+
+static void
+TkglRunCreateCallbacks(
+    void *clientData)
+{
+    Tkgl *tkglPtr = (Tkgl *) clientData;
+
+    if (!tkglPtr->callbacksPending) {
+	return;
+    }
+    tkglPtr->callbacksPending = False;
+    Tcl_CancelIdleCall(TkglRunCreateCallbacks, tkglPtr);
+    Tcl_Preserve(tkglPtr);
+    Tkgl_MakeCurrent(tkglPtr);
+    if (tkglPtr->createProc) {
+	(void) Tkgl_CallCallback(tkglPtr, tkglPtr->createProc);
+    }
+    Tcl_Release(tkglPtr);
+}
+
+/*
+ * The createProc of the widget class.  A -lazy widget which is about to be
+ * shown gets its context here, so the platform code can give its window
+ * the visual of the context.
+ */
+
+static Window
+TkglMakeWindow(
+    Tk_Window tkwin,
+    Window parent,
+    void *instanceData)
+{
+    Tkgl *tkglPtr = (Tkgl *) instanceData;
+
+    if (tkglPtr->contextPending && TkglCreateLazyContext(tkglPtr) != TCL_OK) {
+	Tcl_BackgroundError(tkglPtr->interp);
+    }
+    return Tkgl_MakeWindow(tkwin, parent, instanceData);
+}
 
 /*
  *--------------------------------------------------------------
@@ -215,8 +336,9 @@ TkglWidgetObjCmd(
 	"hideoverlay", "postredisplayoverlay", "renderoverlay",
         "existsoverlay", "ismappedoverlay", "getoverlaytransparentvalue",
         "drawbuffer", "clear", "frustum", "ortho", "numeyes",
-	"contexttag", "copycontextto", "width", "height",
-        NULL
+	"contexttag", "copycontextto", "width", "height", "stats",
+	"readback", "record", "share", "renderlarge", "formatinfo",
+	"resource", "damage", "bufferage", NULL
     };
     enum
     {
@@ -230,7 +352,9 @@ TkglWidgetObjCmd(
         TKGL_GETOVERLAYTRANSPARENTVALUE,
         TKGL_DRAWBUFFER, TKGL_CLEAR, TKGL_FRUSTUM, TKGL_ORTHO,
         TKGL_NUMEYES, TKGL_CONTEXTTAG, TKGL_COPYCONTEXTTO,
-	TKGL_WIDTH, TKGL_HEIGHT
+	TKGL_WIDTH, TKGL_HEIGHT, TKGL_STATS, TKGL_READBACK, TKGL_RECORD,
+	TKGL_SHARE, TKGL_RENDERLARGE, TKGL_FORMATINFO,
+	TKGL_RESOURCE, TKGL_DAMAGE, TKGL_BUFFERAGE
     };
     Tcl_Obj *resultObjPtr;
     int index;
@@ -247,6 +371,19 @@ TkglWidgetObjCmd(
 
     Tcl_Preserve(tkglPtr);
 
+    if (tkglPtr->contextPending && index != TKGL_CGET
+	    && index != TKGL_CONFIGURE && index != TKGL_POSTREDISPLAY
+	    && index != TKGL_WIDTH && index != TKGL_HEIGHT
+	    && index != TKGL_STATS && index != TKGL_DAMAGE) {
+	/* A -lazy widget gets its context when it is first used. */
+	if (TkglCreateLazyContext(tkglPtr) != TCL_OK) {
+	    goto error;
+	}
+    }
+    if (tkglPtr->callbacksPending && index == TKGL_MAKECURRENT) {
+	TkglRunCreateCallbacks(tkglPtr);
+    }
+
     switch (index) {
     case TKGL_CGET:
 	if (objc != 3) {
@@ -280,12 +417,10 @@ TkglWidgetObjCmd(
 		    tkglPtr->optionTable, objc - 2, objv + 2,
 		    tkglPtr->tkwin, NULL, NULL);
 	    if (result == TCL_OK) {
+		updateIdent(tkglPtr);
 		result = TkglConfigure(interp, tkglPtr);
 	    }
-	    if (!tkglPtr->updatePending) {
-		Tcl_DoWhenIdle(TkglDisplay, (void *)tkglPtr);
-		tkglPtr->updatePending = 1;
-	    }
+	    TkglPostRedisplay(tkglPtr);
 	}
 	if (resultObjPtr != NULL) {
 	    Tcl_SetObjResult(interp, resultObjPtr);
@@ -386,11 +521,13 @@ TkglWidgetObjCmd(
 		result = TCL_ERROR;
 		break;
 	    }
+	    /* The read buffer belongs to the context of this widget. */
+	    Tkgl_MakeCurrent(tkglPtr);
 	    glPushAttrib(GL_PIXEL_MODE_BIT);
-	    if (tkglPtr->doubleFlag) {
+	    if (tkglPtr->doubleFlag && tkglPtr->framebuffer == NULL) {
 		glReadBuffer(GL_FRONT);
 	    }
-	    Tkgl_TakePhoto(tkglPtr, photo);
+	    result = Tkgl_TakePhoto(tkglPtr, photo);
 	    glPopAttrib();    /* restore glReadBuffer */
           }
           break;
@@ -526,6 +663,62 @@ ERROR
 	    result = TCL_ERROR;
 	}
 	break;
+    case TKGL_STATS: {
+	/* Report, and optionally reset, the performance counters. */
+	static const char *const statsOptions[] = {"-reset", NULL};
+	int option;
+
+	if (objc > 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "?-reset?");
+	    result = TCL_ERROR;
+	} else if (objc == 3 && Tcl_GetIndexFromObjStruct(interp, objv[2],
+		statsOptions, sizeof(char *), "option", 0, &option) != TCL_OK) {
+	    result = TCL_ERROR;
+	} else {
+	    Tcl_SetObjResult(interp, TkglGetStats(tkglPtr));
+	    if (objc == 3) {
+		memset(&tkglPtr->stats, 0, sizeof(TkglStats));
+	    }
+	}
+	break;
+    }
+    case TKGL_READBACK:
+	result = TkglReadbackObjCmd(tkglPtr, interp, objc, objv);
+	break;
+    case TKGL_RECORD:
+	result = TkglRecordObjCmd(tkglPtr, interp, objc, objv);
+	break;
+    case TKGL_SHARE:
+	result = TkglShareObjCmd(tkglPtr, interp, objc, objv);
+	break;
+    case TKGL_RENDERLARGE:
+	result = TkglRenderLargeObjCmd(tkglPtr, interp, objc, objv);
+	break;
+    case TKGL_FORMATINFO:
+	/* Describe the pixel format which was chosen, and why. */
+	if (objc == 2) {
+	    if (tkglPtr->formatInfo) {
+		Tcl_SetObjResult(interp, tkglPtr->formatInfo);
+	    }
+	} else {
+	    Tcl_WrongNumArgs(interp, 2, objv, NULL);
+	    result = TCL_ERROR;
+	}
+	break;
+    case TKGL_RESOURCE:
+	result = TkglResourceObjCmd(tkglPtr, interp, objc, objv);
+	break;
+    case TKGL_DAMAGE:
+	result = TkglDamageObjCmd(tkglPtr, interp, objc, objv);
+	break;
+    case TKGL_BUFFERAGE:
+	if (objc == 2) {
+	    Tcl_SetObjResult(interp, Tcl_NewIntObj(Tkgl_BufferAge(tkglPtr)));
+	} else {
+	    Tcl_WrongNumArgs(interp, 2, objv, NULL);
+	    result = TCL_ERROR;
+	}
+	break;
     default:
 	break;
     }
@@ -537,12 +730,159 @@ ERROR
     return TCL_ERROR;
 }
 
+/*
+ * TkglPostRedisplay
+ *
+ * Schedule a redraw of the whole widget.
+ */
+
 static void
 TkglPostRedisplay(Tkgl *tkglPtr)
 {
+    TkglPostDamage(tkglPtr, NULL);
+}
+
+/*
+ * Add a rectangle, or the whole widget if rect is NULL, to the damage of
+ * the next redraw.  The rectangle is clipped to the widget.
+ */
+
+static void
+TkglAddDamage(
+    Tkgl *tkglPtr,
+    const int *rect)
+{
+    TkglDamage *damagePtr = &tkglPtr->damage;
+    int x0, y0, x1, y1, i;
+
+    if (damagePtr->count < 0) {
+	return;
+    }
+    if (rect == NULL) {
+	damagePtr->count = -1;
+	return;
+    }
+    x0 = rect[0] > 0 ? rect[0] : 0;
+    y0 = rect[1] > 0 ? rect[1] : 0;
+    x1 = rect[0] + rect[2] < tkglPtr->width ?
+	    rect[0] + rect[2] : tkglPtr->width;
+    y1 = rect[1] + rect[3] < tkglPtr->height ?
+	    rect[1] + rect[3] : tkglPtr->height;
+    if (x1 <= x0 || y1 <= y0) {
+	return;
+    }
+    if (x0 == 0 && y0 == 0 && x1 == tkglPtr->width
+	    && y1 == tkglPtr->height) {
+	damagePtr->count = -1;
+	return;
+    }
+    if (damagePtr->count == TKGL_MAX_DAMAGE) {
+	/* Merge everything into the bounding box. */
+	for (i = 0; i < damagePtr->count; i++) {
+	    int *r = damagePtr->rects[i];
+
+	    x0 = r[0] < x0 ? r[0] : x0;
+	    y0 = r[1] < y0 ? r[1] : y0;
+	    x1 = r[0] + r[2] > x1 ? r[0] + r[2] : x1;
+	    y1 = r[1] + r[3] > y1 ? r[1] + r[3] : y1;
+	}
+	damagePtr->count = 0;
+    }
+    i = damagePtr->count++;
+    damagePtr->rects[i][0] = x0;
+    damagePtr->rects[i][1] = y0;
+    damagePtr->rects[i][2] = x1 - x0;
+    damagePtr->rects[i][3] = y1 - y0;
+}
+
+/*
+ * TkglPostDamage
+ *
+ * Record damage and schedule a call to TkglDisplay, unless one is already
+ * pending.  The platform code decides when the call happens.  On GLX it
+ * happens on the next tick of the display's frame clock, elsewhere when
+ * Tcl is idle.
+ */
+
+static void
+TkglPostDamage(
+    Tkgl *tkglPtr,
+    const int *rect)
+{
+    TkglAddDamage(tkglPtr, rect);
+    TkglUpdateVisibility(tkglPtr);
+    if (tkglPtr->hidden) {
+	if (!tkglPtr->redrawSuppressed) {
+	    tkglPtr->redrawSuppressed = True;
+	    tkglPtr->stats.suppressedFrames++;
+	}
+	return;
+    }
     if (!tkglPtr->updatePending) {
         tkglPtr->updatePending = True;
-        Tcl_DoWhenIdle(TkglDisplay, (void *) tkglPtr);
+        Tkgl_ScheduleRedisplay(tkglPtr);
+    }
+}
+
+/*
+ * A widget can't be seen if it or one of its ancestors is unmapped, which
+ * covers iconified and withdrawn toplevels and the hidden tabs of a
+ * notebook, or if the X server has reported that it is fully obscured.
+ * Offscreen widgets are always drawn.
+ */
+
+static int
+TkglIsHidden(
+    const Tkgl *tkglPtr)
+{
+    Tk_Window tkwin;
+
+    if (TkglIsOffscreen(tkglPtr)) {
+	return 0;
+    }
+    if (tkglPtr->tkwin == NULL || tkglPtr->obscured) {
+	return 1;
+    }
+    for (tkwin = tkglPtr->tkwin; tkwin != NULL; tkwin = Tk_Parent(tkwin)) {
+	if (!Tk_IsMapped(tkwin)) {
+	    return 1;
+	}
+	if (Tk_IsTopLevel(tkwin)) {
+	    break;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Called when the widget may have been hidden or revealed.  While it is
+ * hidden its redraws are dropped and its timer is stopped.  When it can be
+ * seen again the timer is restarted and, if redraws were dropped, a single
+ * redraw brings it up to date.  An ancestor can be unmapped without the
+ * widget getting an event, so redraws and timer ticks check as well.
+ */
+
+static void
+TkglUpdateVisibility(
+    Tkgl *tkglPtr)
+{
+    int hidden = TkglIsHidden(tkglPtr);
+
+    if (hidden == tkglPtr->hidden) {
+	return;
+    }
+    tkglPtr->hidden = hidden;
+    TkglUpdateTimer(tkglPtr);
+    if (hidden) {
+	if (tkglPtr->updatePending) {
+	    Tkgl_CancelRedisplay(tkglPtr);
+	    tkglPtr->updatePending = False;
+	    tkglPtr->redrawSuppressed = True;
+	    tkglPtr->stats.suppressedFrames++;
+	}
+    } else if (tkglPtr->redrawSuppressed) {
+	tkglPtr->redrawSuppressed = False;
+	TkglPostRedisplay(tkglPtr);
     }
 }
 
@@ -576,10 +916,20 @@ TkglConfigure(
      */
 
     Tk_GeometryRequest(tkglPtr->tkwin, tkglPtr->width, tkglPtr->height);
-    if (!tkglPtr->updatePending) {
-	Tcl_DoWhenIdle(TkglDisplay, tkglPtr);
-	tkglPtr->updatePending = 1;
+
+    /*
+     * An offscreen widget gets no ConfigureNotify events, so it is resized
+     * here.  Its framebuffer gets the new size when the context is next
+     * made current.
+     */
+
+    if (tkglPtr->offscreen == OFFSCREEN_FBO && (tkglPtr->framebuffer == NULL
+	    || tkglPtr->framebuffer->width != tkglPtr->width
+	    || tkglPtr->framebuffer->height != tkglPtr->height)) {
+	tkglPtr->reshapePending = True;
     }
+    TkglUpdateTimer(tkglPtr);
+    TkglPostRedisplay(tkglPtr);
     return TCL_OK;
 }
 
@@ -609,27 +959,32 @@ TkglObjEventProc(
     Tkgl *tkglPtr = (Tkgl *)clientData;
 
     switch(eventPtr->type) {
-    case Expose:
-	if (!tkglPtr->updatePending) {
-	    Tcl_DoWhenIdle(TkglDisplay, tkglPtr);
-	    tkglPtr->updatePending = 1;
-	}
+    case Expose: {
+	/* Damage is kept with the origin at the bottom, as in OpenGL. */
+	int rect[4];
+
+	rect[0] = eventPtr->xexpose.x;
+	rect[1] = tkglPtr->height - eventPtr->xexpose.y
+		- eventPtr->xexpose.height;
+	rect[2] = eventPtr->xexpose.width;
+	rect[3] = eventPtr->xexpose.height;
+	TkglPostDamage(tkglPtr, rect);
 	break;
+    }
     case ConfigureNotify:
+	/*
+	 * An interactive resize produces a storm of these events.  We only
+	 * record the new size here.  The surface is resized and the reshape
+	 * callback is run by TkglDisplay, once per frame.
+	 */
+
 	tkglPtr->width = Tk_Width(tkglPtr->tkwin);
 	tkglPtr->height = Tk_Height(tkglPtr->tkwin);
-	XResizeWindow(Tk_Display(tkglPtr->tkwin), Tk_WindowId(tkglPtr->tkwin),
-		      tkglPtr->width, tkglPtr->height);
-        if (tkglPtr->reshapeProc) {
-            if (Tkgl_CallCallback(tkglPtr, tkglPtr->reshapeProc) != TCL_OK) {
-                /* TODO: Error handling. */
-                printf("Error in Reshape callback\n");
-            }
-	}
-	if (!tkglPtr->updatePending) {
-	    Tcl_DoWhenIdle(TkglDisplay, tkglPtr);
-	    tkglPtr->updatePending = 1;
+	if (tkglPtr->reshapePending) {
+	    tkglPtr->stats.coalescedResizes++;
 	}
+	tkglPtr->reshapePending = True;
+	TkglPostRedisplay(tkglPtr);
 	break;
     case DestroyNotify:
 	if (tkglPtr->tkwin != NULL) {
@@ -640,15 +995,39 @@ TkglObjEventProc(
 		    tkglPtr->widgetCmd);
 	}
 	if (tkglPtr->updatePending) {
-	    Tcl_CancelIdleCall(TkglDisplay, tkglPtr);
+	    Tkgl_CancelRedisplay(tkglPtr);
+	    tkglPtr->updatePending = False;
 	}
 	Tcl_EventuallyFree(tkglPtr, TCL_DYNAMIC);
 	break;
     case MapNotify:
 	Tkgl_MapWidget(tkglPtr);
+	TkglUpdateVisibility(tkglPtr);
 	break;
     case UnmapNotify:
 	Tkgl_UnmapWidget(tkglPtr);
+	TkglUpdateVisibility(tkglPtr);
+	break;
+    case VisibilityNotify:
+	/*
+	 * This is also how we learn that an ancestor, e.g. an iconified
+	 * toplevel, has been mapped again.
+	 */
+
+	tkglPtr->obscured =
+		(eventPtr->xvisibility.state == VisibilityFullyObscured);
+	TkglUpdateVisibility(tkglPtr);
+	break;
+    case FocusIn:
+	/* The frame clock draws the focused widget first. */
+	if (eventPtr->xfocus.detail != NotifyPointer) {
+	    tkglPtr->hasFocus = True;
+	}
+	break;
+    case FocusOut:
+	if (eventPtr->xfocus.detail != NotifyPointer) {
+	    tkglPtr->hasFocus = False;
+	}
 	break;
     }
 }
@@ -693,24 +1072,44 @@ TkglDeletedProc(
         /* call user's cleanup code */
         Tkgl_CallCallback(tkglPtr, tkglPtr->destroyProc);
     }
-    if (tkglPtr->timerProc != NULL) {
-        Tcl_DeleteTimerHandler(tkglPtr->timerHandler);
-        tkglPtr->timerHandler = NULL;
-    }
+    TkglStopTimer(tkglPtr);
     if (tkglPtr->updatePending) {
-        Tcl_CancelIdleCall(TkglDisplay, (void *) tkglPtr);
+        Tkgl_CancelRedisplay(tkglPtr);
         tkglPtr->updatePending = False;
     }
+    if (tkglPtr->callbacksPending) {
+	Tcl_CancelIdleCall(TkglRunCreateCallbacks, tkglPtr);
+	tkglPtr->callbacksPending = False;
+    }
 #ifndef NO_TK_CURSOR
     if (tkglPtr->cursor != NULL) {
         Tk_FreeCursor(tkglPtr->display, tkglPtr->cursor);
         tkglPtr->cursor = NULL;
     }
 #endif
+    if (tkglPtr->widgetNameObj) {
+        Tcl_DecrRefCount(tkglPtr->widgetNameObj);
+        tkglPtr->widgetNameObj = NULL;
+    }
+    if (tkglPtr->formatInfo) {
+        Tcl_DecrRefCount(tkglPtr->formatInfo);
+        tkglPtr->formatInfo = NULL;
+    }
+    if (tkglPtr->recorder) {
+	/* Pending readbacks can't be collected once the window is gone. */
+	Tcl_DecrRefCount(TkglRecordStop(tkglPtr, tkwin != NULL));
+    }
+    if (tkglPtr->share) {
+	Tcl_DecrRefCount(TkglShareStop(tkglPtr, tkwin != NULL));
+    }
+    TkglReadbackFree(tkglPtr);
+    TkglGroupLeave(tkglPtr);
     removeFromList(tkglPtr);
     Tkgl_FreeResources(tkglPtr);
     if (tkwin != NULL) {
-        Tk_DeleteEventHandler(tkwin, ExposureMask | StructureNotifyMask,
+        Tk_DeleteEventHandler(tkwin,
+		ExposureMask | StructureNotifyMask | FocusChangeMask
+		| VisibilityChangeMask,
                 TkglObjEventProc, (void *) tkglPtr);
 	if (tkglPtr->setGrid > 0) {
 	    Tk_UnsetGrid(tkwin);
@@ -727,8 +1126,10 @@ TkglDeletedProc(
  * TkglDisplay --
  *
  *	This procedure redraws the contents of a tkgl window. It is invoked
- *	as a do-when-idle handler, so it only runs when there's nothing else
- *	for the application to do.
+ *	by the platform code after TkglPostRedisplay has scheduled it, either
+ *	as a do-when-idle handler or from the display's frame clock.  It is
+ *	also called directly by the render subcommand, in which case any
+ *	scheduled redraw is cancelled since it would be redundant.
  *
  * Results:
  *	None.
@@ -739,22 +1140,96 @@ TkglDeletedProc(
  *--------------------------------------------------------------
  */
 
-static void
+void
 TkglDisplay(
     void *clientData)	/* Information about window. */
 {
     Tkgl *tkglPtr = (Tkgl *)clientData;
     Tk_Window tkwin = tkglPtr->tkwin;
 
-    tkglPtr->updatePending = 0;
-    if (!Tk_IsMapped(tkwin)) {
+    if (tkglPtr->updatePending) {
+	Tkgl_CancelRedisplay(tkglPtr);
+	tkglPtr->updatePending = 0;
+    }
+    if (tkwin == NULL) {
 	return;
     }
+    if (tkglPtr->contextPending) {
+	/*
+	 * An offscreen widget is never mapped, so with -lazy its context is
+	 * only put off until its first redraw.  A window whose context could
+	 * not be created when it was made is not drawn.
+	 */
+
+	if (!TkglIsOffscreen(tkglPtr)) {
+	    return;
+	}
+	if (TkglCreateLazyContext(tkglPtr) != TCL_OK) {
+	    Tcl_BackgroundError(tkglPtr->interp);
+	    return;
+	}
+    }
+    if (TkglIsOffscreen(tkglPtr)) {
+	/* Offscreen widgets draw while unmapped, once they have a target. */
+	if (tkglPtr->offscreen == OFFSCREEN_FBO
+		&& tkglPtr->framebuffer == NULL) {
+	    return;
+	}
+    } else {
+	TkglUpdateVisibility(tkglPtr);
+	if (tkglPtr->hidden) {
+	    if (!tkglPtr->redrawSuppressed) {
+		tkglPtr->redrawSuppressed = True;
+		tkglPtr->stats.suppressedFrames++;
+	    }
+	    return;
+	}
+    }
+    if (tkglPtr->reshapePending && !TkglIsOffscreen(tkglPtr)) {
+	XResizeWindow(Tk_Display(tkwin), Tk_WindowId(tkwin),
+		      tkglPtr->width, tkglPtr->height);
+    }
     Tkgl_Update(tkglPtr);
+    Tcl_Preserve(tkglPtr);
+    TkglRunCreateCallbacks(tkglPtr);
+    if (tkglPtr->tkwin == NULL) {
+	Tcl_Release(tkglPtr);
+	return;
+    }
     Tkgl_MakeCurrent(tkglPtr);
-    if (tkglPtr->displayProc) {
-        Tkgl_CallCallback(tkglPtr, tkglPtr->displayProc);
+    if (tkglPtr->reshapePending) {
+	tkglPtr->reshapePending = False;
+	tkglPtr->stats.reshapes++;
+	if (tkglPtr->reshapeFunc) {
+	    tkglPtr->reshapeFunc(tkglPtr, tkglPtr->reshapeData);
+	} else if (tkglPtr->reshapeProc) {
+	    Tkgl_CallCallback(tkglPtr, tkglPtr->reshapeProc);
+	}
     }
+    if (tkglPtr->tkwin != NULL) {
+	/* The reshape callback may have destroyed the widget. */
+	tkglPtr->stats.frames++;
+	tkglPtr->frameDamage = tkglPtr->damage;
+	if (tkglPtr->frameDamage.count == 0) {
+	    /* Called by the render subcommand without damage. */
+	    tkglPtr->frameDamage.count = -1;
+	}
+	tkglPtr->damage.count = 0;
+	tkglPtr->drawing = True;
+	if (tkglPtr->displayFunc) {
+	    tkglPtr->displayFunc(tkglPtr, tkglPtr->displayData);
+	} else if (tkglPtr->displayProc) {
+	    Tkgl_CallCallback(tkglPtr, tkglPtr->displayProc);
+	}
+	tkglPtr->drawing = False;
+	if (tkglPtr->recorder && tkglPtr->tkwin != NULL) {
+	    TkglRecordFrame(tkglPtr);
+	}
+	if (tkglPtr->share && tkglPtr->tkwin != NULL) {
+	    TkglShareFrame(tkglPtr);
+	}
+    }
+    Tcl_Release(tkglPtr);
 #if 0
     /* Very simple tests */
     static int toggle = 0;
@@ -770,6 +1245,203 @@ TkglDisplay(
 #endif
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * The animation timer.
+ *
+ *	When -timercommand is set and -time is positive, the timer callback
+ *	is called at a fixed rate of one tick every -time milliseconds.  The
+ *	ticks are scheduled against absolute deadlines on a monotonic clock,
+ *	starting from the moment the timer was started, rather than by
+ *	chaining relative Tcl timers.  So late callbacks do not make the
+ *	timer drift.  When the application falls behind, the missed ticks
+ *	are folded into a single call and counted in the skippedticks
+ *	statistic.  With -hirestimer on Linux the deadlines are kept by a
+ *	timerfd, which is not limited to the millisecond resolution of Tcl
+ *	timer handlers.  The timer is stopped while the widget can't be
+ *	seen, see TkglUpdateVisibility.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void TkglArmTimer(Tkgl *tkglPtr);
+
+static void
+TkglTimerTick(
+    Tkgl *tkglPtr)
+{
+    Tcl_WideInt interval = (Tcl_WideInt) tkglPtr->timerRunning * 1000;
+    Tcl_WideInt tick;
+
+    TkglUpdateVisibility(tkglPtr);
+    if (interval <= 0 || tkglPtr->hidden) {
+	return;
+    }
+    tick = (TkglMonotonicTime() - tkglPtr->timerStart) / interval;
+    if (tick <= tkglPtr->timerTick) {
+	/* Woken before the deadline, which can happen with Tcl timers. */
+	TkglArmTimer(tkglPtr);
+	return;
+    }
+    tkglPtr->stats.skippedTicks += tick - tkglPtr->timerTick - 1;
+    tkglPtr->stats.timerTicks++;
+    tkglPtr->timerTick = tick;
+    Tcl_Preserve(tkglPtr);
+    if (tkglPtr->timerFunc) {
+	tkglPtr->timerFunc(tkglPtr, tkglPtr->timerData);
+    } else {
+	Tkgl_CallCallback(tkglPtr, tkglPtr->timerProc);
+    }
+    if (tkglPtr->tkwin != NULL && tkglPtr->timerRunning) {
+	TkglArmTimer(tkglPtr);
+    }
+    Tcl_Release(tkglPtr);
+}
+
+static void
+TkglTimerProc(
+    void *clientData)
+{
+    Tkgl *tkglPtr = (Tkgl *) clientData;
+
+    tkglPtr->timerHandler = NULL;
+    TkglTimerTick(tkglPtr);
+}
+
+#ifdef HAVE_TIMERFD
+static void
+TkglTimerFileProc(
+    void *clientData,
+    int mask)
+{
+    Tkgl *tkglPtr = (Tkgl *) clientData;
+    uint64_t expirations;
+
+    if (read(tkglPtr->timerFd, &expirations, sizeof(expirations)) < 0) {
+	return;
+    }
+    TkglTimerTick(tkglPtr);
+}
+#endif
+
+/*
+ * Schedule the timer to fire at the deadline of the next tick.
+ */
+
+static void
+TkglArmTimer(
+    Tkgl *tkglPtr)
+{
+    Tcl_WideInt interval = (Tcl_WideInt) tkglPtr->timerRunning * 1000;
+    Tcl_WideInt deadline, delay;
+
+    deadline = tkglPtr->timerStart + (tkglPtr->timerTick + 1) * interval;
+#ifdef HAVE_TIMERFD
+    if (tkglPtr->timerFd >= 0) {
+	struct itimerspec spec;
+
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = deadline / 1000000;
+	spec.it_value.tv_nsec = (deadline % 1000000) * 1000;
+	if (timerfd_settime(tkglPtr->timerFd, TFD_TIMER_ABSTIME,
+		&spec, NULL) == 0) {
+	    return;
+	}
+    }
+#endif
+    if (tkglPtr->timerHandler) {
+	Tcl_DeleteTimerHandler(tkglPtr->timerHandler);
+    }
+    delay = deadline - TkglMonotonicTime();
+    tkglPtr->timerHandler = Tcl_CreateTimerHandler(
+	delay > 0 ? (int) ((delay + 999) / 1000) : 0, TkglTimerProc, tkglPtr);
+}
+
+static void
+TkglStopTimer(
+    Tkgl *tkglPtr)
+{
+    if (tkglPtr->timerHandler) {
+	Tcl_DeleteTimerHandler(tkglPtr->timerHandler);
+	tkglPtr->timerHandler = NULL;
+    }
+#ifdef HAVE_TIMERFD
+    if (tkglPtr->timerFd >= 0) {
+	Tcl_DeleteFileHandler(tkglPtr->timerFd);
+	close(tkglPtr->timerFd);
+    }
+#endif
+    tkglPtr->timerFd = -1;
+    tkglPtr->timerRunning = 0;
+}
+
+/*
+ * Start, stop or restart the timer to match the widget's options.  A timer
+ * which is already running with the same settings is left alone, so that
+ * reconfiguring other options does not shift its phase.
+ */
+
+static void
+TkglUpdateTimer(
+    Tkgl *tkglPtr)
+{
+    int interval = (tkglPtr->timerProc || tkglPtr->timerFunc) ?
+	tkglPtr->timerInterval : 0;
+
+    if (interval < 0 || tkglPtr->hidden) {
+	interval = 0;
+    }
+    if (interval == tkglPtr->timerRunning
+	    && (!interval || tkglPtr->hiresTimerFlag == tkglPtr->timerHires)) {
+	return;
+    }
+    TkglStopTimer(tkglPtr);
+    if (interval == 0) {
+	return;
+    }
+#ifdef HAVE_TIMERFD
+    if (tkglPtr->hiresTimerFlag) {
+	tkglPtr->timerFd = timerfd_create(CLOCK_MONOTONIC,
+	    TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tkglPtr->timerFd >= 0) {
+	    Tcl_CreateFileHandler(tkglPtr->timerFd, TCL_READABLE,
+		TkglTimerFileProc, tkglPtr);
+	}
+    }
+#endif
+    tkglPtr->timerRunning = interval;
+    tkglPtr->timerHires = tkglPtr->hiresTimerFlag;
+    tkglPtr->timerStart = TkglMonotonicTime();
+    tkglPtr->timerTick = 0;
+    TkglArmTimer(tkglPtr);
+}
+
+/*
+ * Return the time in microseconds from a monotonic clock.  On Linux this
+ * is CLOCK_MONOTONIC, which is also the clock used by timerfd and by the
+ * UST values of GLX_OML_sync_control.
+ */
+
+Tcl_WideInt
+TkglMonotonicTime(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&count);
+    return (Tcl_WideInt) (count.QuadPart / frequency.QuadPart) * 1000000
+	+ (count.QuadPart % frequency.QuadPart) * 1000000
+	/ frequency.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (Tcl_WideInt) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -806,15 +1478,43 @@ Tkgl_Init(
     }
 
     if (Tk_InitStubs(interp, TK_VERSION, 0) == NULL) {
+#ifdef TKGL_USE_EGL
+	/*
+	 * Without Tk, e.g. on a machine with no X server, there are no
+	 * widgets but headless rendering still works.
+	 */
+
+	Tcl_ResetResult(interp);
+	if (Tcl_PkgProvideEx(interp, PACKAGE_NAME, PACKAGE_VERSION,
+		(void *) &tkglStubs) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	return TkglHeadlessInit(interp);
+#else
         return TCL_ERROR;
+#endif
     }
-    if (Tcl_PkgProvideEx(interp, PACKAGE_NAME, PACKAGE_VERSION, NULL) != TCL_OK) {
+    if (Tcl_PkgProvideEx(interp, PACKAGE_NAME, PACKAGE_VERSION,
+	    (void *) &tkglStubs) != TCL_OK) {
 	return TCL_ERROR;
     }
     if (!Tcl_CreateObjCommand(interp, "tkgl", (Tcl_ObjCmdProc *)TkglObjCmd,
 			      NULL, NULL)) {
 	return TCL_ERROR;
     }
+#if defined(TKGL_X11)
+    if (!Tcl_CreateObjCommand(interp, "tkgl::pixelformats",
+	    TkglPixelFormatsObjCmd, NULL, NULL)
+	    || !Tcl_CreateObjCommand(interp, "tkgl::framebudget",
+	    TkglFrameBudgetObjCmd, NULL, NULL)) {
+	return TCL_ERROR;
+    }
+#endif
+#ifdef TKGL_USE_EGL
+    if (TkglHeadlessInit(interp) != TCL_OK) {
+	return TCL_ERROR;
+    }
+#endif
     return TCL_OK;
 }
 
@@ -1148,25 +1848,43 @@ ObjectIsEmpty(Tcl_Obj *objPtr)
 /* 
  * Tkgl_CallCallback
  *
- * Call command with tkgl widget as only argument
+ * Call command with tkgl widget as only argument.  This runs for every
+ * frame, so it avoids allocating.  The argument object holding the name of
+ * the widget command is cached in the widget record, and is only rebuilt
+ * when the command has been renamed.  The command object is the value of
+ * the callback option itself, which Tcl caches as a command reference.
  */
 
 int
 Tkgl_CallCallback(Tkgl *tkgl, Tcl_Obj *cmd)
 {
     int     result;
-    Tcl_Obj *objv[3];
+    const char *name;
+    Tcl_Obj *objv[2];
 
     if (cmd == NULL || tkgl->widgetCmd == NULL)
         return TCL_OK;
 
+    name = Tcl_GetCommandName(tkgl->interp, tkgl->widgetCmd);
+    if (tkgl->widgetNameObj == NULL
+            || strcmp(Tcl_GetString(tkgl->widgetNameObj), name) != 0) {
+        if (tkgl->widgetNameObj) {
+            Tcl_DecrRefCount(tkgl->widgetNameObj);
+        }
+        tkgl->widgetNameObj = Tcl_NewStringObj(name, -1);
+        Tcl_IncrRefCount(tkgl->widgetNameObj);
+        tkgl->stats.widgetNameAllocs++;
+    }
+
+    /*
+     * Hold references while the callback runs, since it may reconfigure
+     * the widget or rename its command.
+     */
+
     objv[0] = cmd;
+    objv[1] = tkgl->widgetNameObj;
     Tcl_IncrRefCount(objv[0]);
-    objv[1] =
-            Tcl_NewStringObj(Tcl_GetCommandName(tkgl->interp, tkgl->widgetCmd),
-            -1);
     Tcl_IncrRefCount(objv[1]);
-    objv[2] = NULL;
     result = Tcl_EvalObjv(tkgl->interp, 2, objv, TCL_EVAL_GLOBAL);
     Tcl_DecrRefCount(objv[1]);
     Tcl_DecrRefCount(objv[0]);
@@ -1179,70 +1897,260 @@ Tkgl_CallCallback(Tkgl *tkgl, Tcl_Obj *cmd)
 /* 
  *----------------------------------------------------------------------
  *
- * Utilities for managing the list of all Tkgl widgets.
+ * Utilities for managing the registry of all Tkgl widgets.
  *
  *----------------------------------------------------------------------
  */
 
-/* 
- * Add a tkgl widget to the top of the linked list.
+/*
+ * The widgets using a context, in the context index.
+ */
+
+typedef struct ContextUsers {
+    int refCount;		/* Number of widgets using the context. */
+    Tkgl *head;			/* First of them. */
+} ContextUsers;
+
+/*
+ * The widgets with an ident, in the ident index.  Several widgets may have
+ * the same ident, and then the one registered last, the head of the list,
+ * is found.
  */
+
+typedef struct IdentUsers {
+    int count;			/* Number of widgets with the ident. */
+    Tkgl *head;			/* The widget which is found. */
+} IdentUsers;
+
 static void
-addToList(Tkgl *t)
+FreeRegistry(
+    void *clientData)
+{
+    ThreadSpecificData *tsdPtr = (ThreadSpecificData *) clientData;
+
+    /* The widgets are gone, and with them all the entries. */
+    Tcl_DeleteHashTable(&tsdPtr->pathTable);
+    Tcl_DeleteHashTable(&tsdPtr->identTable);
+    Tcl_DeleteHashTable(&tsdPtr->contextTable);
+    tsdPtr->initialized = 0;
+}
+
+static ThreadSpecificData *
+GetRegistry(void)
 {
     ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
         Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
-    t->next = tsdPtr->tkglHead;
-    tsdPtr->tkglHead = t;
+
+    if (!tsdPtr->initialized) {
+	Tcl_InitHashTable(&tsdPtr->pathTable, TCL_STRING_KEYS);
+	Tcl_InitHashTable(&tsdPtr->identTable, TCL_STRING_KEYS);
+	Tcl_InitHashTable(&tsdPtr->contextTable, TCL_ONE_WORD_KEYS);
+	Tcl_CreateThreadExitHandler(FreeRegistry, tsdPtr);
+	tsdPtr->initialized = 1;
+    }
+    return tsdPtr;
+}
+
+/*
+ * Add a widget to the ident index.  Empty idents are not indexed.
+ */
+
+static void
+RegisterIdent(
+    Tkgl *t)
+{
+    ThreadSpecificData *tsdPtr = GetRegistry();
+    Tcl_HashEntry *entryPtr;
+    IdentUsers *usersPtr;
+    int isNew;
+
+    if (t->ident == NULL || t->ident[0] == '\0') {
+	return;
+    }
+    entryPtr = Tcl_CreateHashEntry(&tsdPtr->identTable, t->ident, &isNew);
+    if (isNew) {
+	usersPtr = (IdentUsers *) ckalloc(sizeof(IdentUsers));
+	usersPtr->count = 0;
+	usersPtr->head = NULL;
+	Tcl_SetHashValue(entryPtr, usersPtr);
+    } else {
+	usersPtr = (IdentUsers *) Tcl_GetHashValue(entryPtr);
+    }
+    usersPtr->count++;
+    t->prevSameIdent = NULL;
+    t->nextSameIdent = usersPtr->head;
+    if (usersPtr->head) {
+	usersPtr->head->prevSameIdent = t;
+    }
+    usersPtr->head = t;
+    t->identEntry = entryPtr;
+}
+
+static void
+UnregisterIdent(
+    Tkgl *t)
+{
+    IdentUsers *usersPtr;
+
+    if (t->identEntry == NULL) {
+	return;
+    }
+    usersPtr = (IdentUsers *) Tcl_GetHashValue(t->identEntry);
+    if (t->prevSameIdent) {
+	t->prevSameIdent->nextSameIdent = t->nextSameIdent;
+    } else {
+	usersPtr->head = t->nextSameIdent;
+    }
+    if (t->nextSameIdent) {
+	t->nextSameIdent->prevSameIdent = t->prevSameIdent;
+    }
+    t->nextSameIdent = t->prevSameIdent = NULL;
+    if (--usersPtr->count == 0) {
+	ckfree(usersPtr);
+	Tcl_DeleteHashEntry(t->identEntry);
+    }
+    t->identEntry = NULL;
+}
+
+/*
+ * Add a widget to the context index, once it has a context.  Software
+ * widgets have no context which could be shared, and are not indexed.
+ */
+
+static void
+RegisterContext(
+    Tkgl *t)
+{
+    ThreadSpecificData *tsdPtr = GetRegistry();
+    Tcl_HashEntry *entryPtr;
+    ContextUsers *usersPtr;
+    int isNew;
+
+    if (t->registeredContext != NULL || t->context == NULL
+	    || t->pathEntry == NULL) {
+	return;
+    }
+    entryPtr = Tcl_CreateHashEntry(&tsdPtr->contextTable,
+	    (const char *) t->context, &isNew);
+    if (isNew) {
+	usersPtr = (ContextUsers *) ckalloc(sizeof(ContextUsers));
+	usersPtr->refCount = 0;
+	usersPtr->head = NULL;
+	Tcl_SetHashValue(entryPtr, usersPtr);
+    } else {
+	usersPtr = (ContextUsers *) Tcl_GetHashValue(entryPtr);
+    }
+    usersPtr->refCount++;
+    t->prevSameContext = NULL;
+    t->nextSameContext = usersPtr->head;
+    if (usersPtr->head) {
+	usersPtr->head->prevSameContext = t;
+    }
+    usersPtr->head = t;
+    t->registeredContext = (const void *) t->context;
+}
+
+static void
+UnregisterContext(
+    Tkgl *t)
+{
+    ThreadSpecificData *tsdPtr = GetRegistry();
+    Tcl_HashEntry *entryPtr;
+    ContextUsers *usersPtr;
+
+    if (t->registeredContext == NULL) {
+	return;
+    }
+    entryPtr = Tcl_FindHashEntry(&tsdPtr->contextTable,
+	    (const char *) t->registeredContext);
+    usersPtr = (ContextUsers *) Tcl_GetHashValue(entryPtr);
+    if (t->prevSameContext) {
+	t->prevSameContext->nextSameContext = t->nextSameContext;
+    } else {
+	usersPtr->head = t->nextSameContext;
+    }
+    if (t->nextSameContext) {
+	t->nextSameContext->prevSameContext = t->prevSameContext;
+    }
+    t->nextSameContext = t->prevSameContext = NULL;
+    t->registeredContext = NULL;
+    if (--usersPtr->refCount == 0) {
+	ckfree(usersPtr);
+	Tcl_DeleteHashEntry(entryPtr);
+    }
 }
 
 /* 
- * Remove a tkgl widget from the linked list.
+ * Add a tkgl widget to the registry.
+ */
+static void
+addToList(Tkgl *t)
+{
+    ThreadSpecificData *tsdPtr = GetRegistry();
+    int isNew;
+
+    t->pathEntry = Tcl_CreateHashEntry(&tsdPtr->pathTable,
+	    Tk_PathName(t->tkwin), &isNew);
+    Tcl_SetHashValue(t->pathEntry, t);
+    RegisterIdent(t);
+    RegisterContext(t);
+}
+
+/* 
+ * Remove a tkgl widget from the registry.
  */
 static void
 removeFromList(Tkgl *t)
 {
-    ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
-        Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
-    Tkgl   *prev, *cur;
-    for (cur = tsdPtr->tkglHead, prev = NULL; cur; prev = cur, cur = cur->next) {
-        if (t != cur)
-            continue;
-        if (prev) {
-            prev->next = cur->next;
-        } else {
-            tsdPtr->tkglHead = cur->next;
-        }
-        break;
+    if (t->pathEntry == NULL) {
+	return;
     }
-    if (cur)
-        cur->next = NULL;
+    UnregisterContext(t);
+    UnregisterIdent(t);
+    Tcl_DeleteHashEntry(t->pathEntry);
+    t->pathEntry = NULL;
+}
+
+/*
+ * Called after the widget is configured, in case its ident changed.
+ */
+static void
+updateIdent(Tkgl *t)
+{
+    ThreadSpecificData *tsdPtr = GetRegistry();
+    const char *ident = t->ident ? t->ident : "";
+
+    if (t->pathEntry == NULL) {
+	return;
+    }
+    if (t->identEntry != NULL && strcmp(ident, (const char *)
+	    Tcl_GetHashKey(&tsdPtr->identTable, t->identEntry)) == 0) {
+	return;
+    }
+    if (t->identEntry == NULL && ident[0] == '\0') {
+	return;
+    }
+    UnregisterIdent(t);
+    RegisterIdent(t);
 }
 
 /* 
- * Return a pointer to the widget record of the Tkgl with a given pathname.
+ * Return a pointer to the widget record of the Tkgl with a given pathname,
+ * or, if the name does not start with a dot, with a given ident.
  */
 Tkgl *
 FindTkgl(Tkgl *tkgl, const char *ident)
 {
-    ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
-        Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
-    Tkgl   *t;
+    ThreadSpecificData *tsdPtr = GetRegistry();
+    Tcl_HashEntry *entryPtr;
 
     if (ident[0] != '.') {
-        for (t = tsdPtr->tkglHead; t; t = t->next) {
-            if (strcmp(t->ident, ident) == 0)
-                break;
-        }
-    } else {
-        for (t = tsdPtr->tkglHead; t; t = t->next) {
-            const char *pathname = Tk_PathName(t->tkwin);
-
-            if (strcmp(pathname, ident) == 0)
-                break;
-        }
+        entryPtr = Tcl_FindHashEntry(&tsdPtr->identTable, ident);
+        return entryPtr ? ((IdentUsers *) Tcl_GetHashValue(entryPtr))->head
+		: NULL;
     }
-    return t;
+    entryPtr = Tcl_FindHashEntry(&tsdPtr->pathTable, ident);
+    return entryPtr ? (Tkgl *) Tcl_GetHashValue(entryPtr) : NULL;
 }
 
 /* 
@@ -1251,18 +2159,24 @@ FindTkgl(Tkgl *tkgl, const char *ident)
 Tkgl *
 FindTkglWithSameContext(const Tkgl *tkgl)
 {
-    ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
-        Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
-    Tkgl   *t;
+    ThreadSpecificData *tsdPtr = GetRegistry();
+    Tcl_HashEntry *entryPtr;
+    ContextUsers *usersPtr;
 
-    for (t = tsdPtr->tkglHead; t != NULL; t = t->next) {
-        if (t == tkgl)
-            continue;
-        if ((void *)t->context == (void *)tkgl->context) {
-            return t;
-        }
+    if (tkgl->context == NULL) {
+	/* Software widgets have no context which could be shared. */
+	return NULL;
+    }
+    entryPtr = Tcl_FindHashEntry(&tsdPtr->contextTable,
+	    (const char *) tkgl->context);
+    if (entryPtr == NULL) {
+	return NULL;
     }
-    return NULL;
+    usersPtr = (ContextUsers *) Tcl_GetHashValue(entryPtr);
+    if (usersPtr->head != tkgl) {
+	return usersPtr->head;
+    }
+    return tkgl->nextSameContext;
 }
 
 /*
@@ -1307,6 +2221,7 @@ TkglFrustum(const Tkgl *tkgl, GLdouble left, GLdouble right,
       }
     }
 
+    TkglTileBounds(tkgl, &left, &right, &bottom, &top);
     glFrustum(left + eyeShift, right + eyeShift, bottom, top, zNear, zFar);
     glTranslated(-eyeShift, 0, 0);
 }
@@ -1342,10 +2257,114 @@ TkglOrtho(const Tkgl *tkgl, GLdouble left, GLdouble right,
       }
     }
 
+    TkglTileBounds(tkgl, &left, &right, &bottom, &top);
     glOrtho(left + eyeShift, right + eyeShift, bottom, top, zNear, zFar);
     glTranslated(-eyeShift, 0, 0);
 }
 
+/*
+ * Return the performance counters of a widget as a dict.
+ */
+
+static Tcl_Obj *
+TkglGetStats(const Tkgl *tkglPtr)
+{
+    Tcl_Obj *dictObj = Tcl_NewDictObj();
+
+#define ADD_STAT(name, value) \
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj(name, -1), \
+	Tcl_NewWideIntObj(value))
+    ADD_STAT("frames", tkglPtr->stats.frames);
+    ADD_STAT("reshapes", tkglPtr->stats.reshapes);
+    ADD_STAT("coalescedresizes", tkglPtr->stats.coalescedResizes);
+    ADD_STAT("timerticks", tkglPtr->stats.timerTicks);
+    ADD_STAT("skippedticks", tkglPtr->stats.skippedTicks);
+    ADD_STAT("widgetnameallocs", tkglPtr->stats.widgetNameAllocs);
+    ADD_STAT("contextswitches", tkglPtr->stats.contextSwitches);
+    ADD_STAT("elidedswitches", tkglPtr->stats.elidedSwitches);
+    ADD_STAT("suppressedframes", tkglPtr->stats.suppressedFrames);
+    ADD_STAT("deferredframes", tkglPtr->stats.deferredFrames);
+    ADD_STAT("partialpresents", tkglPtr->stats.partialPresents);
+#undef ADD_STAT
+    return dictObj;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglDamageObjCmd --
+ *
+ *	Implements the damage subcommand:
+ *
+ *	    pathName damage
+ *	    pathName damage add x y width height
+ *
+ *	Without arguments it returns a list of {x y width height} rectangles
+ *	in OpenGL window coordinates.  In the display callback these are the
+ *	parts of the widget which the redraw has to repair, and the callback
+ *	may scissor to them.  Elsewhere they are the damage which has
+ *	accumulated for the next redraw.  Expose events add damage, while
+ *	resizing and postredisplay damage the whole widget.  With add, the
+ *	application damages a rectangle itself and a redraw is scheduled.
+ *
+ *	When a GLX redraw repairs only part of a double buffered widget,
+ *	swapbuffers presents just the damaged rectangles with
+ *	GLX_MESA_copy_sub_buffer.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+TkglDamageObjCmd(
+    Tkgl *tkglPtr,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[])
+{
+    static const char *const damageOptions[] = {"add", NULL};
+    const TkglDamage *damagePtr;
+    Tcl_Obj *listObj, *rectObj[4];
+    int rect[4], i, j, option;
+
+    if (objc > 2) {
+	if (Tcl_GetIndexFromObjStruct(interp, objv[2], damageOptions,
+		sizeof(char *), "option", 0, &option) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (objc != 7) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "x y width height");
+	    return TCL_ERROR;
+	}
+	for (i = 0; i < 4; i++) {
+	    if (Tcl_GetIntFromObj(interp, objv[3 + i], &rect[i]) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	}
+	TkglPostDamage(tkglPtr, rect);
+	return TCL_OK;
+    }
+    damagePtr = tkglPtr->drawing ? &tkglPtr->frameDamage : &tkglPtr->damage;
+    listObj = Tcl_NewListObj(0, NULL);
+    if (damagePtr->count < 0) {
+	rectObj[0] = Tcl_NewIntObj(0);
+	rectObj[1] = Tcl_NewIntObj(0);
+	rectObj[2] = Tcl_NewIntObj(tkglPtr->width);
+	rectObj[3] = Tcl_NewIntObj(tkglPtr->height);
+	Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewListObj(4, rectObj));
+    }
+    for (i = 0; i < damagePtr->count; i++) {
+	for (j = 0; j < 4; j++) {
+	    rectObj[j] = Tcl_NewIntObj(damagePtr->rects[i][j]);
+	}
+	Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewListObj(4, rectObj));
+    }
+    Tcl_SetObjResult(interp, listObj);
+    return TCL_OK;
+}
+
 static int
 GetTkglFromObj(Tcl_Interp *interp, Tcl_Obj *obj, Tkgl **tkglPtr)
 {
@@ -1361,6 +2380,108 @@ GetTkglFromObj(Tcl_Interp *interp, Tcl_Obj *obj, Tkgl **tkglPtr)
     *tkglPtr = (Tkgl *) info.objClientData;
     return TCL_OK;
 }
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * The public C interface.
+ *
+ *	These functions are exported to other extensions through the stubs
+ *	table declared in tkgl.decls.  They allow compiled code to find a
+ *	widget by its path name and to draw into it from C callbacks, which
+ *	TkglDisplay and the animation timer call directly instead of
+ *	evaluating the -displaycommand, -reshapecommand and -timercommand
+ *	scripts.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Tkgl_GetWidgetFromName(
+    Tcl_Interp *interp,
+    const char *pathName,
+    Tkgl **tkglPtrPtr)
+{
+    Tcl_Obj *nameObj = Tcl_NewStringObj(pathName, TCL_INDEX_NONE);
+    int result;
+
+    Tcl_IncrRefCount(nameObj);
+    result = GetTkglFromObj(interp, nameObj, tkglPtrPtr);
+    Tcl_DecrRefCount(nameObj);
+    return result;
+}
+
+void
+Tkgl_PostRedisplay(
+    Tkgl *tkglPtr)
+{
+    TkglPostRedisplay(tkglPtr);
+}
+
+int
+Tkgl_Width(
+    const Tkgl *tkglPtr)
+{
+    return tkglPtr->width;
+}
+
+int
+Tkgl_Height(
+    const Tkgl *tkglPtr)
+{
+    return tkglPtr->height;
+}
+
+/*
+ * Register a C function which is called to draw the widget, in place of
+ * the -displaycommand.  Passing NULL restores the Tcl callback.
+ */
+
+void
+Tkgl_SetDisplayFunc(
+    Tkgl *tkglPtr,
+    Tkgl_Callback *proc,
+    void *clientData)
+{
+    tkglPtr->displayFunc = proc;
+    tkglPtr->displayData = clientData;
+    TkglPostRedisplay(tkglPtr);
+}
+
+/*
+ * Register a C function which is called when the widget changes size, in
+ * place of the -reshapecommand.  It is called before the next redraw so
+ * that it sees the current size.
+ */
+
+void
+Tkgl_SetReshapeFunc(
+    Tkgl *tkglPtr,
+    Tkgl_Callback *proc,
+    void *clientData)
+{
+    tkglPtr->reshapeFunc = proc;
+    tkglPtr->reshapeData = clientData;
+    tkglPtr->reshapePending = True;
+    TkglPostRedisplay(tkglPtr);
+}
+
+/*
+ * Register a C function which is called on each tick of the animation
+ * timer, in place of the -timercommand.  The timer runs while a timer
+ * function or command is set and -time is positive.
+ */
+
+void
+Tkgl_SetTimerFunc(
+    Tkgl *tkglPtr,
+    Tkgl_Callback *proc,
+    void *clientData)
+{
+    tkglPtr->timerFunc = proc;
+    tkglPtr->timerData = clientData;
+    TkglUpdateTimer(tkglPtr);
+}
 
     
 #ifdef __cplusplus
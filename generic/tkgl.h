@@ -25,10 +25,11 @@ typedef int Tcl_Size;
 #include "tkglPlatform.h"
 
 /*
- * Forward declarations
+ * The public functions exported through the stubs table, together with
+ * the forward declaration of the widget record.
  */
 
-typedef struct Tkgl Tkgl;
+#include "tkglDecls.h"
 
 /*
  * Enum used for the -profile option to specify an OpenGL profile.
@@ -38,28 +39,223 @@ enum profile {
     PROFILE_LEGACY, PROFILE_3_2, PROFILE_4_1, PROFILE_SYSTEM
 };
 
+/*
+ * Enum used for the -offscreen option, which selects where an offscreen
+ * widget draws.
+ */
+
+enum offscreen {
+    OFFSCREEN_NONE, OFFSCREEN_FBO
+};
+
+/*
+ * Enum used for the -formatpolicy option, which says how to choose among
+ * the pixel formats that satisfy the requested minimums.
+ */
+
+enum formatPolicy {
+    FORMAT_POLICY_BEST, FORMAT_POLICY_CHEAPEST, FORMAT_POLICY_WEIGHTED
+};
+
+
+/*
+ * Counters which are reported by the stats widget command.
+ */
+
+typedef struct TkglStats {
+    Tcl_WideInt frames;		/* Calls to TkglDisplay which drew. */
+    Tcl_WideInt reshapes;	/* Reshapes performed by TkglDisplay. */
+    Tcl_WideInt coalescedResizes; /* ConfigureNotify events which were
+				 * merged into a later reshape. */
+    Tcl_WideInt timerTicks;	/* Calls to the timer callback. */
+    Tcl_WideInt skippedTicks;	/* Timer ticks which were missed and folded
+				 * into a later call. */
+    Tcl_WideInt widgetNameAllocs; /* Widget name objects built for the
+				 * callbacks, once and again after each
+				 * rename of the widget command. */
+    Tcl_WideInt contextSwitches; /* Calls to Tkgl_MakeCurrent which changed
+				 * the current binding. */
+    Tcl_WideInt elidedSwitches;	/* Calls which found the widget already
+				 * current and did nothing.  GLX only. */
+    Tcl_WideInt suppressedFrames; /* Redraws which were skipped because the
+				 * widget could not be seen. */
+    Tcl_WideInt deferredFrames;	/* Redraws which the frame clock put off
+				 * to its next tick to keep within the
+				 * frame budget.  GLX only. */
+    Tcl_WideInt partialPresents; /* Frames which were presented by copying
+				 * the damaged rectangles.  GLX only. */
+} TkglStats;
+
+/*
+ * The parts of a widget which need to be redrawn, in OpenGL window
+ * coordinates, with the origin at the bottom left, so that they can be
+ * passed to glScissor.  A count of -1 means the whole widget.  When there
+ * are more than TKGL_MAX_DAMAGE rectangles they are merged into one.
+ */
+
+#define TKGL_MAX_DAMAGE 8
+
+typedef struct TkglDamage {
+    int count;
+    int rects[TKGL_MAX_DAMAGE][4];	/* x, y, width, height */
+} TkglDamage;
+
+/*
+ * Entry points for buffer objects and fences.  Not every OpenGL library
+ * exports these, so they are looked up at runtime by TkglGetBufferProcs.
+ */
+
+#ifndef APIENTRY
+#  define APIENTRY
+#endif
+
+typedef struct __GLsync *TkglSync;
+typedef void (APIENTRY TkglGenBuffersProc)(GLsizei n, GLuint *buffers);
+typedef void (APIENTRY TkglDeleteBuffersProc)(GLsizei n,
+					      const GLuint *buffers);
+typedef void (APIENTRY TkglBindBufferProc)(GLenum target, GLuint buffer);
+typedef void (APIENTRY TkglBufferDataProc)(GLenum target, GLsizeiptr size,
+					   const void *data, GLenum usage);
+typedef void *(APIENTRY TkglMapBufferProc)(GLenum target, GLenum access);
+typedef GLboolean (APIENTRY TkglUnmapBufferProc)(GLenum target);
+typedef TkglSync (APIENTRY TkglFenceSyncProc)(GLenum condition,
+					      GLbitfield flags);
+typedef GLenum (APIENTRY TkglClientWaitSyncProc)(TkglSync sync,
+						 GLbitfield flags,
+						 GLuint64 timeout);
+typedef void (APIENTRY TkglDeleteSyncProc)(TkglSync sync);
+
+typedef struct TkglBufferProcs {
+    TkglGenBuffersProc *genBuffers;
+    TkglDeleteBuffersProc *deleteBuffers;
+    TkglBindBufferProc *bindBuffer;
+    TkglBufferDataProc *bufferData;
+    TkglMapBufferProc *mapBuffer;
+    TkglUnmapBufferProc *unmapBuffer;
+    TkglFenceSyncProc *fenceSync;
+    TkglClientWaitSyncProc *clientWaitSync;
+    TkglDeleteSyncProc *deleteSync;
+    int hasSync;		/* The context supports fences. */
+} TkglBufferProcs;
+
+/*
+ * Entry points for framebuffer objects, looked up at runtime by
+ * TkglGetFramebufferProcs.
+ */
+
+typedef void (APIENTRY TkglGenFramebuffersProc)(GLsizei n,
+						GLuint *framebuffers);
+typedef void (APIENTRY TkglDeleteFramebuffersProc)(GLsizei n,
+						   const GLuint *framebuffers);
+typedef void (APIENTRY TkglBindFramebufferProc)(GLenum target,
+						GLuint framebuffer);
+typedef void (APIENTRY TkglFramebufferRenderbufferProc)(GLenum target,
+	GLenum attachment, GLenum renderbufferTarget, GLuint renderbuffer);
+typedef GLenum (APIENTRY TkglCheckFramebufferStatusProc)(GLenum target);
+typedef void (APIENTRY TkglGenRenderbuffersProc)(GLsizei n,
+						 GLuint *renderbuffers);
+typedef void (APIENTRY TkglDeleteRenderbuffersProc)(GLsizei n,
+	const GLuint *renderbuffers);
+typedef void (APIENTRY TkglBindRenderbufferProc)(GLenum target,
+						 GLuint renderbuffer);
+typedef void (APIENTRY TkglRenderbufferStorageProc)(GLenum target,
+	GLenum internalFormat, GLsizei width, GLsizei height);
+
+typedef struct TkglFramebufferProcs {
+    TkglGenFramebuffersProc *genFramebuffers;
+    TkglDeleteFramebuffersProc *deleteFramebuffers;
+    TkglBindFramebufferProc *bindFramebuffer;
+    TkglFramebufferRenderbufferProc *framebufferRenderbuffer;
+    TkglCheckFramebufferStatusProc *checkFramebufferStatus;
+    TkglGenRenderbuffersProc *genRenderbuffers;
+    TkglDeleteRenderbuffersProc *deleteRenderbuffers;
+    TkglBindRenderbufferProc *bindRenderbuffer;
+    TkglRenderbufferStorageProc *renderbufferStorage;
+} TkglFramebufferProcs;
+
+/*
+ * A framebuffer object with color and depth/stencil renderbuffers, whose
+ * formats are chosen by TkglFramebufferInit.
+ */
+
+typedef struct TkglFramebuffer {
+    const TkglFramebufferProcs *procs;
+				/* Functions of the context which owns the
+				 * framebuffer, or NULL before it is
+				 * initialized. */
+    GLenum colorFormat;		/* Format of the color renderbuffer. */
+    GLenum depthFormat;		/* Format of the depth renderbuffer, or 0
+				 * for none. */
+    int hasStencil;		/* The depth renderbuffer is also the stencil
+				 * attachment. */
+    GLuint fbo;			/* The framebuffer object, or 0. */
+    GLuint color;		/* Color renderbuffer. */
+    GLuint depth;		/* Depth and stencil renderbuffer, or 0. */
+    int width, height;		/* Size of the renderbuffers. */
+} TkglFramebuffer;
+
+/*
+ * The tile being drawn by the renderlarge command.  The image is drawn
+ * in tiles as though the widget had the size of the image, and the
+ * frustum and ortho commands narrow the projection to the current tile.
+ */
+
+typedef struct TkglTile {
+    int imageWidth, imageHeight; /* Size of the whole image. */
+    int x, y;			/* Bottom left corner of the tile in the
+				 * image, in OpenGL window coordinates. */
+    int width, height;		/* Size of the tile. */
+} TkglTile;
+
+/*
+ * The number of asynchronous readbacks which a widget can have in flight.
+ * Collecting each frame two frames after it was drawn needs three.
+ */
+
+#define TKGL_READBACK_DEPTH 4
 
 /*
  * The Tkgl widget record.  Each Tkgl widget maintains one of these.
  */
 
 typedef struct Tkgl {
-    struct Tkgl *next;          /* Next in a linked list of all tkgl widgets.*/
+    Tcl_HashEntry *pathEntry;   /* Entries in the indexes of all tkgl */
+    Tcl_HashEntry *identEntry;  /* widgets, or NULL, see tkgl.c */
+    struct Tkgl *nextSameIdent; /* Other widgets with the same ident */
+    struct Tkgl *prevSameIdent;
+    const void *registeredContext; /* Key in the context index, or NULL */
+    struct Tkgl *nextSameContext; /* Other widgets using the same context */
+    struct Tkgl *prevSameContext;
     Tk_Window tkwin;		/* Window identifier for the tkgl widget.*/
     Display *display;		/* X token for the window's display. */
     Tcl_Interp *interp;		/* Interpreter associated with widget. */
     Tcl_Command widgetCmd;	/* Token for tkgl's widget command. */
     Tk_OptionTable optionTable; /* Token representing the option specs. */
     int updatePending;		/* A call to TkglDisplay has been scheduled. */
+    int reshapePending;		/* The size changed since the last redraw. */
+    TkglStats stats;		/* Counters for the stats command. */
+    struct TkglReadbackRing *readback; /* Asynchronous readbacks, or NULL */
+    struct TkglRecorder *recorder; /* Active recording, or NULL */
+    struct TkglShare *share;	/* Shared memory frame ring, or NULL */
+    struct TkglShareGroup *shareGroup; /* Widgets sharing objects with this
+				 * one, see tkglGroup.c */
+    TkglTile *tile;		/* Tile being drawn by renderlarge, or NULL */
     int x, y;                   /* Upper left corner of Tkgl widget */
     int width;	                /* Width of tkgl widget in pixels. */
     int height;	                /* Height of tkgl widget in pixels. */
     int setGrid;                /* positive is grid size for window manager */
-    int contextTag;             /* contexts with same tag share display lists */
+    int contextTag;             /* contexts with same tag share display lists,
+                                 * the tag of the share group */
     XVisualInfo *visInfo;       /* Visual info of the widget */
     Tk_Cursor cursor;           /* The widget's cursor */
     int     timerInterval;      /* Time interval for timer in milliseconds */
     Tcl_TimerToken timerHandler;  /* Token for tkgl's timer handler */
+    Bool    hiresTimerFlag;     /* Use a timerfd for the timer if possible */
+    int     timerFd;            /* The timerfd driving the timer, or -1 */
+    int     timerRunning;       /* Interval of the running timer, or 0 */
+    Bool    timerHires;         /* hiresTimerFlag when it was started */
+    Tcl_WideInt timerStart;     /* Monotonic time of timer tick 0 */
+    Tcl_WideInt timerTick;      /* Index of the last tick delivered */
     Bool    rgbaFlag;           /* configuration flags (ala GLX parameters) */
     int     rgbaRed;
     int     rgbaGreen;
@@ -89,6 +285,31 @@ typedef struct Tkgl {
     Bool    fullscreenFlag;
     Bool    pBufferFlag;
     Bool    largestPbufferFlag;
+    enum    offscreen offscreen;
+    TkglFramebuffer *framebuffer; /* Render target for -offscreen fbo and
+                                   * the software renderer */
+    Bool    softwareFlag;       /* Render in software, see tkglEGL.c */
+    enum    formatPolicy formatPolicy;
+    Bool    lazyFlag;           /* Create the context when first needed */
+    Bool    poolFlag;           /* Share a context with widgets which have
+                                 * the same pixel format */
+    int     priority;           /* Redraw order among widgets which are
+                                 * equally visible, higher first */
+    Bool    hasFocus;           /* The widget has the keyboard focus */
+    Bool    obscured;           /* The X server reported the window as
+                                 * fully obscured */
+    Bool    hidden;             /* Drawing and the timer are suspended
+                                 * since the widget can't be seen */
+    Bool    redrawSuppressed;   /* A redraw was skipped while hidden */
+    TkglDamage damage;          /* Damage accumulated for the next redraw */
+    TkglDamage frameDamage;     /* Damage which the redraw in progress is
+                                 * repairing */
+    Bool    drawing;            /* TkglDisplay is running the callbacks */
+    Bool    contextPending;     /* -lazy: the context is not created yet */
+    Bool    callbacksPending;   /* -lazy: the create and reshape callbacks
+                                 * are queued */
+    Tcl_Obj *formatInfo;        /* How the pixel format was chosen, as
+                                 * reported by the formatinfo command */
     const char *shareList;      /* name (ident) of Tkgl to share dlists with */
     const char *shareContext;   /* name (ident) to share OpenGL context with */
     const char *ident;          /* User's identification string */
@@ -98,6 +319,15 @@ typedef struct Tkgl {
     Tcl_Obj *reshapeProc;       /* Callback when window size changes */
     Tcl_Obj *destroyProc;       /* Callback when widget is destroyed */
     Tcl_Obj *timerProc;         /* Callback when widget is idle */
+    Tcl_Obj *widgetNameObj;     /* Cached callback argument: the name of
+                                 * the widget command */
+    Tkgl_Callback *displayFunc; /* C callbacks registered through the stubs
+                                 * table.  When set they are called instead */
+    void    *displayData;       /* of the corresponding Tcl callbacks. */
+    Tkgl_Callback *reshapeFunc;
+    void    *reshapeData;
+    Tkgl_Callback *timerFunc;
+    void    *timerData;
     Window  overlayWindow;      /* The overlay window, or 0 */
     Tcl_Obj *overlayDisplayProc;     /* Overlay redraw proc */
     Bool    overlayUpdatePending;    /* Should overlay be redrawn? */
@@ -127,7 +357,24 @@ typedef struct Tkgl {
     GLXPbuffer pbuf;
     Window surface;             /* rendering surface for the context */
     GLXFBConfig fbcfg;          /* cached FBConfig */
-    Tcl_TimerToken timerToken;
+    GLint   poolFramebuffer;    /* -pool: the state of the widget, saved */
+    GLint   poolDrawBuffer;     /* while another widget renders with the */
+    GLint   poolReadBuffer;     /* context, see Tkgl_MakeCurrent */
+    GLint   poolViewport[4];
+    Bool    poolStateSaved;
+    Bool    poolProcsKnown;     /* poolProcs has been looked up */
+    const TkglFramebufferProcs *poolProcs; /* framebuffer functions of the
+                                 * pooled context, or NULL */
+    struct FrameClock *frameClock; /* clock on which a redraw is queued */
+    struct Tkgl *nextFrame;     /* next widget queued on the same clock */
+    Bool    frameDeferred;      /* the last tick ran out of time before
+                                 * drawing this widget */
+    Bool    partialPresent;     /* the last frame was presented with
+                                 * glXCopySubBufferMESA, see bufferage */
+    GLuint  photoPbo;           /* pixel pack buffer used by takephoto */
+    size_t  photoPboSize;       /* size of photoPbo in bytes */
+    struct TkglSoftware *software; /* software renderer, used in place of
+                                    * the GLX context if not NULL */
 
 #elif defined(TKGL_NSOPENGL)
     NSOpenGLContext *context;
@@ -138,6 +385,14 @@ typedef struct Tkgl {
 #endif
 } Tkgl;
 
+/*
+ * True for widgets which draw into a pbuffer or a framebuffer object
+ * rather than into their window, and may draw while unmapped.
+ */
+
+#define TkglIsOffscreen(tkglPtr) \
+    ((tkglPtr)->pBufferFlag || (tkglPtr)->offscreen != OFFSCREEN_NONE)
+
 /* The typeMasks used in option specs. */
 
 #define GEOMETRY_MASK 0x1       /* widget geometry */
@@ -190,6 +445,115 @@ typedef struct Tkgl {
 Tkgl* FindTkgl(Tkgl *tkgl, const char *ident);
 Tkgl* FindTkglWithSameContext(const Tkgl *tkgl);
 int   Tkgl_CallCallback(Tkgl *tkgl, Tcl_Obj *cmd);
+void  TkglDisplay(void *clientData);
+int   TkglCreateLazyContext(Tkgl *tkglPtr);
+Tcl_WideInt TkglMonotonicTime(void);
+
+/*
+ * Declarations of the pixel conversion kernels defined in tkglPixels.c.
+ */
+
+void  TkglFlipRows(unsigned char *dst, const unsigned char *src,
+		   size_t rowBytes, int height);
+int   TkglConvertPixels(unsigned char *dst, GLenum dstFormat,
+			const unsigned char *src, GLenum srcFormat,
+			size_t count);
+void  TkglExpandColorIndex(const Tkgl *tkglPtr, unsigned char *dst,
+			   const GLuint *src, size_t count);
+int   TkglPutPhotoPixels(Tkgl *tkglPtr, Tk_PhotoHandle photo,
+			 const unsigned char *pixels, GLenum format,
+			 int x, int y, int width, int height);
+
+/*
+ * Declarations of the asynchronous readback functions defined in
+ * tkglReadback.c.
+ */
+
+const TkglBufferProcs *TkglGetBufferProcs(void);
+int   TkglReadbackStart(Tkgl *tkglPtr, int x, int y, int width, int height);
+int   TkglReadbackReady(Tkgl *tkglPtr, int id);
+const unsigned char *TkglReadbackMap(Tkgl *tkglPtr, int id, int *widthPtr,
+				     int *heightPtr);
+void  TkglReadbackRelease(Tkgl *tkglPtr, int id);
+void  TkglReadbackFree(Tkgl *tkglPtr);
+int   TkglReadbackObjCmd(Tkgl *tkglPtr, Tcl_Interp *interp, int objc,
+			 Tcl_Obj *const objv[]);
+
+/*
+ * Declarations of the recording functions defined in tkglRecord.c.
+ */
+
+typedef struct TkglPNGWriter TkglPNGWriter;
+
+TkglPNGWriter *TkglPNGOpen(const char *fileName, int width, int height);
+int   TkglPNGWriteRows(TkglPNGWriter *pngPtr, const unsigned char *pixels,
+		       int count);
+int   TkglPNGClose(TkglPNGWriter *pngPtr);
+void  TkglRecordFrame(Tkgl *tkglPtr);
+Tcl_Obj *TkglRecordStop(Tkgl *tkglPtr, int collect);
+int   TkglRecordObjCmd(Tkgl *tkglPtr, Tcl_Interp *interp, int objc,
+		       Tcl_Obj *const objv[]);
+
+/*
+ * Declarations of the framebuffer object functions defined in
+ * tkglFramebuffer.c.
+ */
+
+const TkglFramebufferProcs *TkglGetFramebufferProcs(void);
+int   TkglFramebufferInit(Tcl_Interp *interp, TkglFramebuffer *fbPtr,
+			    const Tkgl *tkglPtr);
+int   TkglFramebufferResize(Tcl_Interp *interp, TkglFramebuffer *fbPtr,
+			    int width, int height);
+void  TkglFramebufferFree(TkglFramebuffer *fbPtr);
+void  TkglOffscreenBind(const Tkgl *tkglPtr);
+void  TkglOffscreenFree(Tkgl *tkglPtr);
+
+#if defined(TKGL_X11)
+/* The tkgl::pixelformats and tkgl::framebudget commands, in tkglGLX.c */
+int   TkglPixelFormatsObjCmd(void *clientData, Tcl_Interp *interp, int objc,
+		Tcl_Obj *const objv[]);
+int   TkglFrameBudgetObjCmd(void *clientData, Tcl_Interp *interp, int objc,
+		Tcl_Obj *const objv[]);
+#endif
+
+#ifdef TKGL_USE_EGL
+/* Headless and software rendering with EGL, in tkglEGL.c */
+int   TkglHeadlessInit(Tcl_Interp *interp);
+int   TkglSoftwareCreate(Tkgl *tkglPtr, Tkgl *shareWith);
+void  TkglSoftwareMakeCurrent(const Tkgl *tkglPtr);
+void  TkglSoftwareRelease(void);
+void  TkglSoftwarePresent(const Tkgl *tkglPtr);
+void  TkglSoftwareFree(Tkgl *tkglPtr);
+#endif
+
+/*
+ * Declarations of the tiled rendering functions defined in tkglTile.c.
+ */
+
+void  TkglTileBounds(const Tkgl *tkglPtr, GLdouble *leftPtr,
+		     GLdouble *rightPtr, GLdouble *bottomPtr,
+		     GLdouble *topPtr);
+int   TkglRenderLargeObjCmd(Tkgl *tkglPtr, Tcl_Interp *interp, int objc,
+			    Tcl_Obj *const objv[]);
+
+/*
+ * Declarations of the share group functions defined in tkglGroup.c.
+ */
+
+int   TkglGroupPartner(Tkgl *tkglPtr, Tkgl **partnerPtrPtr);
+void  TkglGroupJoin(Tkgl *tkglPtr, Tkgl *partnerPtr);
+void  TkglGroupLeave(Tkgl *tkglPtr);
+int   TkglResourceObjCmd(Tkgl *tkglPtr, Tcl_Interp *interp, int objc,
+			 Tcl_Obj *const objv[]);
+
+/*
+ * Declarations of the frame sharing functions defined in tkglShare.c.
+ */
+
+void  TkglShareFrame(Tkgl *tkglPtr);
+Tcl_Obj *TkglShareStop(Tkgl *tkglPtr, int collect);
+int   TkglShareObjCmd(Tkgl *tkglPtr, Tcl_Interp *interp, int objc,
+		      Tcl_Obj *const objv[]);
 
 /*
  * The functions declared below constitute the interface
@@ -237,11 +601,24 @@ void Tkgl_MakeCurrent(const Tkgl *tkglPtr);
  *
  * Called by the GL Client after updating the image.  If the Tkgl
  * is double-buffered it interchanges the front and back framebuffers.
- * otherwise it calls GLFlush.
+ * otherwise it calls GLFlush.  It also just flushes while renderlarge is
+ * drawing tiles, which are not in the window's buffers.
  */
 
 void Tkgl_SwapBuffers(const Tkgl *tkglPtr);
 
+/*
+ * Tkgl_BufferAge
+ *
+ * Returns the number of frames since the back buffer of the widget was
+ * the front buffer, as defined by GLX_EXT_buffer_age, or 0 if its contents
+ * are unknown.  An application which knows the damage of the last few
+ * frames can then redraw only what is stale.  The widget must be current;
+ * the query does not make it current.
+ */
+
+int Tkgl_BufferAge(const Tkgl *tkglPtr);
+
 /*
  * TkglUpdate
  *
@@ -253,6 +630,26 @@ void Tkgl_SwapBuffers(const Tkgl *tkglPtr);
 
 void Tkgl_Update(const Tkgl *tkglPtr);
 
+/*
+ * Tkgl_ScheduleRedisplay
+ *
+ * Called by TkglPostRedisplay to arrange for TkglDisplay to be called
+ * for the widget.  With GLX the widget is queued on a frame clock shared by
+ * all widgets on the same display, which draws the queued widgets once per
+ * refresh interval.  The other platforms use an idle handler.
+ */
+
+void Tkgl_ScheduleRedisplay(Tkgl *tkglPtr);
+
+/*
+ * Tkgl_CancelRedisplay
+ *
+ * Cancels a redraw which was scheduled by Tkgl_ScheduleRedisplay.  It is
+ * harmless to call this when no redraw is scheduled.
+ */
+
+void Tkgl_CancelRedisplay(Tkgl *tkglPtr);
+
 /*
  * Tkgl_GetExtensions
  *
@@ -264,6 +661,16 @@ void Tkgl_Update(const Tkgl *tkglPtr);
 
 const char* Tkgl_GetExtensions(Tkgl *tkglPtr);
 
+/*
+ * Tkgl_GetProcAddress
+ *
+ * Returns the address of an OpenGL function which may not be exported by
+ * the OpenGL library, or NULL if it is not available.  A non-NULL result
+ * does not imply that the current context supports the function.
+ */
+
+void *Tkgl_GetProcAddress(const char *name);
+
 void Tkgl_FreeResources(Tkgl *tkglPtr);
 int Tkgl_TakePhoto(Tkgl *tkglPtr, Tk_PhotoHandle photo);
 int Tkgl_CopyContext(const Tkgl *from, const Tkgl *to, unsigned mask);
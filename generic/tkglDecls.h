@@ -0,0 +1,141 @@
+/*
+ * tkglDecls.h --
+ *
+ *	Declarations of the functions which Tkgl exports to other extensions
+ *	through its stubs table.  An extension which uses them should define
+ *	USE_TKGL_STUBS, call Tkgl_InitStubs from its initialization function
+ *	and link with the Tkgl stubs library.  Drawing code can then register
+ *	C callbacks with a widget, which TkglDisplay calls directly instead of
+ *	evaluating a Tcl command.
+ *
+ * Copyright (C) 2024, Marc Culler, Nathan Dunfield, Matthias Goerner
+ *
+ * This file is part of the TkGL project.  TkGL is licensed under the Tcl
+ * license.  The terms of the license are described in the file
+ * "license.terms" which should be included with this distribution.
+ */
+
+#ifndef _TKGLDECLS
+#define _TKGLDECLS
+
+#include "tcl.h"
+
+#ifdef BUILD_Tkgl
+#   undef TCL_STORAGE_CLASS
+#   define TCL_STORAGE_CLASS DLLEXPORT
+#endif
+
+/*
+ * The widget record is opaque to users of the stubs table.
+ */
+
+typedef struct Tkgl Tkgl;
+
+/*
+ * The signature of the C callbacks which can be registered with
+ * Tkgl_SetDisplayFunc, Tkgl_SetReshapeFunc and Tkgl_SetTimerFunc.
+ */
+
+typedef void (Tkgl_Callback) (Tkgl *tkglPtr, void *clientData);
+
+#ifdef USE_TKGL_STUBS
+#ifdef __cplusplus
+extern "C" {
+#endif
+const char *Tkgl_InitStubs(Tcl_Interp *interp, const char *version,
+	int exact);
+#ifdef __cplusplus
+}
+#endif
+#else
+#define Tkgl_InitStubs(interp, version, exact) \
+	Tcl_PkgRequire(interp, "Tkgl", version, exact)
+#endif
+
+/* !BEGIN!: Do not edit below this line. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Exported function declarations:
+ */
+
+/* 0 */
+EXTERN int		Tkgl_GetWidgetFromName(Tcl_Interp *interp,
+				const char *pathName, Tkgl **tkglPtrPtr);
+/* 1 */
+EXTERN void		Tkgl_MakeCurrent(const Tkgl *tkglPtr);
+/* 2 */
+EXTERN void		Tkgl_SwapBuffers(const Tkgl *tkglPtr);
+/* 3 */
+EXTERN void		Tkgl_PostRedisplay(Tkgl *tkglPtr);
+/* 4 */
+EXTERN int		Tkgl_Width(const Tkgl *tkglPtr);
+/* 5 */
+EXTERN int		Tkgl_Height(const Tkgl *tkglPtr);
+/* 6 */
+EXTERN void		Tkgl_SetDisplayFunc(Tkgl *tkglPtr,
+				Tkgl_Callback *proc, void *clientData);
+/* 7 */
+EXTERN void		Tkgl_SetReshapeFunc(Tkgl *tkglPtr,
+				Tkgl_Callback *proc, void *clientData);
+/* 8 */
+EXTERN void		Tkgl_SetTimerFunc(Tkgl *tkglPtr, Tkgl_Callback *proc,
+				void *clientData);
+
+typedef struct TkglStubs {
+    int magic;
+    void *hooks;
+
+    int (*tkgl_GetWidgetFromName) (Tcl_Interp *interp, const char *pathName, Tkgl **tkglPtrPtr); /* 0 */
+    void (*tkgl_MakeCurrent) (const Tkgl *tkglPtr); /* 1 */
+    void (*tkgl_SwapBuffers) (const Tkgl *tkglPtr); /* 2 */
+    void (*tkgl_PostRedisplay) (Tkgl *tkglPtr); /* 3 */
+    int (*tkgl_Width) (const Tkgl *tkglPtr); /* 4 */
+    int (*tkgl_Height) (const Tkgl *tkglPtr); /* 5 */
+    void (*tkgl_SetDisplayFunc) (Tkgl *tkglPtr, Tkgl_Callback *proc, void *clientData); /* 6 */
+    void (*tkgl_SetReshapeFunc) (Tkgl *tkglPtr, Tkgl_Callback *proc, void *clientData); /* 7 */
+    void (*tkgl_SetTimerFunc) (Tkgl *tkglPtr, Tkgl_Callback *proc, void *clientData); /* 8 */
+} TkglStubs;
+
+extern const TkglStubs *tkglStubsPtr;
+
+#ifdef __cplusplus
+}
+#endif
+
+#if defined(USE_TKGL_STUBS)
+
+/*
+ * Inline function declarations:
+ */
+
+#define Tkgl_GetWidgetFromName \
+	(tkglStubsPtr->tkgl_GetWidgetFromName) /* 0 */
+#define Tkgl_MakeCurrent \
+	(tkglStubsPtr->tkgl_MakeCurrent) /* 1 */
+#define Tkgl_SwapBuffers \
+	(tkglStubsPtr->tkgl_SwapBuffers) /* 2 */
+#define Tkgl_PostRedisplay \
+	(tkglStubsPtr->tkgl_PostRedisplay) /* 3 */
+#define Tkgl_Width \
+	(tkglStubsPtr->tkgl_Width) /* 4 */
+#define Tkgl_Height \
+	(tkglStubsPtr->tkgl_Height) /* 5 */
+#define Tkgl_SetDisplayFunc \
+	(tkglStubsPtr->tkgl_SetDisplayFunc) /* 6 */
+#define Tkgl_SetReshapeFunc \
+	(tkglStubsPtr->tkgl_SetReshapeFunc) /* 7 */
+#define Tkgl_SetTimerFunc \
+	(tkglStubsPtr->tkgl_SetTimerFunc) /* 8 */
+
+#endif /* defined(USE_TKGL_STUBS) */
+
+/* !END!: Do not edit above this line. */
+
+#undef TCL_STORAGE_CLASS
+#define TCL_STORAGE_CLASS DLLIMPORT
+
+#endif /* _TKGLDECLS */
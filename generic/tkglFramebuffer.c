@@ -0,0 +1,407 @@
+/*
+ * tkglFramebuffer.c --
+ *
+ *	Framebuffer objects, used to render into images which are not shown
+ *	in a window and need not have the size of one.  A TkglFramebuffer has
+ *	a color renderbuffer and, if the widget asks for them, a depth
+ *	renderbuffer which may also hold the stencil buffer.  Changing its
+ *	size reallocates the storage of the renderbuffers, and keeps the
+ *	framebuffer object itself.
+ *
+ *	The framebuffer functions are looked up at runtime, like the buffer
+ *	object functions, using the core names for OpenGL 3.0 and
+ *	GL_ARB_framebuffer_object and the EXT names for older contexts which
+ *	only have GL_EXT_framebuffer_object.
+ *
+ * Copyright (C) 2024, Marc Culler, Nathan Dunfield, Matthias Goerner
+ *
+ * This file is part of the TkGL project.  TkGL is licensed under the Tcl
+ * license.  The terms of the license are described in the file
+ * "license.terms" which should be included with this distribution.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "tkgl.h"
+
+#ifndef GL_FRAMEBUFFER
+#  define GL_FRAMEBUFFER		0x8D40
+#  define GL_RENDERBUFFER		0x8D41
+#  define GL_FRAMEBUFFER_BINDING	0x8CA6
+#  define GL_RENDERBUFFER_BINDING	0x8CA7
+#  define GL_FRAMEBUFFER_COMPLETE	0x8CD5
+#  define GL_COLOR_ATTACHMENT0		0x8CE0
+#  define GL_DEPTH_ATTACHMENT		0x8D00
+#  define GL_STENCIL_ATTACHMENT		0x8D20
+#  define GL_MAX_RENDERBUFFER_SIZE	0x84E8
+#endif
+#ifndef GL_DEPTH24_STENCIL8
+#  define GL_DEPTH24_STENCIL8		0x88F0
+#endif
+#ifndef GL_DEPTH_COMPONENT24
+#  define GL_DEPTH_COMPONENT24		0x81A6
+#endif
+#ifndef GL_DEPTH_COMPONENT16
+#  define GL_DEPTH_COMPONENT16		0x81A5
+#endif
+#ifndef GL_DEPTH_COMPONENT32
+#  define GL_DEPTH_COMPONENT32		0x81A7
+#endif
+#ifndef GL_RGB8
+#  define GL_RGB8			0x8051
+#endif
+#ifndef GL_RGBA8
+#  define GL_RGBA8			0x8058
+#endif
+
+/*
+ * Look up the framebuffer functions with the given suffix, which is "" for
+ * the core names and "EXT" for the extension.
+ */
+
+static void
+LookupFramebufferProcs(
+    TkglFramebufferProcs *procs,
+    const char *suffix)
+{
+    char name[64];
+
+#define LOOKUP(member, type, base) \
+    snprintf(name, sizeof(name), "%s%s", base, suffix); \
+    procs->member = (type *) Tkgl_GetProcAddress(name)
+
+    LOOKUP(genFramebuffers, TkglGenFramebuffersProc, "glGenFramebuffers");
+    LOOKUP(deleteFramebuffers, TkglDeleteFramebuffersProc,
+	"glDeleteFramebuffers");
+    LOOKUP(bindFramebuffer, TkglBindFramebufferProc, "glBindFramebuffer");
+    LOOKUP(framebufferRenderbuffer, TkglFramebufferRenderbufferProc,
+	"glFramebufferRenderbuffer");
+    LOOKUP(checkFramebufferStatus, TkglCheckFramebufferStatusProc,
+	"glCheckFramebufferStatus");
+    LOOKUP(genRenderbuffers, TkglGenRenderbuffersProc, "glGenRenderbuffers");
+    LOOKUP(deleteRenderbuffers, TkglDeleteRenderbuffersProc,
+	"glDeleteRenderbuffers");
+    LOOKUP(bindRenderbuffer, TkglBindRenderbufferProc, "glBindRenderbuffer");
+    LOOKUP(renderbufferStorage, TkglRenderbufferStorageProc,
+	"glRenderbufferStorage");
+#undef LOOKUP
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglGetFramebufferProcs --
+ *
+ *	Look up the framebuffer object functions.  As for the buffer object
+ *	functions, the lookup is done once per process and whether the
+ *	current context supports them is checked on every call.  A
+ *	TkglFramebuffer keeps the result, so this is only called when one is
+ *	initialized.
+ *
+ * Results:
+ *	The function table if the current context supports framebuffer
+ *	objects, otherwise NULL.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const TkglFramebufferProcs *
+TkglGetFramebufferProcs(void)
+{
+    static TkglFramebufferProcs coreProcs, extProcs;
+    static int initialized = 0;
+    const char *version = (const char *) glGetString(GL_VERSION);
+    const char *extensions = NULL;
+    const TkglFramebufferProcs *procs;
+    int major = 0, minor = 0;
+
+    if (version == NULL || sscanf(version, "%d.%d", &major, &minor) != 2) {
+	return NULL;
+    }
+    if (major < 3) {
+	extensions = (const char *) glGetString(GL_EXTENSIONS);
+    }
+    if (!initialized) {
+	LookupFramebufferProcs(&coreProcs, "");
+	LookupFramebufferProcs(&extProcs, "EXT");
+	initialized = 1;
+    }
+    if (major >= 3 || (extensions
+	    && strstr(extensions, "GL_ARB_framebuffer_object") != NULL)) {
+	procs = &coreProcs;
+    } else if (extensions
+	    && strstr(extensions, "GL_EXT_framebuffer_object") != NULL) {
+	procs = &extProcs;
+    } else {
+	return NULL;
+    }
+    if (!procs->genFramebuffers || !procs->deleteFramebuffers
+	    || !procs->bindFramebuffer || !procs->framebufferRenderbuffer
+	    || !procs->checkFramebufferStatus || !procs->genRenderbuffers
+	    || !procs->deleteRenderbuffers || !procs->bindRenderbuffer
+	    || !procs->renderbufferStorage) {
+	return NULL;
+    }
+    return procs;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglFramebufferInit --
+ *
+ *	Prepare a framebuffer for the current context, choosing the formats
+ *	of its renderbuffers from the options of a widget: -alpha, -depth,
+ *	-depthsize, -stencil and -stencilsize.  Without a widget it gets an
+ *	RGBA color buffer and a 24 bit depth buffer with an 8 bit stencil
+ *	buffer.  A framebuffer object has no accumulation buffer, and is not
+ *	multisampled, so -accum and -multisample are errors.  No objects are
+ *	created until TkglFramebufferResize.
+ *
+ * Results:
+ *	A standard Tcl result, with an error message in the interp, if it is
+ *	not NULL, when the framebuffer can not have what the widget asks for.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglFramebufferInit(
+    Tcl_Interp *interp,
+    TkglFramebuffer *fbPtr,
+    const Tkgl *tkglPtr)
+{
+    const char *message = NULL;
+    int depthSize = 24;
+
+    memset(fbPtr, 0, sizeof(TkglFramebuffer));
+    fbPtr->colorFormat = GL_RGBA8;
+    fbPtr->hasStencil = 1;
+    if (tkglPtr) {
+	fbPtr->colorFormat = tkglPtr->alphaFlag ? GL_RGBA8 : GL_RGB8;
+	fbPtr->hasStencil = tkglPtr->stencilFlag;
+	depthSize = tkglPtr->depthFlag ? tkglPtr->depthSize : 0;
+	if (tkglPtr->accumFlag) {
+	    message = "framebuffer objects have no accumulation buffer";
+	} else if (tkglPtr->multisampleFlag) {
+	    message = "framebuffer objects are not multisampled";
+	} else if (tkglPtr->alphaFlag && tkglPtr->alphaSize > 8) {
+	    message = "the alpha buffer of a framebuffer object has 8 bits";
+	} else if (tkglPtr->stencilFlag && tkglPtr->stencilSize > 8) {
+	    message = "the stencil buffer of a framebuffer object has 8 bits";
+	} else if (tkglPtr->stencilFlag && depthSize > 24) {
+	    message = "the depth buffer of a framebuffer object with a "
+		    "stencil buffer has 24 bits";
+	} else if (depthSize > 32) {
+	    message = "the depth buffer of a framebuffer object has at most "
+		    "32 bits";
+	}
+    }
+    if (message == NULL) {
+	fbPtr->procs = TkglGetFramebufferProcs();
+	if (fbPtr->procs == NULL) {
+	    message = "framebuffer objects are not supported";
+	}
+    }
+    if (message) {
+	if (interp) {
+	    Tcl_SetObjResult(interp,
+		    Tcl_NewStringObj(message, TCL_INDEX_NONE));
+	}
+	return TCL_ERROR;
+    }
+    if (fbPtr->hasStencil) {
+	fbPtr->depthFormat = GL_DEPTH24_STENCIL8;
+    } else if (depthSize > 24) {
+	fbPtr->depthFormat = GL_DEPTH_COMPONENT32;
+    } else if (depthSize > 16) {
+	fbPtr->depthFormat = GL_DEPTH_COMPONENT24;
+    } else if (depthSize > 0) {
+	fbPtr->depthFormat = GL_DEPTH_COMPONENT16;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglFramebufferResize --
+ *
+ *	Give a framebuffer the requested size, creating its objects the
+ *	first time, in the current context.  A framebuffer which has not
+ *	been initialized gets the attachments of TkglFramebufferInit without
+ *	a widget.  When the size changes only the storage of the
+ *	renderbuffers is reallocated.  The framebuffer is left bound, and the
+ *	renderbuffer binding is restored.
+ *
+ * Results:
+ *	A standard Tcl result, with an error message in the interp, if it is
+ *	not NULL, when the framebuffer could not be made complete.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglFramebufferResize(
+    Tcl_Interp *interp,
+    TkglFramebuffer *fbPtr,
+    int width,
+    int height)
+{
+    const TkglFramebufferProcs *procs;
+    GLint renderbuffer, maxSize;
+    GLenum status;
+
+    if (fbPtr->procs == NULL
+	    && TkglFramebufferInit(interp, fbPtr, NULL) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    procs = fbPtr->procs;
+    if (fbPtr->fbo != 0 && fbPtr->width == width && fbPtr->height == height) {
+	procs->bindFramebuffer(GL_FRAMEBUFFER, fbPtr->fbo);
+	return TCL_OK;
+    }
+    glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &maxSize);
+    if (width <= 0 || height <= 0 || width > maxSize || height > maxSize) {
+	if (interp) {
+	    Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+		"the framebuffer size must be between 1 and %d",
+		(int) maxSize));
+	}
+	return TCL_ERROR;
+    }
+    if (fbPtr->fbo == 0) {
+	procs->genFramebuffers(1, &fbPtr->fbo);
+	procs->genRenderbuffers(1, &fbPtr->color);
+	if (fbPtr->depthFormat) {
+	    procs->genRenderbuffers(1, &fbPtr->depth);
+	}
+	fbPtr->width = fbPtr->height = 0;
+    }
+    procs->bindFramebuffer(GL_FRAMEBUFFER, fbPtr->fbo);
+    glGetIntegerv(GL_RENDERBUFFER_BINDING, &renderbuffer);
+    procs->bindRenderbuffer(GL_RENDERBUFFER, fbPtr->color);
+    procs->renderbufferStorage(GL_RENDERBUFFER, fbPtr->colorFormat, width,
+	height);
+    procs->framebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+	GL_RENDERBUFFER, fbPtr->color);
+    if (fbPtr->depth) {
+	procs->bindRenderbuffer(GL_RENDERBUFFER, fbPtr->depth);
+	procs->renderbufferStorage(GL_RENDERBUFFER, fbPtr->depthFormat, width,
+	    height);
+	procs->framebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+	    GL_RENDERBUFFER, fbPtr->depth);
+	if (fbPtr->hasStencil) {
+	    procs->framebufferRenderbuffer(GL_FRAMEBUFFER,
+		GL_STENCIL_ATTACHMENT, GL_RENDERBUFFER, fbPtr->depth);
+	}
+    }
+    status = procs->checkFramebufferStatus(GL_FRAMEBUFFER);
+    procs->bindRenderbuffer(GL_RENDERBUFFER, renderbuffer);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+	fbPtr->width = fbPtr->height = 0;
+	if (interp) {
+	    Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+		"the framebuffer is not complete (status 0x%04x)",
+		(unsigned) status));
+	}
+	return TCL_ERROR;
+    }
+    fbPtr->width = width;
+    fbPtr->height = height;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglFramebufferFree --
+ *
+ *	Delete the objects of a framebuffer, which must belong to the current
+ *	context.  The default framebuffer is bound if it was bound.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglFramebufferFree(
+    TkglFramebuffer *fbPtr)
+{
+    const TkglFramebufferProcs *procs = fbPtr->procs;
+    GLint framebuffer;
+
+    if (fbPtr->fbo != 0) {
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+	if ((GLuint) framebuffer == fbPtr->fbo) {
+	    procs->bindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+	procs->deleteFramebuffers(1, &fbPtr->fbo);
+	procs->deleteRenderbuffers(1, &fbPtr->color);
+	if (fbPtr->depth) {
+	    procs->deleteRenderbuffers(1, &fbPtr->depth);
+	}
+    }
+    memset(fbPtr, 0, sizeof(TkglFramebuffer));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglOffscreenBind --
+ *
+ *	Called by Tkgl_MakeCurrent for a widget with -offscreen fbo, after
+ *	its context has been made current.  Binds the framebuffer which the
+ *	widget draws into, first giving it the current size of the widget if
+ *	that has changed.  This is how an offscreen widget is resized: the
+ *	renderbuffers get new storage and nothing else is recreated.
+ *
+ *	While renderlarge is drawing tiles the framebuffer of the tile is
+ *	left bound.  Nothing is bound until TkglFramebufferInit has chosen
+ *	the attachments.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglOffscreenBind(
+    const Tkgl *tkglPtr)
+{
+    int width = tkglPtr->width > 0 ? tkglPtr->width : 1;
+    int height = tkglPtr->height > 0 ? tkglPtr->height : 1;
+
+    if (tkglPtr->framebuffer == NULL || tkglPtr->framebuffer->procs == NULL
+	    || tkglPtr->tile != NULL) {
+	return;
+    }
+    (void) TkglFramebufferResize(NULL, tkglPtr->framebuffer, width, height);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglOffscreenFree --
+ *
+ *	Delete the framebuffer of a widget with -offscreen fbo.  Its context
+ *	must be current.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglOffscreenFree(
+    Tkgl *tkglPtr)
+{
+    if (tkglPtr->framebuffer) {
+	TkglFramebufferFree(tkglPtr->framebuffer);
+	ckfree(tkglPtr->framebuffer);
+	tkglPtr->framebuffer = NULL;
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * fill-column: 78
+ * End:
+ */
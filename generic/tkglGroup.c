@@ -0,0 +1,402 @@
+/*
+ * tkglGroup.c --
+ *
+ *	Share groups.  Widgets created with -sharelist have contexts which
+ *	share one namespace of textures, buffers and other objects, and
+ *	widgets created with -sharecontext use the very context of another
+ *	widget.  Either way they belong to the same TkglShareGroup, which is
+ *	reference counted by its widgets and has the same context tag for
+ *	all of them.  A widget which is not created with either option is
+ *	the first member of a new group.
+ *
+ *	A group also has a registry of named objects, so a widget can find
+ *	the textures and buffers which another widget of the group created.
+ *	The registered objects are deleted when the last widget leaves the
+ *	group.
+ *
+ * Copyright (C) 2024, Marc Culler, Nathan Dunfield, Matthias Goerner
+ *
+ * This file is part of the TkGL project.  TkGL is licensed under the Tcl
+ * license.  The terms of the license are described in the file
+ * "license.terms" which should be included with this distribution.
+ */
+
+#include <string.h>
+#include "tkgl.h"
+
+/*
+ * The kinds of objects which are shared between contexts and can be
+ * registered.  Framebuffer and vertex array objects are not shared.
+ */
+
+static const char *const resourceTypes[] = {
+    "texture", "buffer", "renderbuffer", "program", "shader", NULL
+};
+
+enum resourceType {
+    RESOURCE_TEXTURE, RESOURCE_BUFFER, RESOURCE_RENDERBUFFER,
+    RESOURCE_PROGRAM, RESOURCE_SHADER
+};
+
+typedef void (APIENTRY TkglDeleteObjectProc)(GLuint object);
+
+typedef struct Resource {
+    enum resourceType type;
+    GLuint object;		/* The OpenGL name of the object. */
+} Resource;
+
+typedef struct TkglShareGroup {
+    int refCount;		/* Number of widgets in the group. */
+    int tag;			/* The context tag of the widgets. */
+    Tcl_HashTable resources;	/* Registered name -> Resource. */
+} TkglShareGroup;
+
+typedef struct {
+    int nextTag;		/* Tag of the last group created. */
+} ThreadSpecificData;
+
+static Tcl_ThreadDataKey dataKey;
+
+/*
+ * Delete a registered object, in the current context.
+ */
+
+static void
+DeleteResource(
+    const Resource *resPtr)
+{
+    const TkglBufferProcs *bufferProcs;
+    const TkglFramebufferProcs *framebufferProcs;
+    TkglDeleteObjectProc *deleteProc;
+
+    switch (resPtr->type) {
+    case RESOURCE_TEXTURE:
+	glDeleteTextures(1, &resPtr->object);
+	break;
+    case RESOURCE_BUFFER:
+	bufferProcs = TkglGetBufferProcs();
+	if (bufferProcs) {
+	    bufferProcs->deleteBuffers(1, &resPtr->object);
+	}
+	break;
+    case RESOURCE_RENDERBUFFER:
+	framebufferProcs = TkglGetFramebufferProcs();
+	if (framebufferProcs) {
+	    framebufferProcs->deleteRenderbuffers(1, &resPtr->object);
+	}
+	break;
+    case RESOURCE_PROGRAM:
+    case RESOURCE_SHADER:
+	deleteProc = (TkglDeleteObjectProc *) Tkgl_GetProcAddress(
+		resPtr->type == RESOURCE_PROGRAM
+		? "glDeleteProgram" : "glDeleteShader");
+	if (deleteProc) {
+	    deleteProc(resPtr->object);
+	}
+	break;
+    }
+}
+
+/*
+ * Whether the context of a widget which is being destroyed can still be
+ * made current.  Unless it draws offscreen that needs its window.
+ */
+
+static int
+CanMakeCurrent(
+    const Tkgl *tkglPtr)
+{
+    return TkglIsOffscreen(tkglPtr) || tkglPtr->framebuffer != NULL
+	    || (tkglPtr->tkwin != NULL && Tk_WindowId(tkglPtr->tkwin) != None);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglGroupPartner --
+ *
+ *	Find the widget named by the -sharelist or -sharecontext option of
+ *	a widget whose context is about to be created.
+ *
+ * Results:
+ *	A standard Tcl result.  The widget is stored in *partnerPtrPtr, or
+ *	NULL if neither option is set.  It is an error if the widget does
+ *	not exist, is on another display, or if both options are set.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglGroupPartner(
+    Tkgl *tkglPtr,
+    Tkgl **partnerPtrPtr)
+{
+    const char *shareList = tkglPtr->shareList;
+    const char *shareContext = tkglPtr->shareContext;
+    const char *name;
+    Tkgl *partnerPtr;
+
+    *partnerPtrPtr = NULL;
+    if (shareList && *shareList == '\0') {
+	shareList = NULL;
+    }
+    if (shareContext && *shareContext == '\0') {
+	shareContext = NULL;
+    }
+    if (shareList && shareContext) {
+	Tcl_SetResult(tkglPtr->interp,
+		"-sharelist and -sharecontext cannot be combined", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    name = shareList ? shareList : shareContext;
+    if (name == NULL) {
+	return TCL_OK;
+    }
+    partnerPtr = FindTkgl(tkglPtr, name);
+    if (partnerPtr == NULL || partnerPtr == tkglPtr) {
+	Tcl_SetObjResult(tkglPtr->interp, Tcl_ObjPrintf(
+		"no tkgl widget \"%s\" to share with", name));
+	return TCL_ERROR;
+    }
+    if (partnerPtr->display != tkglPtr->display) {
+	Tcl_SetObjResult(tkglPtr->interp, Tcl_ObjPrintf(
+		"can't share with \"%s\", which is on another display", name));
+	return TCL_ERROR;
+    }
+    *partnerPtrPtr = partnerPtr;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglGroupJoin --
+ *
+ *	Add a widget whose context has been created to the share group of
+ *	another widget, or to a new group if partnerPtr is NULL.  The
+ *	context tag of the widget becomes the tag of the group.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglGroupJoin(
+    Tkgl *tkglPtr,
+    Tkgl *partnerPtr)
+{
+    ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
+	    Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+    TkglShareGroup *groupPtr;
+
+    if (tkglPtr->shareGroup) {
+	return;
+    }
+    if (partnerPtr && partnerPtr->shareGroup) {
+	groupPtr = partnerPtr->shareGroup;
+    } else {
+	groupPtr = (TkglShareGroup *) ckalloc(sizeof(TkglShareGroup));
+	groupPtr->refCount = 0;
+	groupPtr->tag = ++tsdPtr->nextTag;
+	Tcl_InitHashTable(&groupPtr->resources, TCL_STRING_KEYS);
+    }
+    groupPtr->refCount++;
+    tkglPtr->shareGroup = groupPtr;
+    tkglPtr->contextTag = groupPtr->tag;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglGroupLeave --
+ *
+ *	Remove a widget which is being destroyed from its share group,
+ *	before its context is freed.  When it is the last widget of the
+ *	group, the registered objects are deleted in its context and the
+ *	group is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglGroupLeave(
+    Tkgl *tkglPtr)
+{
+    TkglShareGroup *groupPtr = tkglPtr->shareGroup;
+    Tcl_HashEntry *entryPtr;
+    Tcl_HashSearch search;
+    int canDelete;
+
+    if (groupPtr == NULL) {
+	return;
+    }
+    tkglPtr->shareGroup = NULL;
+    if (--groupPtr->refCount > 0) {
+	return;
+    }
+    canDelete = groupPtr->resources.numEntries > 0 && CanMakeCurrent(tkglPtr);
+    if (canDelete) {
+	Tkgl_MakeCurrent(tkglPtr);
+    }
+    for (entryPtr = Tcl_FirstHashEntry(&groupPtr->resources, &search);
+	    entryPtr != NULL; entryPtr = Tcl_NextHashEntry(&search)) {
+	Resource *resPtr = (Resource *) Tcl_GetHashValue(entryPtr);
+
+	/* Otherwise the objects go away with the context. */
+	if (canDelete) {
+	    DeleteResource(resPtr);
+	}
+	ckfree(resPtr);
+    }
+    Tcl_DeleteHashTable(&groupPtr->resources);
+    ckfree(groupPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglResourceObjCmd --
+ *
+ *	Implements the resource widget command, which manages the registry
+ *	of the widget's share group:
+ *
+ *	    $w resource register name type object
+ *	    $w resource lookup name
+ *	    $w resource forget name
+ *	    $w resource delete name
+ *	    $w resource names ?pattern?
+ *
+ *	The type is texture, buffer, renderbuffer, program or shader and
+ *	object is the OpenGL name of the object.  lookup returns a list of
+ *	the type and the object.  forget removes a name from the registry,
+ *	while delete also deletes the object, in the context of the widget.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglResourceObjCmd(
+    Tkgl *tkglPtr,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[])
+{
+    static const char *const subcommands[] = {
+	"register", "lookup", "forget", "delete", "names", NULL
+    };
+    enum {
+	RES_REGISTER, RES_LOOKUP, RES_FORGET, RES_DELETE, RES_NAMES
+    };
+    TkglShareGroup *groupPtr = tkglPtr->shareGroup;
+    Tcl_HashEntry *entryPtr;
+    Tcl_HashSearch search;
+    Resource *resPtr;
+    Tcl_Obj *listPtr;
+    const char *pattern;
+    int index, type, object, isNew;
+
+    if (objc < 3) {
+	Tcl_WrongNumArgs(interp, 2, objv, "subcommand ?arg ...?");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObjStruct(interp, objv[2], subcommands,
+	    sizeof(char *), "subcommand", 0, &index) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (groupPtr == NULL) {
+	Tcl_SetResult(interp, "the widget has no context", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    switch (index) {
+    case RES_REGISTER:
+	if (objc != 6) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "name type object");
+	    return TCL_ERROR;
+	}
+	if (Tcl_GetIndexFromObjStruct(interp, objv[4], resourceTypes,
+		sizeof(char *), "type", 0, &type) != TCL_OK
+		|| Tcl_GetIntFromObj(interp, objv[5], &object) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (object <= 0) {
+	    Tcl_SetResult(interp, "the object must be a positive integer",
+		    TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	entryPtr = Tcl_CreateHashEntry(&groupPtr->resources,
+		Tcl_GetString(objv[3]), &isNew);
+	if (!isNew) {
+	    Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+		    "resource \"%s\" is already registered",
+		    Tcl_GetString(objv[3])));
+	    return TCL_ERROR;
+	}
+	resPtr = (Resource *) ckalloc(sizeof(Resource));
+	resPtr->type = (enum resourceType) type;
+	resPtr->object = (GLuint) object;
+	Tcl_SetHashValue(entryPtr, resPtr);
+	break;
+    case RES_LOOKUP:
+    case RES_FORGET:
+    case RES_DELETE:
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "name");
+	    return TCL_ERROR;
+	}
+	entryPtr = Tcl_FindHashEntry(&groupPtr->resources,
+		Tcl_GetString(objv[3]));
+	if (entryPtr == NULL) {
+	    Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+		    "no resource named \"%s\"", Tcl_GetString(objv[3])));
+	    return TCL_ERROR;
+	}
+	resPtr = (Resource *) Tcl_GetHashValue(entryPtr);
+	if (index == RES_LOOKUP) {
+	    listPtr = Tcl_NewListObj(0, NULL);
+	    Tcl_ListObjAppendElement(NULL, listPtr,
+		    Tcl_NewStringObj(resourceTypes[resPtr->type],
+		    TCL_INDEX_NONE));
+	    Tcl_ListObjAppendElement(NULL, listPtr,
+		    Tcl_NewIntObj((int) resPtr->object));
+	    Tcl_SetObjResult(interp, listPtr);
+	    break;
+	}
+	if (index == RES_DELETE) {
+	    Tkgl_MakeCurrent(tkglPtr);
+	    DeleteResource(resPtr);
+	}
+	ckfree(resPtr);
+	Tcl_DeleteHashEntry(entryPtr);
+	break;
+    case RES_NAMES:
+	if (objc > 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "?pattern?");
+	    return TCL_ERROR;
+	}
+	pattern = objc == 4 ? Tcl_GetString(objv[3]) : NULL;
+	listPtr = Tcl_NewListObj(0, NULL);
+	for (entryPtr = Tcl_FirstHashEntry(&groupPtr->resources, &search);
+		entryPtr != NULL; entryPtr = Tcl_NextHashEntry(&search)) {
+	    const char *name = (const char *)
+		    Tcl_GetHashKey(&groupPtr->resources, entryPtr);
+
+	    if (pattern == NULL || Tcl_StringMatch(name, pattern)) {
+		Tcl_ListObjAppendElement(NULL, listPtr,
+			Tcl_NewStringObj(name, TCL_INDEX_NONE));
+	    }
+	}
+	Tcl_SetObjResult(interp, listPtr);
+	break;
+    }
+    return TCL_OK;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * fill-column: 78
+ * End:
+ */
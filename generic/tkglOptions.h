@@ -17,6 +17,24 @@ static const char *const profileStrings[] = {
   "legacy", "3_2", "4_1", "system", NULL
 };
 
+/*
+ * The legal values for the -offscreen option, in the order of enum
+ * offscreen.
+ */
+
+static const char *const offscreenStrings[] = {
+  "none", "fbo", NULL
+};
+
+/*
+ * The legal values for the -formatpolicy option, in the order of enum
+ * formatPolicy.
+ */
+
+static const char *const formatPolicyStrings[] = {
+  "best-quality", "cheapest-sufficient", "weighted", NULL
+};
+
 static Tk_ObjCustomOption stereoOption;
 static Tk_ObjCustomOption wideIntOption;
 
@@ -76,6 +94,8 @@ static Tk_OptionSpec tkglOptionSpecs[] = {
      TCL_INDEX_NONE, offsetof(Tkgl, setGrid), 0, NULL, GEOMETRY_MASK},
     {TK_OPTION_INT, "-time", "time", "Time", DEFAULT_TIME,
      TCL_INDEX_NONE, offsetof(Tkgl, timerInterval), 0, NULL, TIMER_MASK},
+    {TK_OPTION_BOOLEAN, "-hirestimer", "hiresTimer", "HiresTimer", "false",
+     TCL_INDEX_NONE, offsetof(Tkgl, hiresTimerFlag), 0, NULL, TIMER_MASK},
     {TK_OPTION_STRING, "-sharelist", "sharelist", "ShareList", NULL,
      TCL_INDEX_NONE, offsetof(Tkgl, shareList), 0, NULL, FORMAT_MASK},
     {TK_OPTION_STRING, "-sharecontext", "sharecontext", "ShareContext", NULL,
@@ -96,6 +116,20 @@ static Tk_OptionSpec tkglOptionSpecs[] = {
      TCL_INDEX_NONE, offsetof(Tkgl, pBufferFlag), 0, NULL, FORMAT_MASK},
     {TK_OPTION_BOOLEAN, "-largestpbuffer", "largestpbuffer", "LargestPbuffer", "false",
      TCL_INDEX_NONE, offsetof(Tkgl, largestPbufferFlag), 0, NULL, 0},
+    {TK_OPTION_BOOLEAN, "-software", "software", "Software", "false",
+     TCL_INDEX_NONE, offsetof(Tkgl, softwareFlag), 0, NULL, FORMAT_MASK},
+    {TK_OPTION_STRING_TABLE, "-offscreen", "offscreen", "Offscreen", "none",
+     TCL_INDEX_NONE, offsetof(Tkgl, offscreen), 0, offscreenStrings,
+     FORMAT_MASK},
+    {TK_OPTION_BOOLEAN, "-lazy", "lazy", "Lazy", "false",
+     TCL_INDEX_NONE, offsetof(Tkgl, lazyFlag), 0, NULL, 0},
+    {TK_OPTION_BOOLEAN, "-pool", "pool", "Pool", "false",
+     TCL_INDEX_NONE, offsetof(Tkgl, poolFlag), 0, NULL, FORMAT_MASK},
+    {TK_OPTION_INT, "-priority", "priority", "Priority", "0",
+     TCL_INDEX_NONE, offsetof(Tkgl, priority), 0, NULL, 0},
+    {TK_OPTION_STRING_TABLE, "-formatpolicy", "formatPolicy", "FormatPolicy",
+     "best-quality", TCL_INDEX_NONE, offsetof(Tkgl, formatPolicy), 0,
+     formatPolicyStrings, FORMAT_MASK},
     {TK_OPTION_STRING, "-createcommand", "createCommand", "CallbackCommand", NULL,
      offsetof(Tkgl, createProc), TCL_INDEX_NONE, TK_OPTION_NULL_OK, NULL, 0},
     {TK_OPTION_SYNONYM, "-create", NULL, NULL, NULL, TCL_INDEX_NONE, TCL_INDEX_NONE, 0,
@@ -0,0 +1,474 @@
+/*
+ * tkglPixels.c --
+ *
+ *	Conversion kernels for pixels read back from a Tkgl widget.  All of
+ *	the platforms use these to turn the result of glReadPixels into the
+ *	layout that the consumer wants: a Tk photo image, an image file or a
+ *	buffer handed to an extension.  The kernels have SSE2, AVX2 and NEON
+ *	versions, and scalar versions for everything else.  The best version
+ *	supported by the processor is chosen the first time a kernel is used.
+ *
+ * Copyright (C) 2024, Marc Culler, Nathan Dunfield, Matthias Goerner
+ *
+ * This file is part of the TkGL project.  TkGL is licensed under the Tcl
+ * license.  The terms of the license are described in the file
+ * "license.terms" which should be included with this distribution.
+ */
+
+#include <string.h>
+#include "tkgl.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#  define HAVE_SSE2 1
+#  include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define HAVE_AVX2 1
+#  include <immintrin.h>
+#  define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#  define HAVE_NEON 1
+#  include <arm_neon.h>
+#endif
+
+/*
+ * The kernels.  Swap4 exchanges the first and third bytes of each 4 byte
+ * pixel, converting between RGBA and BGRA.  Strip drops the alpha byte,
+ * and also exchanges the first and third bytes if swap is true.  Both may
+ * be used in place.  ExpandIndex maps
+ * color indices to 4 byte pixels through a table of lutSize entries.
+ */
+
+typedef struct {
+    void (*swap4)(unsigned char *dst, const unsigned char *src, size_t n);
+    void (*strip)(unsigned char *dst, const unsigned char *src, size_t n,
+	    int swap);
+    void (*expandIndex)(unsigned int *dst, const GLuint *src, size_t n,
+	    const unsigned int *lut, GLuint lutSize);
+} PixelKernels;
+
+static void
+Swap4Scalar(
+    unsigned char *dst,
+    const unsigned char *src,
+    size_t n)
+{
+    for (; n > 0; n--, src += 4, dst += 4) {
+	unsigned char r = src[0], g = src[1], b = src[2], a = src[3];
+
+	dst[0] = b;
+	dst[1] = g;
+	dst[2] = r;
+	dst[3] = a;
+    }
+}
+
+static void
+StripScalar(
+    unsigned char *dst,
+    const unsigned char *src,
+    size_t n,
+    int swap)
+{
+    int first = swap ? 2 : 0;
+
+    for (; n > 0; n--, src += 4, dst += 3) {
+	unsigned char c0 = src[first], c1 = src[1], c2 = src[2 - first];
+
+	dst[0] = c0;
+	dst[1] = c1;
+	dst[2] = c2;
+    }
+}
+
+static void
+ExpandIndexScalar(
+    unsigned int *dst,
+    const GLuint *src,
+    size_t n,
+    const unsigned int *lut,
+    GLuint lutSize)
+{
+    for (; n > 0; n--) {
+	GLuint index = *src++;
+
+	*dst++ = lut[index < lutSize ? index : lutSize - 1];
+    }
+}
+
+#ifdef HAVE_SSE2
+static void
+Swap4SSE2(
+    unsigned char *dst,
+    const unsigned char *src,
+    size_t n)
+{
+    const __m128i gaMask = _mm_set1_epi32((int) 0xFF00FF00);
+    const __m128i rbMask = _mm_set1_epi32(0x00FF00FF);
+
+    for (; n >= 4; n -= 4, src += 16, dst += 16) {
+	__m128i x = _mm_loadu_si128((const __m128i *) src);
+	__m128i rb = _mm_and_si128(x, rbMask);
+
+	x = _mm_or_si128(_mm_and_si128(x, gaMask),
+	    _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16)));
+	_mm_storeu_si128((__m128i *) dst, x);
+    }
+    Swap4Scalar(dst, src, n);
+}
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_AVX2
+static AVX2_TARGET void
+Swap4AVX2(
+    unsigned char *dst,
+    const unsigned char *src,
+    size_t n)
+{
+    const __m256i shuffle = _mm256_setr_epi8(
+	2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+	2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    for (; n >= 8; n -= 8, src += 32, dst += 32) {
+	__m256i x = _mm256_loadu_si256((const __m256i *) src);
+
+	_mm256_storeu_si256((__m256i *) dst, _mm256_shuffle_epi8(x, shuffle));
+    }
+    Swap4Scalar(dst, src, n);
+}
+
+/*
+ * The shuffles work within 128 bit lanes, so Strip converts 4 pixels per
+ * lane.  Each lane stores 16 bytes of which only 12 are pixel data, so the
+ * loop stops early enough to stay in bounds.
+ */
+
+static AVX2_TARGET void
+StripAVX2(
+    unsigned char *dst,
+    const unsigned char *src,
+    size_t n,
+    int swap)
+{
+    const __m256i shuffle = swap ?
+	_mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+	    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1) :
+	_mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+	    0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    for (; n >= 10; n -= 8, src += 32, dst += 24) {
+	__m256i x = _mm256_shuffle_epi8(
+	    _mm256_loadu_si256((const __m256i *) src), shuffle);
+
+	_mm_storeu_si128((__m128i *) dst, _mm256_castsi256_si128(x));
+	_mm_storeu_si128((__m128i *) (dst + 12),
+	    _mm256_extracti128_si256(x, 1));
+    }
+    StripScalar(dst, src, n, swap);
+}
+
+static AVX2_TARGET void
+ExpandIndexAVX2(
+    unsigned int *dst,
+    const GLuint *src,
+    size_t n,
+    const unsigned int *lut,
+    GLuint lutSize)
+{
+    const __m256i maxIndex = _mm256_set1_epi32((int) (lutSize - 1));
+
+    for (; n >= 8; n -= 8, src += 8, dst += 8) {
+	__m256i index = _mm256_min_epu32(
+	    _mm256_loadu_si256((const __m256i *) src), maxIndex);
+
+	_mm256_storeu_si256((__m256i *) dst,
+	    _mm256_i32gather_epi32((const int *) lut, index, 4));
+    }
+    ExpandIndexScalar(dst, src, n, lut, lutSize);
+}
+#endif /* HAVE_AVX2 */
+
+#ifdef HAVE_NEON
+static void
+Swap4NEON(
+    unsigned char *dst,
+    const unsigned char *src,
+    size_t n)
+{
+    for (; n >= 16; n -= 16, src += 64, dst += 64) {
+	uint8x16x4_t x = vld4q_u8(src);
+	uint8x16_t r = x.val[0];
+
+	x.val[0] = x.val[2];
+	x.val[2] = r;
+	vst4q_u8(dst, x);
+    }
+    Swap4Scalar(dst, src, n);
+}
+
+static void
+StripNEON(
+    unsigned char *dst,
+    const unsigned char *src,
+    size_t n,
+    int swap)
+{
+    int first = swap ? 2 : 0;
+
+    for (; n >= 16; n -= 16, src += 64, dst += 48) {
+	uint8x16x4_t x = vld4q_u8(src);
+	uint8x16x3_t y;
+
+	y.val[0] = x.val[first];
+	y.val[1] = x.val[1];
+	y.val[2] = x.val[2 - first];
+	vst3q_u8(dst, y);
+    }
+    StripScalar(dst, src, n, swap);
+}
+#endif /* HAVE_NEON */
+
+/*
+ * Choose the kernels once per process.  The kernels may be used from any
+ * thread, such as the recorder's workers, so the choice is made under a
+ * mutex.  The lock is cheap next to the conversion of an image.
+ */
+
+TCL_DECLARE_MUTEX(kernelMutex)
+
+static const PixelKernels *
+GetPixelKernels(void)
+{
+    static PixelKernels kernels;
+    static int initialized = 0;
+
+    Tcl_MutexLock(&kernelMutex);
+    if (!initialized) {
+	kernels.swap4 = Swap4Scalar;
+	kernels.strip = StripScalar;
+	kernels.expandIndex = ExpandIndexScalar;
+#ifdef HAVE_SSE2
+	kernels.swap4 = Swap4SSE2;
+#endif
+#ifdef HAVE_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+	    kernels.swap4 = Swap4AVX2;
+	    kernels.strip = StripAVX2;
+	    kernels.expandIndex = ExpandIndexAVX2;
+	}
+#endif
+#ifdef HAVE_NEON
+	kernels.swap4 = Swap4NEON;
+	kernels.strip = StripNEON;
+#endif
+	initialized = 1;
+    }
+    Tcl_MutexUnlock(&kernelMutex);
+    return &kernels;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglFlipRows --
+ *
+ *	Reverse the order of the rows of an image, converting between the
+ *	bottom-up row order of OpenGL and the top-down order of image files.
+ *	The source and destination may be the same buffer, otherwise they
+ *	must not overlap.  Rows are moved with memcpy, which the C library
+ *	already vectorizes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglFlipRows(
+    unsigned char *dst,
+    const unsigned char *src,
+    size_t rowBytes,
+    int height)
+{
+    unsigned char chunk[4096];
+    unsigned char *top, *bottom;
+    int y;
+
+    if (dst != src) {
+	for (y = 0; y < height; y++) {
+	    memcpy(dst + (size_t) (height - 1 - y) * rowBytes,
+		src + (size_t) y * rowBytes, rowBytes);
+	}
+	return;
+    }
+    for (y = 0; y < height / 2; y++) {
+	size_t done, count;
+
+	top = dst + (size_t) y * rowBytes;
+	bottom = dst + (size_t) (height - 1 - y) * rowBytes;
+	for (done = 0; done < rowBytes; done += count) {
+	    count = rowBytes - done;
+	    if (count > sizeof(chunk)) {
+		count = sizeof(chunk);
+	    }
+	    memcpy(chunk, top + done, count);
+	    memcpy(top + done, bottom + done, count);
+	    memcpy(bottom + done, chunk, count);
+	}
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglConvertPixels --
+ *
+ *	Convert count pixels from the GL_RGBA or GL_BGRA format, as read
+ *	back by glReadPixels, to the GL_RGBA, GL_BGRA, GL_RGB or GL_BGR
+ *	format, with 8 bits per component.  The conversion may be done in
+ *	place.
+ *
+ * Results:
+ *	TCL_OK, or TCL_ERROR if either format is not supported.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglConvertPixels(
+    unsigned char *dst,
+    GLenum dstFormat,
+    const unsigned char *src,
+    GLenum srcFormat,
+    size_t count)
+{
+    const PixelKernels *kernels = GetPixelKernels();
+    int swap;
+
+    if (srcFormat != GL_RGBA && srcFormat != GL_BGRA) {
+	return TCL_ERROR;
+    }
+    swap = (srcFormat == GL_BGRA) != (dstFormat == GL_BGRA
+	    || dstFormat == GL_BGR);
+    if (dstFormat == GL_RGBA || dstFormat == GL_BGRA) {
+	if (swap) {
+	    kernels->swap4(dst, src, count);
+	} else if (dst != src) {
+	    memcpy(dst, src, count * 4);
+	}
+    } else if (dstFormat == GL_RGB || dstFormat == GL_BGR) {
+	kernels->strip(dst, src, count, swap);
+    } else {
+	return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglExpandColorIndex --
+ *
+ *	Convert color indices, as read with GL_COLOR_INDEX and
+ *	GL_UNSIGNED_INT, to RGBA pixels through the red, green and blue maps
+ *	of a color index mode widget.  Indices beyond the end of the maps
+ *	use the last entry.  This replaces the glPixelMap tables, which are
+ *	not available in every context.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglExpandColorIndex(
+    const Tkgl *tkglPtr,
+    unsigned char *dst,
+    const GLuint *src,
+    size_t count)
+{
+    GLuint i, lutSize = tkglPtr->mapSize > 0 ? tkglPtr->mapSize : 1;
+    unsigned int *lut = (unsigned int *) ckalloc(lutSize * sizeof(unsigned int));
+
+#define MAP_COMPONENT(map) \
+    ((map) && i < (GLuint) tkglPtr->mapSize ? (unsigned char) \
+	((map)[i] <= 0.0f ? 0 : (map)[i] >= 1.0f ? 255 : (map)[i] * 255 + 0.5f) : 0)
+    for (i = 0; i < lutSize; i++) {
+	unsigned char *entry = (unsigned char *) (lut + i);
+
+	entry[0] = MAP_COMPONENT(tkglPtr->redMap);
+	entry[1] = MAP_COMPONENT(tkglPtr->greenMap);
+	entry[2] = MAP_COMPONENT(tkglPtr->blueMap);
+	entry[3] = 0xFF;
+    }
+#undef MAP_COMPONENT
+    GetPixelKernels()->expandIndex((unsigned int *) dst, src, count, lut,
+	lutSize);
+    ckfree(lut);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglPutPhotoPixels --
+ *
+ *	Copy pixels read from a widget with glReadPixels into a photo image.
+ *	The pixels are in OpenGL's bottom-up row order, with rows packed at
+ *	an alignment of 4.  The format may be GL_RGBA or GL_BGRA, which are
+ *	passed to Tk as they are, or GL_COLOR_INDEX for pixels read as
+ *	GL_UNSIGNED_INT, which are expanded first.  The rows are not flipped
+ *	in memory: the photo block has a negative pitch, so that Tk reads
+ *	them from the top of the window down.  The pixels are put into the
+ *	photo with their top left corner at x, y.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglPutPhotoPixels(
+    Tkgl *tkglPtr,
+    Tk_PhotoHandle photo,
+    const unsigned char *pixels,
+    GLenum format,
+    int x, int y,
+    int width,
+    int height)
+{
+    size_t rowBytes = (size_t) width * 4;
+    unsigned char *expanded = NULL;
+    Tk_PhotoImageBlock photoBlock;
+    int result;
+
+    if (width <= 0 || height <= 0) {
+	return TCL_OK;
+    }
+    if (format == GL_COLOR_INDEX) {
+	expanded = (unsigned char *) ckalloc(rowBytes * height);
+	TkglExpandColorIndex(tkglPtr, expanded, (const GLuint *) pixels,
+	    (size_t) width * height);
+	pixels = expanded;
+    }
+    photoBlock.pixelPtr = (unsigned char *) pixels + (height - 1) * rowBytes;
+    photoBlock.width = width;
+    photoBlock.height = height;
+    photoBlock.pitch = -(int) rowBytes;
+    photoBlock.pixelSize = 4;
+    photoBlock.offset[0] = format == GL_BGRA ? 2 : 0;
+    photoBlock.offset[1] = 1;
+    photoBlock.offset[2] = format == GL_BGRA ? 0 : 2;
+    photoBlock.offset[3] = 3;
+    result = Tk_PhotoPutBlock(tkglPtr->interp, photo, &photoBlock, x, y,
+	width, height, TK_PHOTO_COMPOSITE_SET);
+    if (expanded) {
+	ckfree(expanded);
+    }
+    return result;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * fill-column: 78
+ * End:
+ */
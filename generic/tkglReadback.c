@@ -0,0 +1,655 @@
+/*
+ * tkglReadback.c --
+ *
+ *	Asynchronous readback of the contents of a Tkgl widget.  A readback
+ *	is started by issuing glReadPixels into a pixel pack buffer, which
+ *	returns as soon as the copy has been queued, and a fence is inserted
+ *	after it.  The pixels are collected later, typically a couple of
+ *	frames afterwards, when the fence shows that the copy is complete, so
+ *	neither the GPU nor the event loop ever waits for the other.  Each
+ *	widget has a ring of TKGL_READBACK_DEPTH buffers, one per readback in
+ *	flight.  Contexts without pixel buffer objects read synchronously into
+ *	client memory, and contexts without fences judge completion by
+ *	counting frames.
+ *
+ *	This file also looks up the buffer object functions, which are not
+ *	exported by every OpenGL library, for the other readback code.
+ *
+ * Copyright (C) 2024, Marc Culler, Nathan Dunfield, Matthias Goerner
+ *
+ * This file is part of the TkGL project.  TkGL is licensed under the Tcl
+ * license.  The terms of the license are described in the file
+ * "license.terms" which should be included with this distribution.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "tkgl.h"
+
+/*
+ * Constants from OpenGL 2.1 and ARB_sync, which older headers lack.
+ */
+
+#ifndef GL_PIXEL_PACK_BUFFER
+#  define GL_PIXEL_PACK_BUFFER		0x88EB
+#  define GL_PIXEL_PACK_BUFFER_BINDING	0x88ED
+#endif
+#ifndef GL_FRAMEBUFFER_BINDING
+#  define GL_FRAMEBUFFER_BINDING	0x8CA6
+#endif
+#ifndef GL_STREAM_READ
+#  define GL_STREAM_READ		0x88E1
+#endif
+#ifndef GL_READ_ONLY
+#  define GL_READ_ONLY			0x88B8
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#  define GL_SYNC_GPU_COMMANDS_COMPLETE	0x9117
+#  define GL_ALREADY_SIGNALED		0x911A
+#  define GL_TIMEOUT_EXPIRED		0x911B
+#  define GL_CONDITION_SATISFIED	0x911C
+#  define GL_WAIT_FAILED		0x911D
+#  define GL_SYNC_FLUSH_COMMANDS_BIT	0x00000001
+#endif
+
+/*
+ * A readback which has been started and not yet released.  When pbo is 0
+ * the pixels were read synchronously into the pixels buffer.
+ */
+
+typedef struct ReadbackSlot {
+    int id;			/* The handle of the readback, 0 if free. */
+    GLuint pbo;			/* Pixel pack buffer, kept between uses. */
+    size_t pboSize;		/* Size of the pixel pack buffer. */
+    TkglSync sync;		/* Fence after the read, or NULL. */
+    Tcl_WideInt frame;		/* Frame counter when the read was issued. */
+    int width, height;		/* Size of the region which was read. */
+    unsigned char *pixels;	/* Mapped buffer, or client memory. */
+    size_t pixelsSize;		/* Size of the client memory buffer. */
+    int mapped;			/* True if pixels points into the pbo. */
+} ReadbackSlot;
+
+typedef struct TkglReadbackRing {
+    ReadbackSlot slots[TKGL_READBACK_DEPTH];
+    int lastId;			/* The most recently issued handle. */
+} TkglReadbackRing;
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglGetBufferProcs --
+ *
+ *	Look up the buffer object and sync functions.  The lookup is done
+ *	once per process, since Tkgl_GetProcAddress returns addresses which
+ *	do not depend on the context, but whether the current context
+ *	supports the functions is checked on every call.
+ *
+ * Results:
+ *	The function table if the current context supports pixel pack
+ *	buffers, otherwise NULL.  The hasSync member says whether fences
+ *	may be used as well.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const TkglBufferProcs *
+TkglGetBufferProcs(void)
+{
+    static TkglBufferProcs procs;
+    static int initialized = 0;
+    const char *version = (const char *) glGetString(GL_VERSION);
+    const char *extensions = NULL;
+    int major = 0, minor = 0, hasPbo, hasSync;
+
+    if (version == NULL || sscanf(version, "%d.%d", &major, &minor) != 2) {
+	return NULL;
+    }
+    if (major < 3) {
+	/* GL_EXTENSIONS may not be queried this way in core profiles. */
+	extensions = (const char *) glGetString(GL_EXTENSIONS);
+    }
+    hasPbo = major > 2 || (major == 2 && minor >= 1) || (extensions
+	&& strstr(extensions, "GL_ARB_pixel_buffer_object") != NULL);
+    hasSync = major > 3 || (major == 3 && minor >= 2) || (extensions
+	&& strstr(extensions, "GL_ARB_sync") != NULL);
+    if (!hasPbo) {
+	return NULL;
+    }
+    if (!initialized) {
+	procs.genBuffers = (TkglGenBuffersProc *)
+	    Tkgl_GetProcAddress("glGenBuffers");
+	procs.deleteBuffers = (TkglDeleteBuffersProc *)
+	    Tkgl_GetProcAddress("glDeleteBuffers");
+	procs.bindBuffer = (TkglBindBufferProc *)
+	    Tkgl_GetProcAddress("glBindBuffer");
+	procs.bufferData = (TkglBufferDataProc *)
+	    Tkgl_GetProcAddress("glBufferData");
+	procs.mapBuffer = (TkglMapBufferProc *)
+	    Tkgl_GetProcAddress("glMapBuffer");
+	procs.unmapBuffer = (TkglUnmapBufferProc *)
+	    Tkgl_GetProcAddress("glUnmapBuffer");
+	procs.fenceSync = (TkglFenceSyncProc *)
+	    Tkgl_GetProcAddress("glFenceSync");
+	procs.clientWaitSync = (TkglClientWaitSyncProc *)
+	    Tkgl_GetProcAddress("glClientWaitSync");
+	procs.deleteSync = (TkglDeleteSyncProc *)
+	    Tkgl_GetProcAddress("glDeleteSync");
+	initialized = 1;
+    }
+    if (!procs.genBuffers || !procs.deleteBuffers || !procs.bindBuffer
+	    || !procs.bufferData || !procs.mapBuffer || !procs.unmapBuffer) {
+	return NULL;
+    }
+    procs.hasSync = hasSync && procs.fenceSync && procs.clientWaitSync
+	&& procs.deleteSync;
+    return &procs;
+}
+
+/*
+ * Return the slot holding the readback with the given handle, or NULL.
+ */
+
+static ReadbackSlot *
+FindSlot(
+    Tkgl *tkglPtr,
+    int id)
+{
+    TkglReadbackRing *ringPtr = tkglPtr->readback;
+    int i;
+
+    if (ringPtr == NULL || id <= 0) {
+	return NULL;
+    }
+    for (i = 0; i < TKGL_READBACK_DEPTH; i++) {
+	if (ringPtr->slots[i].id == id) {
+	    return &ringPtr->slots[i];
+	}
+    }
+    return NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglReadbackStart --
+ *
+ *	Start reading back a region of the widget, given in OpenGL window
+ *	coordinates, i.e. measured from the bottom left corner.  The read
+ *	buffer is the front buffer of a double buffered widget, as for
+ *	takephoto, unless a framebuffer object is bound, in which case it is
+ *	the framebuffer's read buffer.  The region must lie inside the
+ *	widget, or the framebuffer.
+ *
+ * Results:
+ *	A positive handle for the readback, or 0 if every buffer of the ring
+ *	holds a readback which has not been released.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglReadbackStart(
+    Tkgl *tkglPtr,
+    int x, int y,
+    int width, int height)
+{
+    TkglReadbackRing *ringPtr = tkglPtr->readback;
+    const TkglBufferProcs *procs;
+    ReadbackSlot *slotPtr = NULL;
+    size_t size = (size_t) width * height * 4;
+    GLint packAlignment, packRowLength, packBuffer = 0, readBuffer;
+    GLint framebuffer = 0;
+    int i;
+
+    if (ringPtr == NULL) {
+	ringPtr = (TkglReadbackRing *) ckalloc(sizeof(TkglReadbackRing));
+	memset(ringPtr, 0, sizeof(TkglReadbackRing));
+	tkglPtr->readback = ringPtr;
+    }
+    for (i = 0; i < TKGL_READBACK_DEPTH; i++) {
+	if (ringPtr->slots[i].id == 0) {
+	    slotPtr = &ringPtr->slots[i];
+	    break;
+	}
+    }
+    if (slotPtr == NULL) {
+	return 0;
+    }
+    if (++ringPtr->lastId <= 0) {
+	ringPtr->lastId = 1;
+    }
+    slotPtr->id = ringPtr->lastId;
+    slotPtr->width = width;
+    slotPtr->height = height;
+    slotPtr->frame = tkglPtr->stats.frames;
+    slotPtr->mapped = 0;
+
+    Tkgl_MakeCurrent(tkglPtr);
+    procs = TkglGetBufferProcs();
+    glGetIntegerv(GL_PACK_ALIGNMENT, &packAlignment);
+    glGetIntegerv(GL_PACK_ROW_LENGTH, &packRowLength);
+    glGetIntegerv(GL_READ_BUFFER, &readBuffer);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    if (TkglGetFramebufferProcs()) {
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+    }
+    if (tkglPtr->doubleFlag && framebuffer == 0) {
+	glReadBuffer(GL_FRONT);
+    }
+    if (procs) {
+	glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &packBuffer);
+	if (slotPtr->pbo == 0) {
+	    procs->genBuffers(1, &slotPtr->pbo);
+	    slotPtr->pboSize = 0;
+	}
+	procs->bindBuffer(GL_PIXEL_PACK_BUFFER, slotPtr->pbo);
+	if (slotPtr->pboSize != size) {
+	    procs->bufferData(GL_PIXEL_PACK_BUFFER, size, NULL,
+		GL_STREAM_READ);
+	    slotPtr->pboSize = size;
+	}
+	glReadPixels(x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	procs->bindBuffer(GL_PIXEL_PACK_BUFFER, packBuffer);
+	if (procs->hasSync) {
+	    slotPtr->sync = procs->fenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+	glFlush();
+    } else {
+	/* No pixel pack buffers: read synchronously into client memory. */
+	if (slotPtr->pixelsSize < size) {
+	    slotPtr->pixels = (unsigned char *)
+		ckrealloc(slotPtr->pixels, size);
+	    slotPtr->pixelsSize = size;
+	}
+	glReadPixels(x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE,
+	    slotPtr->pixels);
+    }
+    if (framebuffer == 0) {
+	glReadBuffer(readBuffer);
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, packAlignment);
+    glPixelStorei(GL_PACK_ROW_LENGTH, packRowLength);
+    return slotPtr->id;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglReadbackReady --
+ *
+ *	Check without blocking whether the pixels of a readback can be
+ *	collected.  Without fences a readback is assumed to be complete
+ *	once two more frames have been drawn.
+ *
+ * Results:
+ *	1 if the readback is complete, 0 if it is not, -1 if there is no
+ *	readback with the given handle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglReadbackReady(
+    Tkgl *tkglPtr,
+    int id)
+{
+    ReadbackSlot *slotPtr = FindSlot(tkglPtr, id);
+    const TkglBufferProcs *procs;
+    GLenum status;
+
+    if (slotPtr == NULL) {
+	return -1;
+    }
+    if (slotPtr->pbo == 0 || slotPtr->mapped) {
+	return 1;
+    }
+    if (slotPtr->sync == NULL) {
+	return tkglPtr->stats.frames >= slotPtr->frame + 2;
+    }
+    Tkgl_MakeCurrent(tkglPtr);
+    procs = TkglGetBufferProcs();
+    status = procs->clientWaitSync(slotPtr->sync, GL_SYNC_FLUSH_COMMANDS_BIT,
+	0);
+    return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED
+	|| status == GL_WAIT_FAILED;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglReadbackMap --
+ *
+ *	Get the pixels of a readback, waiting for it to complete if
+ *	necessary.  The pixels are RGBA, in OpenGL's bottom-up row order,
+ *	with rows of 4 * width bytes.  They remain valid until the readback
+ *	is released.
+ *
+ * Results:
+ *	A pointer to the pixels, or NULL if there is no readback with the
+ *	given handle or its buffer could not be mapped.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const unsigned char *
+TkglReadbackMap(
+    Tkgl *tkglPtr,
+    int id,
+    int *widthPtr,
+    int *heightPtr)
+{
+    ReadbackSlot *slotPtr = FindSlot(tkglPtr, id);
+    const TkglBufferProcs *procs;
+    GLint packBuffer;
+
+    if (slotPtr == NULL) {
+	return NULL;
+    }
+    *widthPtr = slotPtr->width;
+    *heightPtr = slotPtr->height;
+    if (slotPtr->pbo == 0 || slotPtr->mapped) {
+	return slotPtr->pixels;
+    }
+    Tkgl_MakeCurrent(tkglPtr);
+    procs = TkglGetBufferProcs();
+    if (procs == NULL) {
+	return NULL;
+    }
+    if (slotPtr->sync) {
+	/* Mapping waits anyway, but only for this readback. */
+	procs->clientWaitSync(slotPtr->sync, GL_SYNC_FLUSH_COMMANDS_BIT,
+	    (GLuint64) 1000000000);
+	procs->deleteSync(slotPtr->sync);
+	slotPtr->sync = NULL;
+    }
+    glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &packBuffer);
+    procs->bindBuffer(GL_PIXEL_PACK_BUFFER, slotPtr->pbo);
+    slotPtr->pixels = (unsigned char *)
+	procs->mapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    procs->bindBuffer(GL_PIXEL_PACK_BUFFER, packBuffer);
+    slotPtr->mapped = slotPtr->pixels != NULL;
+    return slotPtr->pixels;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglReadbackRelease --
+ *
+ *	Free the ring buffer used by a readback, so that it can be reused.
+ *	Its pixels may not be used afterwards.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglReadbackRelease(
+    Tkgl *tkglPtr,
+    int id)
+{
+    ReadbackSlot *slotPtr = FindSlot(tkglPtr, id);
+    const TkglBufferProcs *procs;
+    GLint packBuffer;
+
+    if (slotPtr == NULL) {
+	return;
+    }
+    if (slotPtr->pbo && (slotPtr->mapped || slotPtr->sync)) {
+	Tkgl_MakeCurrent(tkglPtr);
+	procs = TkglGetBufferProcs();
+	if (procs && slotPtr->mapped) {
+	    glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &packBuffer);
+	    procs->bindBuffer(GL_PIXEL_PACK_BUFFER, slotPtr->pbo);
+	    procs->unmapBuffer(GL_PIXEL_PACK_BUFFER);
+	    procs->bindBuffer(GL_PIXEL_PACK_BUFFER, packBuffer);
+	}
+	if (procs && slotPtr->sync) {
+	    procs->deleteSync(slotPtr->sync);
+	}
+	slotPtr->pixels = NULL;
+    }
+    slotPtr->sync = NULL;
+    slotPtr->mapped = 0;
+    slotPtr->id = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglReadbackFree --
+ *
+ *	Free the readback ring of a widget which is being destroyed.  The
+ *	buffer objects belong to the share group of the context, which may
+ *	outlive it, so they are always deleted explicitly.  If the context
+ *	can't be made current nothing is current, and they go away with it.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglReadbackFree(
+    Tkgl *tkglPtr)
+{
+    TkglReadbackRing *ringPtr = tkglPtr->readback;
+    const TkglBufferProcs *procs;
+    int i;
+
+    if (ringPtr == NULL) {
+	return;
+    }
+    Tkgl_MakeCurrent(tkglPtr);
+    procs = TkglGetBufferProcs();
+    for (i = 0; i < TKGL_READBACK_DEPTH; i++) {
+	ReadbackSlot *slotPtr = &ringPtr->slots[i];
+
+	if (procs && slotPtr->sync) {
+	    procs->deleteSync(slotPtr->sync);
+	}
+	if (procs && slotPtr->pbo) {
+	    /* Deleting a mapped buffer unmaps it. */
+	    procs->deleteBuffers(1, &slotPtr->pbo);
+	}
+	if (slotPtr->pixelsSize) {
+	    ckfree(slotPtr->pixels);
+	}
+    }
+    ckfree(ringPtr);
+    tkglPtr->readback = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglReadbackObjCmd --
+ *
+ *	Implements the readback widget command:
+ *
+ *	    $w readback start ?-region {x y width height}?
+ *	    $w readback ready handle
+ *	    $w readback fetch handle photo|bytearray ?-format format?
+ *	    $w readback release handle
+ *
+ *	The region is given in Tk coordinates, from the top left corner of
+ *	the widget, and defaults to the whole widget.  Fetching a readback
+ *	collects its pixels, waiting if it is not ready, and releases it.
+ *	The pixels go into the named photo image, or with the keyword
+ *	bytearray are returned as a byte array of top-down rows.  The format
+ *	of a byte array is rgba, the default, bgra, rgb or bgr.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglReadbackObjCmd(
+    Tkgl *tkglPtr,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[])
+{
+    static const char *const readbackOptions[] = {
+	"fetch", "ready", "release", "start", NULL
+    };
+    enum {
+	READBACK_FETCH, READBACK_READY, READBACK_RELEASE, READBACK_START
+    };
+    static const char *const formatNames[] = {
+	"rgba", "bgra", "rgb", "bgr", NULL
+    };
+    static const GLenum formats[] = {GL_RGBA, GL_BGRA, GL_RGB, GL_BGR};
+    static const int formatSizes[] = {4, 4, 3, 3};
+    static const char *const startOptions[] = {"-region", NULL};
+    static const char *const fetchOptions[] = {"-format", NULL};
+    int index, id, x, y, width, height, ready, format = 0;
+    const unsigned char *pixels;
+    Tk_PhotoHandle photo = NULL;
+
+    if (objc < 3) {
+	Tcl_WrongNumArgs(interp, 2, objv, "option ?arg ...?");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObjStruct(interp, objv[2], readbackOptions,
+	    sizeof(char *), "option", 0, &index) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (index == READBACK_START) {
+	x = 0;
+	y = 0;
+	width = tkglPtr->width;
+	height = tkglPtr->height;
+	if (objc == 5) {
+	    Tcl_Size count;
+	    Tcl_Obj **elems;
+	    int option;
+
+	    if (Tcl_GetIndexFromObjStruct(interp, objv[3], startOptions,
+		    sizeof(char *), "option", 0, &option) != TCL_OK
+		    || Tcl_ListObjGetElements(interp, objv[4], &count, &elems)
+		    != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (count != 4
+		    || Tcl_GetIntFromObj(interp, elems[0], &x) != TCL_OK
+		    || Tcl_GetIntFromObj(interp, elems[1], &y) != TCL_OK
+		    || Tcl_GetIntFromObj(interp, elems[2], &width) != TCL_OK
+		    || Tcl_GetIntFromObj(interp, elems[3], &height) != TCL_OK) {
+		Tcl_SetResult(interp, "the region must be a list of four "
+		    "integers: x y width height", TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	} else if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "?-region {x y width height}?");
+	    return TCL_ERROR;
+	}
+	if (x < 0 || y < 0 || width <= 0 || height <= 0
+		|| x + width > tkglPtr->width || y + height > tkglPtr->height) {
+	    Tcl_SetResult(interp, "the region must lie inside the widget",
+		TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	id = TkglReadbackStart(tkglPtr, x, tkglPtr->height - y - height,
+	    width, height);
+	if (id == 0) {
+	    Tcl_SetResult(interp, "all readback buffers are in use",
+		TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	Tcl_SetObjResult(interp, Tcl_NewIntObj(id));
+	return TCL_OK;
+    }
+
+    if (index == READBACK_FETCH && objc == 7) {
+	int option;
+
+	if (Tcl_GetIndexFromObjStruct(interp, objv[5], fetchOptions,
+		sizeof(char *), "option", 0, &option) != TCL_OK
+		|| Tcl_GetIndexFromObjStruct(interp, objv[6], formatNames,
+		sizeof(char *), "format", 0, &format) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+    } else if (objc != (index == READBACK_FETCH ? 5 : 4)) {
+	Tcl_WrongNumArgs(interp, 3, objv, index == READBACK_FETCH ?
+	    "handle photo|bytearray ?-format format?" : "handle");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIntFromObj(interp, objv[3], &id) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (FindSlot(tkglPtr, id) == NULL) {
+	Tcl_AppendResult(interp, "no pending readback \"",
+	    Tcl_GetString(objv[3]), "\"", NULL);
+	return TCL_ERROR;
+    }
+    switch (index) {
+    case READBACK_READY:
+	ready = TkglReadbackReady(tkglPtr, id);
+	Tcl_SetObjResult(interp, Tcl_NewBooleanObj(ready > 0));
+	return TCL_OK;
+    case READBACK_RELEASE:
+	TkglReadbackRelease(tkglPtr, id);
+	return TCL_OK;
+    default:
+	break;
+    }
+
+    /*
+     * READBACK_FETCH.  The photo is looked up first, so that a bad name
+     * leaves the readback pending rather than losing its frame.
+     */
+
+    if (strcmp(Tcl_GetString(objv[4]), "bytearray") != 0) {
+	const char *name = Tcl_GetString(objv[4]);
+
+	photo = Tk_FindPhoto(interp, name);
+	if (photo == NULL) {
+	    Tcl_AppendResult(interp, "image \"", name,
+		"\" doesn't exist or is not a photo image", NULL);
+	    return TCL_ERROR;
+	}
+	if (objc == 7) {
+	    Tcl_SetResult(interp, "-format only applies to a bytearray",
+		TCL_STATIC);
+	    return TCL_ERROR;
+	}
+    }
+    pixels = TkglReadbackMap(tkglPtr, id, &width, &height);
+    if (pixels == NULL) {
+	TkglReadbackRelease(tkglPtr, id);
+	Tcl_SetResult(interp, "the readback buffer could not be mapped",
+	    TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (photo == NULL) {
+	size_t rowBytes = (size_t) width * 4;
+	size_t count = (size_t) width * height;
+	Tcl_Obj *bytesObj = Tcl_NewByteArrayObj(NULL, 0);
+	unsigned char *bytes =
+		Tcl_SetByteArrayLength(bytesObj, rowBytes * height);
+
+	/* Flip, then convert in place, which may shrink the pixels. */
+	TkglFlipRows(bytes, pixels, rowBytes, height);
+	if (formats[format] != GL_RGBA) {
+	    (void) TkglConvertPixels(bytes, formats[format], bytes, GL_RGBA,
+		count);
+	    Tcl_SetByteArrayLength(bytesObj, count * formatSizes[format]);
+	}
+	Tcl_SetObjResult(interp, bytesObj);
+    } else if (TkglPutPhotoPixels(tkglPtr, photo, pixels, GL_RGBA, 0, 0,
+	    width, height) != TCL_OK) {
+	TkglReadbackRelease(tkglPtr, id);
+	return TCL_ERROR;
+    }
+    TkglReadbackRelease(tkglPtr, id);
+    return TCL_OK;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * fill-column: 78
+ * End:
+ */
@@ -0,0 +1,909 @@
+/*
+ * tkglRecord.c --
+ *
+ *	Recording the frames drawn by a Tkgl widget to disk.  Each frame is
+ *	captured with an asynchronous readback when it is drawn and collected
+ *	a frame or two later, without waiting for the GPU.  The collected
+ *	pixels are copied into one of a fixed pool of frame buffers and queued
+ *	for a set of worker threads, which convert, compress and write them.
+ *	The thread running the event loop never encodes or touches the output
+ *	files.  When every frame buffer is waiting to be written, or every
+ *	readback buffer is in use, new frames are dropped rather than making
+ *	the widget wait for the encoders.
+ *
+ *	Three formats are supported: y4m, a YUV4MPEG2 stream with 4:4:4
+ *	chroma which video encoders read directly; png-seq, one PNG file per
+ *	frame; and raw, a stream of top-down RGBA frames with no header.
+ *	The PNG writer streams rows, and is also used by renderlarge.
+ *
+ * Copyright (C) 2024, Marc Culler, Nathan Dunfield, Matthias Goerner
+ *
+ * This file is part of the TkGL project.  TkGL is licensed under the Tcl
+ * license.  The terms of the license are described in the file
+ * "license.terms" which should be included with this distribution.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "tkgl.h"
+
+#define MAX_RECORD_THREADS 16
+
+enum RecordFormat {
+    FORMAT_Y4M, FORMAT_PNG_SEQ, FORMAT_RAW
+};
+
+static const char *const recordFormats[] = {
+    "y4m", "png-seq", "raw", NULL
+};
+
+/*
+ * A frame buffer.  It is on the free list, in the queue, or owned by the
+ * worker which is encoding it.
+ */
+
+typedef struct RecordFrame {
+    struct RecordFrame *next;
+    Tcl_WideInt seq;		/* Position of the frame in the recording. */
+    unsigned char *pixels;	/* Top-down RGBA rows. */
+} RecordFrame;
+
+typedef struct TkglRecorder {
+    char *fileName;		/* The output file, or the pattern from which
+				 * png-seq file names are made. */
+    int format;			/* One of enum RecordFormat. */
+    int width, height;		/* Size of the recorded frames. */
+    int fps;			/* Frame rate written to y4m headers. */
+    int numThreads;
+    Tcl_ThreadId threads[MAX_RECORD_THREADS];
+    RecordFrame *frames;	/* All of the frame buffers. */
+    int numFrames;
+    int pending[TKGL_READBACK_DEPTH]; /* Readbacks in flight, oldest first. */
+    int numPending;
+
+    /*
+     * Fields shared with the workers, protected by queueMutex.  It is only
+     * held briefly, so the event loop never waits for a worker's I/O.
+     */
+
+    Tcl_Mutex queueMutex;
+    Tcl_Condition queueCond;	/* Signalled when a frame is queued, or when
+				 * the recording stops. */
+    RecordFrame *freeList;	/* Frame buffers ready to be filled. */
+    RecordFrame *queueHead;	/* Frames waiting for a worker. */
+    RecordFrame *queueTail;
+    Tcl_WideInt nextSeq;	/* Sequence number of the next queued frame. */
+    int stopping;		/* Workers exit when the queue is empty. */
+    Tcl_WideInt captured;	/* Frames which were queued. */
+    Tcl_WideInt dropped;	/* Frames which were not recorded. */
+    Tcl_WideInt written;	/* Frames which were written. */
+    char *error;		/* The first error reported by a worker. */
+
+    /*
+     * Fields used by the workers to write stream formats in order,
+     * protected by writeMutex.
+     */
+
+    Tcl_Mutex writeMutex;
+    Tcl_Condition writeCond;	/* Signalled when nextWrite changes. */
+    Tcl_WideInt nextWrite;	/* Sequence number of the next frame to be
+				 * written to the stream. */
+    FILE *file;			/* The stream, opened by the first write. */
+} TkglRecorder;
+
+/*
+ * Record the first error which happens in a worker.
+ */
+
+static void
+SetRecordError(
+    TkglRecorder *recPtr,
+    const char *message,
+    const char *fileName)
+{
+    Tcl_MutexLock(&recPtr->queueMutex);
+    if (recPtr->error == NULL) {
+	size_t length = strlen(message) + strlen(fileName) + 4;
+
+	recPtr->error = (char *) ckalloc(length);
+	snprintf(recPtr->error, length, "%s \"%s\"", message, fileName);
+    }
+    Tcl_MutexUnlock(&recPtr->queueMutex);
+}
+
+/*
+ * Convert RGBA pixels to three full resolution planes of BT.601 limited
+ * range YCbCr, as expected by the C444 colorspace of YUV4MPEG2.
+ */
+
+static void
+RGBAToYCbCr(
+    unsigned char *dst,
+    const unsigned char *src,
+    size_t count)
+{
+    unsigned char *yPlane = dst, *cbPlane = dst + count;
+    unsigned char *crPlane = dst + 2 * count;
+    size_t i;
+
+    for (i = 0; i < count; i++, src += 4) {
+	int r = src[0], g = src[1], b = src[2];
+
+	yPlane[i] = (unsigned char) (16 + ((66 * r + 129 * g + 25 * b + 128) >> 8));
+	cbPlane[i] = (unsigned char) (128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8));
+	crPlane[i] = (unsigned char) (128 + ((112 * r - 94 * g - 18 * b + 128) >> 8));
+    }
+}
+
+/*
+ * Write a 32 bit big endian integer, as used in PNG files.
+ */
+
+static void
+PutBE32(
+    unsigned char *p,
+    unsigned int value)
+{
+    p[0] = (unsigned char) (value >> 24);
+    p[1] = (unsigned char) (value >> 16);
+    p[2] = (unsigned char) (value >> 8);
+    p[3] = (unsigned char) value;
+}
+
+static int
+WritePNGChunk(
+    FILE *file,
+    const char *type,
+    const unsigned char *data,
+    size_t length)
+{
+    unsigned char header[8], trailer[4];
+    unsigned int crc;
+
+    PutBE32(header, (unsigned int) length);
+    memcpy(header + 4, type, 4);
+    crc = Tcl_ZlibCRC32(0, header + 4, 4);
+    if (length > 0) {
+	crc = Tcl_ZlibCRC32(crc, data, (int) length);
+    }
+    PutBE32(trailer, crc);
+    return fwrite(header, 1, 8, file) == 8
+	&& (length == 0 || fwrite(data, 1, length, file) == length)
+	&& fwrite(trailer, 1, 4, file) == 4;
+}
+
+/*
+ * A PNG file which is written a few rows at a time, so that images of any
+ * size can be written without holding them in memory.  The pixels are 8
+ * bit RGBA, and the rows use the Up filter, which is cheap and compresses
+ * rendered images well.
+ */
+
+struct TkglPNGWriter {
+    FILE *file;
+    Tcl_ZlibStream stream;	/* Deflates the filtered rows. */
+    size_t rowBytes;
+    int height;
+    int rowsWritten;
+    unsigned char *lastRow;	/* The previous row, for the Up filter. */
+    Tcl_Obj *rawObj;		/* Filtered rows for the stream. */
+    Tcl_Obj *compressedObj;	/* Output of the stream. */
+    int ok;			/* False after any error. */
+};
+
+/*
+ * Write the data which the stream has compressed so far as an IDAT chunk.
+ */
+
+static void
+FlushPNG(
+    TkglPNGWriter *pngPtr)
+{
+    const unsigned char *compressed;
+    Tcl_Size length;
+
+    if (Tcl_ZlibStreamGet(pngPtr->stream, pngPtr->compressedObj, -1)
+	    != TCL_OK) {
+	pngPtr->ok = 0;
+	return;
+    }
+    compressed = Tcl_GetByteArrayFromObj(pngPtr->compressedObj, &length);
+    if (length > 0) {
+	pngPtr->ok = pngPtr->ok
+	    && WritePNGChunk(pngPtr->file, "IDAT", compressed, length);
+	Tcl_SetByteArrayLength(pngPtr->compressedObj, 0);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglPNGOpen --
+ *
+ *	Create a PNG file and write its header.
+ *
+ * Results:
+ *	A writer for the rows of the image, or NULL if the file could not be
+ *	created.
+ *
+ *----------------------------------------------------------------------
+ */
+
+TkglPNGWriter *
+TkglPNGOpen(
+    const char *fileName,
+    int width,
+    int height)
+{
+    static const unsigned char signature[8] = {
+	0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'
+    };
+    TkglPNGWriter *pngPtr;
+    unsigned char ihdr[13];
+    FILE *file;
+
+    file = fopen(fileName, "wb");
+    if (file == NULL) {
+	return NULL;
+    }
+    pngPtr = (TkglPNGWriter *) ckalloc(sizeof(TkglPNGWriter));
+    memset(pngPtr, 0, sizeof(TkglPNGWriter));
+    pngPtr->file = file;
+    pngPtr->rowBytes = (size_t) width * 4;
+    pngPtr->height = height;
+    pngPtr->lastRow = (unsigned char *) ckalloc(pngPtr->rowBytes);
+    pngPtr->rawObj = Tcl_NewByteArrayObj(NULL, 0);
+    Tcl_IncrRefCount(pngPtr->rawObj);
+    pngPtr->compressedObj = Tcl_NewByteArrayObj(NULL, 0);
+    Tcl_IncrRefCount(pngPtr->compressedObj);
+    pngPtr->ok = Tcl_ZlibStreamInit(NULL, TCL_ZLIB_STREAM_DEFLATE,
+	TCL_ZLIB_FORMAT_ZLIB, 3, NULL, &pngPtr->stream) == TCL_OK;
+    if (!pngPtr->ok) {
+	pngPtr->stream = NULL;
+    }
+
+    PutBE32(ihdr, (unsigned int) width);
+    PutBE32(ihdr + 4, (unsigned int) height);
+    ihdr[8] = 8;		/* bit depth */
+    ihdr[9] = 6;		/* color type: RGBA */
+    ihdr[10] = 0;		/* deflate */
+    ihdr[11] = 0;		/* adaptive filtering */
+    ihdr[12] = 0;		/* no interlace */
+    pngPtr->ok = pngPtr->ok && fwrite(signature, 1, 8, file) == 8
+	&& WritePNGChunk(file, "IHDR", ihdr, 13);
+    return pngPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglPNGWriteRows --
+ *
+ *	Filter and compress the next rows of the image, which are top-down
+ *	RGBA, and write whatever the compressor has produced.
+ *
+ * Results:
+ *	1 on success, 0 if anything written so far has failed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglPNGWriteRows(
+    TkglPNGWriter *pngPtr,
+    const unsigned char *pixels,
+    int count)
+{
+    size_t rowBytes = pngPtr->rowBytes, x;
+    const unsigned char *row, *above;
+    unsigned char *raw, *out;
+    int y;
+
+    if (!pngPtr->ok || count <= 0) {
+	return pngPtr->ok;
+    }
+    raw = Tcl_SetByteArrayLength(pngPtr->rawObj, (rowBytes + 1) * count);
+    for (y = 0; y < count; y++) {
+	row = pixels + y * rowBytes;
+	above = y > 0 ? row - rowBytes : pngPtr->lastRow;
+	out = raw + y * (rowBytes + 1);
+	if (pngPtr->rowsWritten + y == 0) {
+	    out[0] = 0;
+	    memcpy(out + 1, row, rowBytes);
+	} else {
+	    out[0] = 2;
+	    for (x = 0; x < rowBytes; x++) {
+		out[x + 1] = (unsigned char) (row[x] - above[x]);
+	    }
+	}
+    }
+    memcpy(pngPtr->lastRow, pixels + (count - 1) * rowBytes, rowBytes);
+    pngPtr->rowsWritten += count;
+    pngPtr->ok = Tcl_ZlibStreamPut(pngPtr->stream, pngPtr->rawObj,
+	TCL_ZLIB_NO_FLUSH) == TCL_OK;
+    if (pngPtr->ok) {
+	FlushPNG(pngPtr);
+    }
+    return pngPtr->ok;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglPNGClose --
+ *
+ *	Finish the compressed data, write the end of the file, close it and
+ *	free the writer.
+ *
+ * Results:
+ *	1 if the whole image was written, otherwise 0.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglPNGClose(
+    TkglPNGWriter *pngPtr)
+{
+    int ok = pngPtr->ok && pngPtr->rowsWritten == pngPtr->height;
+
+    if (ok) {
+	Tcl_SetByteArrayLength(pngPtr->rawObj, 0);
+	ok = Tcl_ZlibStreamPut(pngPtr->stream, pngPtr->rawObj,
+	    TCL_ZLIB_FINALIZE) == TCL_OK;
+	if (ok) {
+	    FlushPNG(pngPtr);
+	    ok = pngPtr->ok && WritePNGChunk(pngPtr->file, "IEND", NULL, 0);
+	}
+    }
+    if (pngPtr->stream) {
+	Tcl_ZlibStreamClose(pngPtr->stream);
+    }
+    ok = (fclose(pngPtr->file) == 0) && ok;
+    Tcl_DecrRefCount(pngPtr->rawObj);
+    Tcl_DecrRefCount(pngPtr->compressedObj);
+    ckfree(pngPtr->lastRow);
+    ckfree(pngPtr);
+    return ok;
+}
+
+/*
+ * Encode a frame as a PNG file.
+ */
+
+static int
+WritePNG(
+    const char *fileName,
+    const unsigned char *pixels,
+    int width,
+    int height)
+{
+    TkglPNGWriter *pngPtr = TkglPNGOpen(fileName, width, height);
+
+    if (pngPtr == NULL) {
+	return 0;
+    }
+    TkglPNGWriteRows(pngPtr, pixels, height);
+    return TkglPNGClose(pngPtr);
+}
+
+/*
+ * Make the name of a file of a png-seq recording by inserting the frame
+ * number, with six digits, before the extension of the pattern.
+ */
+
+static void
+MakeFrameFileName(
+    Tcl_DString *dsPtr,
+    const char *pattern,
+    Tcl_WideInt seq)
+{
+    const char *slash = strrchr(pattern, '/');
+    const char *dot = strrchr(pattern, '.');
+    char number[TCL_INTEGER_SPACE + 2];
+
+    if (dot == NULL || (slash && dot < slash)) {
+	dot = pattern + strlen(pattern);
+    }
+    snprintf(number, sizeof(number), "%06" TCL_LL_MODIFIER "d", seq);
+    Tcl_DStringInit(dsPtr);
+    Tcl_DStringAppend(dsPtr, pattern, dot - pattern);
+    Tcl_DStringAppend(dsPtr, number, TCL_INDEX_NONE);
+    Tcl_DStringAppend(dsPtr, *dot ? dot : ".png", TCL_INDEX_NONE);
+}
+
+/*
+ * Append an encoded frame to the y4m or raw stream.  Workers may finish
+ * encoding out of order, so each waits here for its turn.
+ */
+
+static int
+WriteStreamFrame(
+    TkglRecorder *recPtr,
+    Tcl_WideInt seq,
+    const unsigned char *data,
+    size_t length)
+{
+    int ok = 1;
+
+    Tcl_MutexLock(&recPtr->writeMutex);
+    while (recPtr->nextWrite != seq) {
+	Tcl_ConditionWait(&recPtr->writeCond, &recPtr->writeMutex, NULL);
+    }
+    if (recPtr->file == NULL && seq == 0) {
+	recPtr->file = fopen(recPtr->fileName, "wb");
+	if (recPtr->file && recPtr->format == FORMAT_Y4M) {
+	    ok = fprintf(recPtr->file,
+		"YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n",
+		recPtr->width, recPtr->height, recPtr->fps) > 0;
+	}
+    }
+    if (recPtr->file == NULL) {
+	ok = 0;
+    } else if (data) {
+	if (recPtr->format == FORMAT_Y4M) {
+	    ok = ok && fputs("FRAME\n", recPtr->file) >= 0;
+	}
+	ok = ok && fwrite(data, 1, length, recPtr->file) == length;
+    } else {
+	ok = 0;
+    }
+    recPtr->nextWrite++;
+    Tcl_ConditionNotify(&recPtr->writeCond);
+    Tcl_MutexUnlock(&recPtr->writeMutex);
+    return ok;
+}
+
+/*
+ * The worker threads.  Each takes frames from the queue in order, encodes
+ * them and writes them, then returns the frame buffer to the free list.
+ */
+
+static Tcl_ThreadCreateType
+RecordWorker(
+    void *clientData)
+{
+    TkglRecorder *recPtr = (TkglRecorder *) clientData;
+    size_t count = (size_t) recPtr->width * recPtr->height;
+    unsigned char *scratch = NULL;
+    RecordFrame *framePtr;
+    Tcl_DString name;
+    int ok;
+
+    if (recPtr->format == FORMAT_Y4M) {
+	scratch = (unsigned char *) ckalloc(count * 3);
+    }
+    Tcl_MutexLock(&recPtr->queueMutex);
+    for (;;) {
+	while (recPtr->queueHead == NULL && !recPtr->stopping) {
+	    Tcl_ConditionWait(&recPtr->queueCond, &recPtr->queueMutex, NULL);
+	}
+	framePtr = recPtr->queueHead;
+	if (framePtr == NULL) {
+	    break;
+	}
+	recPtr->queueHead = framePtr->next;
+	if (recPtr->queueHead == NULL) {
+	    recPtr->queueTail = NULL;
+	}
+	Tcl_MutexUnlock(&recPtr->queueMutex);
+
+	switch (recPtr->format) {
+	case FORMAT_PNG_SEQ:
+	    MakeFrameFileName(&name, recPtr->fileName, framePtr->seq);
+	    ok = WritePNG(Tcl_DStringValue(&name), framePtr->pixels,
+		recPtr->width, recPtr->height);
+	    if (!ok) {
+		SetRecordError(recPtr, "error writing",
+		    Tcl_DStringValue(&name));
+	    }
+	    Tcl_DStringFree(&name);
+	    break;
+	case FORMAT_Y4M:
+	    RGBAToYCbCr(scratch, framePtr->pixels, count);
+	    ok = WriteStreamFrame(recPtr, framePtr->seq, scratch, count * 3);
+	    break;
+	default:
+	    ok = WriteStreamFrame(recPtr, framePtr->seq, framePtr->pixels,
+		count * 4);
+	    break;
+	}
+	if (!ok && recPtr->format != FORMAT_PNG_SEQ) {
+	    SetRecordError(recPtr, "error writing", recPtr->fileName);
+	}
+
+	Tcl_MutexLock(&recPtr->queueMutex);
+	if (ok) {
+	    recPtr->written++;
+	}
+	framePtr->next = recPtr->freeList;
+	recPtr->freeList = framePtr;
+    }
+    Tcl_MutexUnlock(&recPtr->queueMutex);
+    if (scratch) {
+	ckfree(scratch);
+    }
+    Tcl_ExitThread(TCL_OK);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ * Collect the readback with the oldest pending handle, and queue its
+ * pixels for the workers.  The frame is dropped if every frame buffer is
+ * still waiting to be written.
+ */
+
+static void
+CollectFrame(
+    Tkgl *tkglPtr,
+    TkglRecorder *recPtr)
+{
+    int id = recPtr->pending[0], width, height;
+    const unsigned char *pixels;
+    RecordFrame *framePtr;
+
+    recPtr->numPending--;
+    memmove(recPtr->pending, recPtr->pending + 1,
+	recPtr->numPending * sizeof(int));
+
+    Tcl_MutexLock(&recPtr->queueMutex);
+    framePtr = recPtr->freeList;
+    if (framePtr) {
+	recPtr->freeList = framePtr->next;
+    } else {
+	recPtr->dropped++;
+    }
+    Tcl_MutexUnlock(&recPtr->queueMutex);
+
+    pixels = framePtr ? TkglReadbackMap(tkglPtr, id, &width, &height) : NULL;
+    if (pixels) {
+	TkglFlipRows(framePtr->pixels, pixels, (size_t) width * 4, height);
+    }
+    TkglReadbackRelease(tkglPtr, id);
+    if (framePtr == NULL) {
+	return;
+    }
+
+    Tcl_MutexLock(&recPtr->queueMutex);
+    if (pixels) {
+	framePtr->seq = recPtr->nextSeq++;
+	framePtr->next = NULL;
+	if (recPtr->queueTail) {
+	    recPtr->queueTail->next = framePtr;
+	} else {
+	    recPtr->queueHead = framePtr;
+	}
+	recPtr->queueTail = framePtr;
+	recPtr->captured++;
+	Tcl_ConditionNotify(&recPtr->queueCond);
+    } else {
+	framePtr->next = recPtr->freeList;
+	recPtr->freeList = framePtr;
+	recPtr->dropped++;
+    }
+    Tcl_MutexUnlock(&recPtr->queueMutex);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglRecordFrame --
+ *
+ *	Called by TkglDisplay after each frame has been drawn.  Collects the
+ *	earlier frames whose readbacks have completed, then starts reading
+ *	back the new frame.  Frames are dropped when no readback buffer is
+ *	available or when the widget no longer has the size of the recording.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglRecordFrame(
+    Tkgl *tkglPtr)
+{
+    TkglRecorder *recPtr = tkglPtr->recorder;
+    int id = 0;
+
+    while (recPtr->numPending > 0
+	    && TkglReadbackReady(tkglPtr, recPtr->pending[0]) != 0) {
+	CollectFrame(tkglPtr, recPtr);
+    }
+    if (tkglPtr->width == recPtr->width && tkglPtr->height == recPtr->height
+	    && recPtr->numPending < TKGL_READBACK_DEPTH) {
+	id = TkglReadbackStart(tkglPtr, 0, 0, recPtr->width, recPtr->height);
+    }
+    if (id) {
+	recPtr->pending[recPtr->numPending++] = id;
+    } else {
+	Tcl_MutexLock(&recPtr->queueMutex);
+	recPtr->dropped++;
+	Tcl_MutexUnlock(&recPtr->queueMutex);
+    }
+}
+
+/*
+ * Return the counters of the recording, and its error if there is one.
+ */
+
+static Tcl_Obj *
+GetRecordStatus(
+    TkglRecorder *recPtr)
+{
+    Tcl_Obj *dictObj = Tcl_NewDictObj();
+
+    Tcl_MutexLock(&recPtr->queueMutex);
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("file", TCL_INDEX_NONE),
+	Tcl_NewStringObj(recPtr->fileName, TCL_INDEX_NONE));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("format", TCL_INDEX_NONE),
+	Tcl_NewStringObj(recordFormats[recPtr->format], TCL_INDEX_NONE));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("captured", TCL_INDEX_NONE),
+	Tcl_NewWideIntObj(recPtr->captured));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("dropped", TCL_INDEX_NONE),
+	Tcl_NewWideIntObj(recPtr->dropped));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("written", TCL_INDEX_NONE),
+	Tcl_NewWideIntObj(recPtr->written));
+    if (recPtr->error) {
+	Tcl_DictObjPut(NULL, dictObj,
+	    Tcl_NewStringObj("error", TCL_INDEX_NONE),
+	    Tcl_NewStringObj(recPtr->error, TCL_INDEX_NONE));
+    }
+    Tcl_MutexUnlock(&recPtr->queueMutex);
+    return dictObj;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglRecordStop --
+ *
+ *	Stop recording.  The frames which are still being read back are
+ *	collected, unless collect is false because the widget is being
+ *	destroyed, the workers finish writing the queued frames, and the
+ *	output is closed.  This waits for the workers, since the recording is
+ *	not complete until they are done.
+ *
+ * Results:
+ *	The final status of the recording, as returned by record status, or
+ *	NULL if the widget was not recording.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Tcl_Obj *
+TkglRecordStop(
+    Tkgl *tkglPtr,
+    int collect)
+{
+    TkglRecorder *recPtr = tkglPtr->recorder;
+    Tcl_Obj *statusObj;
+    int i, threadResult;
+
+    if (recPtr == NULL) {
+	return NULL;
+    }
+    while (recPtr->numPending > 0) {
+	if (collect) {
+	    CollectFrame(tkglPtr, recPtr);
+	} else {
+	    recPtr->numPending--;
+	    recPtr->dropped++;
+	}
+    }
+    Tcl_MutexLock(&recPtr->queueMutex);
+    recPtr->stopping = 1;
+    Tcl_ConditionNotify(&recPtr->queueCond);
+    Tcl_MutexUnlock(&recPtr->queueMutex);
+    for (i = 0; i < recPtr->numThreads; i++) {
+	Tcl_JoinThread(recPtr->threads[i], &threadResult);
+    }
+    if (recPtr->file) {
+	if (fclose(recPtr->file) != 0 && recPtr->error == NULL) {
+	    SetRecordError(recPtr, "error closing", recPtr->fileName);
+	}
+    }
+    statusObj = GetRecordStatus(recPtr);
+
+    Tcl_MutexFinalize(&recPtr->queueMutex);
+    Tcl_MutexFinalize(&recPtr->writeMutex);
+    Tcl_ConditionFinalize(&recPtr->queueCond);
+    Tcl_ConditionFinalize(&recPtr->writeCond);
+    for (i = 0; i < recPtr->numFrames; i++) {
+	ckfree(recPtr->frames[i].pixels);
+    }
+    ckfree(recPtr->frames);
+    if (recPtr->error) {
+	ckfree(recPtr->error);
+    }
+    ckfree(recPtr->fileName);
+    ckfree(recPtr);
+    tkglPtr->recorder = NULL;
+    return statusObj;
+}
+
+/*
+ * Start recording, as described for TkglRecordObjCmd.
+ */
+
+static int
+RecordStart(
+    Tkgl *tkglPtr,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[])
+{
+    static const char *const startOptions[] = {
+	"-format", "-fps", "-threads", NULL
+    };
+    enum { START_FORMAT, START_FPS, START_THREADS };
+    const char *fileName, *ext;
+    int i, index, format, fps = 30, numThreads = 2;
+    size_t frameSize;
+    TkglRecorder *recPtr;
+
+    if (objc < 4 || (objc % 2) != 0) {
+	Tcl_WrongNumArgs(interp, 3, objv,
+	    "file ?-format y4m|png-seq|raw? ?-fps n? ?-threads n?");
+	return TCL_ERROR;
+    }
+    if (tkglPtr->recorder) {
+	Tcl_SetResult(interp, "the widget is already recording", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    fileName = Tcl_GetString(objv[3]);
+    ext = strrchr(fileName, '.');
+    format = (ext && strcmp(ext, ".y4m") == 0) ? FORMAT_Y4M :
+	(ext && strcmp(ext, ".png") == 0) ? FORMAT_PNG_SEQ : FORMAT_RAW;
+    for (i = 4; i < objc; i += 2) {
+	if (Tcl_GetIndexFromObjStruct(interp, objv[i], startOptions,
+		sizeof(char *), "option", 0, &index) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	switch (index) {
+	case START_FORMAT:
+	    if (Tcl_GetIndexFromObjStruct(interp, objv[i + 1], recordFormats,
+		    sizeof(char *), "format", 0, &format) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    break;
+	case START_FPS:
+	    if (Tcl_GetIntFromObj(interp, objv[i + 1], &fps) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (fps <= 0) {
+		Tcl_SetResult(interp, "the frame rate must be positive",
+		    TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    break;
+	case START_THREADS:
+	    if (Tcl_GetIntFromObj(interp, objv[i + 1], &numThreads)
+		    != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (numThreads < 1 || numThreads > MAX_RECORD_THREADS) {
+		Tcl_SetResult(interp, "the number of threads must be between "
+		    "1 and 16", TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    break;
+	}
+    }
+    if (tkglPtr->width <= 0 || tkglPtr->height <= 0) {
+	Tcl_SetResult(interp, "the widget has no size", TCL_STATIC);
+	return TCL_ERROR;
+    }
+
+    recPtr = (TkglRecorder *) ckalloc(sizeof(TkglRecorder));
+    memset(recPtr, 0, sizeof(TkglRecorder));
+    recPtr->fileName = (char *) ckalloc(strlen(fileName) + 1);
+    strcpy(recPtr->fileName, fileName);
+    recPtr->format = format;
+    recPtr->width = tkglPtr->width;
+    recPtr->height = tkglPtr->height;
+    recPtr->fps = fps;
+
+    /*
+     * Each worker needs a frame to encode, and a couple more let the
+     * queue absorb short stalls in the encoders.
+     */
+
+    recPtr->numFrames = numThreads + 2;
+    recPtr->frames = (RecordFrame *)
+	ckalloc(recPtr->numFrames * sizeof(RecordFrame));
+    frameSize = (size_t) recPtr->width * recPtr->height * 4;
+    for (i = 0; i < recPtr->numFrames; i++) {
+	recPtr->frames[i].pixels = (unsigned char *) ckalloc(frameSize);
+	recPtr->frames[i].next = recPtr->freeList;
+	recPtr->freeList = &recPtr->frames[i];
+    }
+    for (i = 0; i < numThreads; i++) {
+	if (Tcl_CreateThread(&recPtr->threads[i], RecordWorker, recPtr,
+		TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+	    break;
+	}
+    }
+    recPtr->numThreads = i;
+    tkglPtr->recorder = recPtr;
+    if (i < numThreads) {
+	Tcl_DecrRefCount(TkglRecordStop(tkglPtr, 0));
+	Tcl_SetResult(interp, "could not create the recording threads",
+	    TCL_STATIC);
+	return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglRecordObjCmd --
+ *
+ *	Implements the record widget command:
+ *
+ *	    $w record start file ?-format y4m|png-seq|raw? ?-fps n?
+ *		?-threads n?
+ *	    $w record status
+ *	    $w record stop
+ *
+ *	The format defaults to y4m for a .y4m file, png-seq for a .png file
+ *	and raw otherwise.  For png-seq the frame number is inserted before
+ *	the extension of the file name.  The frame rate is only written to
+ *	the header of y4m files.  The size of the recording is the size of
+ *	the widget when it starts; frames drawn at any other size are
+ *	dropped.  The status is a dict with the keys file, format, captured,
+ *	dropped and written, and error if a worker failed.  Stopping returns
+ *	the final status.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglRecordObjCmd(
+    Tkgl *tkglPtr,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[])
+{
+    static const char *const recordOptions[] = {
+	"start", "status", "stop", NULL
+    };
+    enum { RECORD_START, RECORD_STATUS, RECORD_STOP };
+    int index;
+
+    if (objc < 3) {
+	Tcl_WrongNumArgs(interp, 2, objv, "option ?arg ...?");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObjStruct(interp, objv[2], recordOptions,
+	    sizeof(char *), "option", 0, &index) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (index == RECORD_START) {
+	return RecordStart(tkglPtr, interp, objc, objv);
+    }
+    if (objc != 3) {
+	Tcl_WrongNumArgs(interp, 3, objv, NULL);
+	return TCL_ERROR;
+    }
+    if (tkglPtr->recorder == NULL) {
+	Tcl_SetResult(interp, "the widget is not recording", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (index == RECORD_STATUS) {
+	Tcl_SetObjResult(interp, GetRecordStatus(tkglPtr->recorder));
+    } else {
+	Tcl_SetObjResult(interp, TkglRecordStop(tkglPtr, 1));
+    }
+    return TCL_OK;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * fill-column: 78
+ * End:
+ */
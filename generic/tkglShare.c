@@ -0,0 +1,533 @@
+/*
+ * tkglShare.c --
+ *
+ *	Publishing the frames drawn by a Tkgl widget to other processes
+ *	through a ring of slots in a named shared memory region, whose layout
+ *	is described in tkglShare.h.  Like a recording, each frame is read
+ *	back asynchronously when it is drawn and collected a frame or two
+ *	later.  The collected pixels are flipped straight from the mapped
+ *	pixel buffer into the next slot, which is the only copy made on the
+ *	CPU, and no Tcl objects are created per frame.  Frames are dropped
+ *	when every readback buffer is in use or when they are larger than a
+ *	slot.  Consumers are never waited for: a consumer which falls more
+ *	than a ring behind misses frames, and detects this from the frame
+ *	numbers.
+ *
+ * Copyright (C) 2024, Marc Culler, Nathan Dunfield, Matthias Goerner
+ *
+ * This file is part of the TkGL project.  TkGL is licensed under the Tcl
+ * license.  The terms of the license are described in the file
+ * "license.terms" which should be included with this distribution.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "tkgl.h"
+#include "tkglShare.h"
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#endif
+
+/*
+ * Stores which make the frame written before them visible to a consumer
+ * which loads the stored value with acquire semantics.
+ */
+
+#if defined(_MSC_VER)
+#  define StoreRelease(ptr, value) (MemoryBarrier(), *(ptr) = (value))
+#  define ReleaseFence() MemoryBarrier()
+#else
+#  define StoreRelease(ptr, value) \
+	__atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#  define ReleaseFence() __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+
+#define MAX_SHARE_SLOTS 64
+
+typedef struct TkglShare {
+    char *name;			/* Name of the shared memory region. */
+#ifdef _WIN32
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+    unsigned char *base;	/* The mapped region. */
+    size_t size;
+    TkglShareHeader *header;
+    int maxWidth, maxHeight;	/* Largest frame which fits in a slot. */
+    int pending[TKGL_READBACK_DEPTH]; /* Readbacks in flight, oldest first. */
+    Tcl_WideInt times[TKGL_READBACK_DEPTH]; /* When they were started. */
+    int numPending;
+    Tcl_WideInt published;	/* Frames which were published. */
+    Tcl_WideInt dropped;	/* Frames which were not. */
+} TkglShare;
+
+/*
+ * A serial number which makes default region names unique within the
+ * process.
+ */
+
+static int shareCount = 0;
+TCL_DECLARE_MUTEX(shareMutex)
+
+/*
+ * Create and map a shared memory region of the given size, which is
+ * filled with zeros.  Returns TCL_ERROR, with a message in the interp, if
+ * the region could not be created.
+ */
+
+static int
+CreateRegion(
+    Tcl_Interp *interp,
+    TkglShare *sharePtr)
+{
+#ifdef _WIN32
+    unsigned long long size = sharePtr->size;
+
+    sharePtr->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL,
+	PAGE_READWRITE, (DWORD) (size >> 32), (DWORD) size, sharePtr->name);
+    if (sharePtr->mapping != NULL && GetLastError() == ERROR_ALREADY_EXISTS) {
+	CloseHandle(sharePtr->mapping);
+	sharePtr->mapping = NULL;
+    }
+    if (sharePtr->mapping == NULL) {
+	Tcl_AppendResult(interp, "could not create shared memory \"",
+	    sharePtr->name, "\"", NULL);
+	return TCL_ERROR;
+    }
+    sharePtr->base = (unsigned char *) MapViewOfFile(sharePtr->mapping,
+	FILE_MAP_ALL_ACCESS, 0, 0, sharePtr->size);
+    if (sharePtr->base == NULL) {
+	CloseHandle(sharePtr->mapping);
+	Tcl_AppendResult(interp, "could not map shared memory \"",
+	    sharePtr->name, "\"", NULL);
+	return TCL_ERROR;
+    }
+#else
+    void *base;
+
+    sharePtr->fd = shm_open(sharePtr->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (sharePtr->fd < 0) {
+	Tcl_AppendResult(interp, "could not create shared memory \"",
+	    sharePtr->name, "\": ", Tcl_PosixError(interp), NULL);
+	return TCL_ERROR;
+    }
+    base = MAP_FAILED;
+    if (ftruncate(sharePtr->fd, (off_t) sharePtr->size) == 0) {
+	base = mmap(NULL, sharePtr->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    sharePtr->fd, 0);
+    }
+    if (base == MAP_FAILED) {
+	Tcl_AppendResult(interp, "could not map shared memory \"",
+	    sharePtr->name, "\": ", Tcl_PosixError(interp), NULL);
+	close(sharePtr->fd);
+	shm_unlink(sharePtr->name);
+	return TCL_ERROR;
+    }
+    sharePtr->base = (unsigned char *) base;
+#endif
+    return TCL_OK;
+}
+
+/*
+ * Unmap and remove a shared memory region.  Consumers which still have it
+ * mapped keep their mappings.
+ */
+
+static void
+DestroyRegion(
+    TkglShare *sharePtr)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(sharePtr->base);
+    CloseHandle(sharePtr->mapping);
+#else
+    munmap(sharePtr->base, sharePtr->size);
+    close(sharePtr->fd);
+    shm_unlink(sharePtr->name);
+#endif
+}
+
+/*
+ * Copy the oldest pending readback into the next slot and publish it.
+ */
+
+static void
+PublishFrame(
+    Tkgl *tkglPtr,
+    TkglShare *sharePtr)
+{
+    TkglShareHeader *header = sharePtr->header;
+    TkglShareSlot *slot;
+    int id = sharePtr->pending[0], width, height;
+    Tcl_WideInt timestamp = sharePtr->times[0];
+    const unsigned char *pixels;
+    uint64_t seq;
+
+    sharePtr->numPending--;
+    memmove(sharePtr->pending, sharePtr->pending + 1,
+	sharePtr->numPending * sizeof(int));
+    memmove(sharePtr->times, sharePtr->times + 1,
+	sharePtr->numPending * sizeof(Tcl_WideInt));
+
+    pixels = TkglReadbackMap(tkglPtr, id, &width, &height);
+    if (pixels == NULL) {
+	TkglReadbackRelease(tkglPtr, id);
+	sharePtr->dropped++;
+	return;
+    }
+    seq = header->latest + 1;
+    slot = (TkglShareSlot *) (sharePtr->base + header->headerSize
+	+ ((seq - 1) % header->slotCount) * header->slotSize);
+
+    /*
+     * Mark the slot as being written before touching the pixels, so that
+     * a consumer reading the frame it held sees that it changed.
+     */
+
+    slot->seq = 0;
+    ReleaseFence();
+    slot->timestamp = timestamp;
+    slot->width = width;
+    slot->height = height;
+    slot->stride = width * 4;
+    slot->format = TKGL_SHARE_RGBA;
+    slot->size = (uint64_t) width * height * 4;
+    TkglFlipRows((unsigned char *) (slot + 1), pixels, (size_t) width * 4,
+	height);
+    TkglReadbackRelease(tkglPtr, id);
+    StoreRelease(&slot->seq, seq);
+    StoreRelease(&header->latest, seq);
+    sharePtr->published++;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglShareFrame --
+ *
+ *	Called by TkglDisplay after each frame has been drawn.  Publishes the
+ *	earlier frames whose readbacks have completed, then starts reading
+ *	back the new frame.  Frames are dropped when no readback buffer is
+ *	available or when the widget is larger than a slot.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglShareFrame(
+    Tkgl *tkglPtr)
+{
+    TkglShare *sharePtr = tkglPtr->share;
+    Tcl_Time now;
+    int id = 0;
+
+    while (sharePtr->numPending > 0
+	    && TkglReadbackReady(tkglPtr, sharePtr->pending[0]) != 0) {
+	PublishFrame(tkglPtr, sharePtr);
+    }
+    if (tkglPtr->width <= sharePtr->maxWidth
+	    && tkglPtr->height <= sharePtr->maxHeight
+	    && sharePtr->numPending < TKGL_READBACK_DEPTH) {
+	id = TkglReadbackStart(tkglPtr, 0, 0, tkglPtr->width,
+	    tkglPtr->height);
+    }
+    if (id) {
+	Tcl_GetTime(&now);
+	sharePtr->times[sharePtr->numPending] =
+	    (Tcl_WideInt) now.sec * 1000000 + now.usec;
+	sharePtr->pending[sharePtr->numPending++] = id;
+    } else {
+	sharePtr->dropped++;
+    }
+}
+
+/*
+ * Return a description of the shared memory region and its counters.
+ */
+
+static Tcl_Obj *
+GetShareInfo(
+    TkglShare *sharePtr)
+{
+    Tcl_Obj *dictObj = Tcl_NewDictObj();
+
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("name", TCL_INDEX_NONE),
+	Tcl_NewStringObj(sharePtr->name, TCL_INDEX_NONE));
+#ifndef _WIN32
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("fd", TCL_INDEX_NONE),
+	Tcl_NewIntObj(sharePtr->fd));
+#endif
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("size", TCL_INDEX_NONE),
+	Tcl_NewWideIntObj((Tcl_WideInt) sharePtr->size));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("slots", TCL_INDEX_NONE),
+	Tcl_NewIntObj((int) sharePtr->header->slotCount));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("maxwidth", TCL_INDEX_NONE),
+	Tcl_NewIntObj(sharePtr->maxWidth));
+    Tcl_DictObjPut(NULL, dictObj,
+	Tcl_NewStringObj("maxheight", TCL_INDEX_NONE),
+	Tcl_NewIntObj(sharePtr->maxHeight));
+    Tcl_DictObjPut(NULL, dictObj,
+	Tcl_NewStringObj("published", TCL_INDEX_NONE),
+	Tcl_NewWideIntObj(sharePtr->published));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("dropped", TCL_INDEX_NONE),
+	Tcl_NewWideIntObj(sharePtr->dropped));
+    return dictObj;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglShareStop --
+ *
+ *	Stop publishing frames.  The frames which are still being read back
+ *	are published, unless collect is false because the widget is being
+ *	destroyed, and the shared memory region is removed.
+ *
+ * Results:
+ *	The final information about the region, as returned by share info,
+ *	or NULL if the widget was not sharing its frames.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Tcl_Obj *
+TkglShareStop(
+    Tkgl *tkglPtr,
+    int collect)
+{
+    TkglShare *sharePtr = tkglPtr->share;
+    Tcl_Obj *infoObj;
+
+    if (sharePtr == NULL) {
+	return NULL;
+    }
+    while (sharePtr->numPending > 0) {
+	if (collect) {
+	    PublishFrame(tkglPtr, sharePtr);
+	} else {
+	    sharePtr->numPending--;
+	    sharePtr->dropped++;
+	}
+    }
+    infoObj = GetShareInfo(sharePtr);
+    DestroyRegion(sharePtr);
+    ckfree(sharePtr->name);
+    ckfree(sharePtr);
+    tkglPtr->share = NULL;
+    return infoObj;
+}
+
+/*
+ * Start sharing frames, as described for TkglShareObjCmd.
+ */
+
+static int
+ShareStart(
+    Tkgl *tkglPtr,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[])
+{
+    static const char *const startOptions[] = {
+	"-name", "-slots", "-maxsize", NULL
+    };
+    enum { START_NAME, START_SLOTS, START_MAXSIZE };
+    const char *name = NULL;
+    char defaultName[48];
+    int i, index, numSlots = 3, maxWidth, maxHeight;
+    Tcl_Size listc;
+    Tcl_Obj **listv;
+    size_t slotSize;
+    TkglShare *sharePtr;
+    TkglShareHeader *header;
+
+    if ((objc % 2) != 1) {
+	Tcl_WrongNumArgs(interp, 3, objv,
+	    "?-name name? ?-slots n? ?-maxsize {width height}?");
+	return TCL_ERROR;
+    }
+    if (tkglPtr->share) {
+	Tcl_SetResult(interp, "the widget is already sharing its frames",
+	    TCL_STATIC);
+	return TCL_ERROR;
+    }
+    maxWidth = tkglPtr->width;
+    maxHeight = tkglPtr->height;
+    for (i = 3; i < objc; i += 2) {
+	if (Tcl_GetIndexFromObjStruct(interp, objv[i], startOptions,
+		sizeof(char *), "option", 0, &index) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	switch (index) {
+	case START_NAME:
+	    name = Tcl_GetString(objv[i + 1]);
+	    break;
+	case START_SLOTS:
+	    if (Tcl_GetIntFromObj(interp, objv[i + 1], &numSlots) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (numSlots < 2 || numSlots > MAX_SHARE_SLOTS) {
+		Tcl_SetResult(interp, "the number of slots must be between "
+		    "2 and 64", TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    break;
+	case START_MAXSIZE:
+	    if (Tcl_ListObjGetElements(interp, objv[i + 1], &listc, &listv)
+		    != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (listc != 2) {
+		Tcl_SetResult(interp, "the size must be a list of a width "
+		    "and a height", TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    if (Tcl_GetIntFromObj(interp, listv[0], &maxWidth) != TCL_OK
+		    || Tcl_GetIntFromObj(interp, listv[1], &maxHeight)
+		    != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    break;
+	}
+    }
+    if (maxWidth <= 0 || maxHeight <= 0) {
+	Tcl_SetResult(interp, "the widget has no size", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (name == NULL) {
+	Tcl_MutexLock(&shareMutex);
+	i = ++shareCount;
+	Tcl_MutexUnlock(&shareMutex);
+#ifdef _WIN32
+	snprintf(defaultName, sizeof(defaultName), "Local\\tkgl-%lu-%d",
+	    (unsigned long) GetCurrentProcessId(), i);
+#else
+	snprintf(defaultName, sizeof(defaultName), "/tkgl-%ld-%d",
+	    (long) getpid(), i);
+#endif
+	name = defaultName;
+    }
+
+    /*
+     * Keep the pixels of every slot aligned for vector loads.
+     */
+
+    slotSize = sizeof(TkglShareSlot) + (size_t) maxWidth * maxHeight * 4;
+    slotSize = (slotSize + 63) & ~(size_t) 63;
+
+    sharePtr = (TkglShare *) ckalloc(sizeof(TkglShare));
+    memset(sharePtr, 0, sizeof(TkglShare));
+    sharePtr->name = (char *) ckalloc(strlen(name) + 1);
+    strcpy(sharePtr->name, name);
+    sharePtr->size = sizeof(TkglShareHeader) + numSlots * slotSize;
+    sharePtr->maxWidth = maxWidth;
+    sharePtr->maxHeight = maxHeight;
+    if (CreateRegion(interp, sharePtr) != TCL_OK) {
+	ckfree(sharePtr->name);
+	ckfree(sharePtr);
+	return TCL_ERROR;
+    }
+    header = sharePtr->header = (TkglShareHeader *) sharePtr->base;
+    header->version = TKGL_SHARE_VERSION;
+    header->headerSize = sizeof(TkglShareHeader);
+    header->slotCount = numSlots;
+    header->slotSize = slotSize;
+    header->maxWidth = maxWidth;
+    header->maxHeight = maxHeight;
+    header->latest = 0;
+
+    /*
+     * Consumers which open the region before it is ready see no magic.
+     */
+
+    StoreRelease(&header->magic, TKGL_SHARE_MAGIC);
+    tkglPtr->share = sharePtr;
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(sharePtr->name, TCL_INDEX_NONE));
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglShareObjCmd --
+ *
+ *	Implements the share widget command:
+ *
+ *	    $w share start ?-name name? ?-slots n? ?-maxsize {width height}?
+ *	    $w share info
+ *	    $w share stop
+ *
+ *	Starting creates the shared memory region, with the given name or a
+ *	unique one, and returns its name, which is a POSIX shared memory
+ *	object name or a Windows file mapping name.  Frames are published to
+ *	a ring of slots, 3 by default, each large enough for a frame of the
+ *	maximum size, which defaults to the size of the widget.  The info is
+ *	a dict with the keys name, fd (except on Windows), size, slots,
+ *	maxwidth, maxheight, published and dropped.  Stopping removes the
+ *	region and returns the final info.
+ *
+ *	The frames are deliberately not available as Tcl values: a byte
+ *	array always owns a private copy of its bytes, and consumers are
+ *	expected to map the region themselves.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglShareObjCmd(
+    Tkgl *tkglPtr,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[])
+{
+    static const char *const shareOptions[] = {
+	"start", "info", "stop", NULL
+    };
+    enum { SHARE_START, SHARE_INFO, SHARE_STOP };
+    int index;
+
+    if (objc < 3) {
+	Tcl_WrongNumArgs(interp, 2, objv, "option ?arg ...?");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObjStruct(interp, objv[2], shareOptions,
+	    sizeof(char *), "option", 0, &index) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (index == SHARE_START) {
+	return ShareStart(tkglPtr, interp, objc, objv);
+    }
+    if (objc != 3) {
+	Tcl_WrongNumArgs(interp, 3, objv, NULL);
+	return TCL_ERROR;
+    }
+    if (tkglPtr->share == NULL) {
+	Tcl_SetResult(interp, "the widget is not sharing its frames",
+	    TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (index == SHARE_INFO) {
+	Tcl_SetObjResult(interp, GetShareInfo(tkglPtr->share));
+    } else {
+	Tcl_SetObjResult(interp, TkglShareStop(tkglPtr, 1));
+    }
+    return TCL_OK;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * fill-column: 78
+ * End:
+ */
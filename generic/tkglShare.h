@@ -0,0 +1,70 @@
+/*
+ * tkglShare.h --
+ *
+ *	The layout of the shared memory region written by the share command
+ *	of a Tkgl widget.  Processes which consume the frames map the region
+ *	by name and read it using these definitions; they do not need Tcl,
+ *	Tk or OpenGL.
+ *
+ *	The region starts with a TkglShareHeader, followed by slotCount
+ *	slots of slotSize bytes each, the first at offset headerSize.  Each
+ *	slot starts with a TkglShareSlot, followed by the pixels of a frame
+ *	as top-down rows of RGBA bytes.  Frames are numbered from 1 and
+ *	frame n is written to slot (n - 1) % slotCount.
+ *
+ *	The header's latest field is the number of the newest complete
+ *	frame.  A slot's seq field is 0 while its frame is being written and
+ *	is set to the frame number after the frame is complete.  To read
+ *	frame n, a consumer checks that seq is n, reads the frame and then
+ *	checks that seq is still n; otherwise the slot was overwritten while
+ *	it was being read.  Loads of seq should have acquire semantics.
+ *
+ * Copyright (C) 2024, Marc Culler, Nathan Dunfield, Matthias Goerner
+ *
+ * This file is part of the TkGL project.  TkGL is licensed under the Tcl
+ * license.  The terms of the license are described in the file
+ * "license.terms" which should be included with this distribution.
+ */
+
+#ifndef TKGLSHARE_H
+#define TKGLSHARE_H
+
+#include <stdint.h>
+
+#define TKGL_SHARE_MAGIC	0x4C474B54	/* "TKGL" on little endian */
+#define TKGL_SHARE_VERSION	1
+#define TKGL_SHARE_RGBA		0		/* The only pixel format. */
+
+typedef struct TkglShareHeader {
+    uint32_t magic;		/* TKGL_SHARE_MAGIC */
+    uint32_t version;		/* TKGL_SHARE_VERSION */
+    uint32_t headerSize;	/* Offset of the first slot. */
+    uint32_t slotCount;		/* Number of slots. */
+    uint64_t slotSize;		/* Size of a slot, including its header. */
+    uint32_t maxWidth;		/* Largest frame which fits in a slot. */
+    uint32_t maxHeight;
+    volatile uint64_t latest;	/* Newest complete frame, or 0. */
+    uint64_t reserved[3];
+} TkglShareHeader;
+
+typedef struct TkglShareSlot {
+    volatile uint64_t seq;	/* Frame number, or 0 while writing. */
+    int64_t timestamp;		/* When the frame was drawn, in
+				 * microseconds since the epoch. */
+    uint32_t width;		/* Size of the frame in pixels. */
+    uint32_t height;
+    uint32_t stride;		/* Bytes from one row to the next. */
+    uint32_t format;		/* TKGL_SHARE_RGBA */
+    uint64_t size;		/* Bytes of pixel data. */
+    uint64_t reserved[3];
+} TkglShareSlot;
+
+#endif /* TKGLSHARE_H */
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * fill-column: 78
+ * End:
+ */
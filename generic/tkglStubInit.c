@@ -0,0 +1,31 @@
+/*
+ * tkglStubInit.c --
+ *
+ *	This file contains the initializers for the Tkgl stubs table.
+ *
+ * Copyright (C) 2024, Marc Culler, Nathan Dunfield, Matthias Goerner
+ *
+ * This file is part of the TkGL project.  TkGL is licensed under the Tcl
+ * license.  The terms of the license are described in the file
+ * "license.terms" which should be included with this distribution.
+ */
+
+#include "tkgl.h"
+
+/* !BEGIN!: Do not edit below this line. */
+
+const TkglStubs tkglStubs = {
+    TCL_STUB_MAGIC,
+    0,
+    Tkgl_GetWidgetFromName, /* 0 */
+    Tkgl_MakeCurrent, /* 1 */
+    Tkgl_SwapBuffers, /* 2 */
+    Tkgl_PostRedisplay, /* 3 */
+    Tkgl_Width, /* 4 */
+    Tkgl_Height, /* 5 */
+    Tkgl_SetDisplayFunc, /* 6 */
+    Tkgl_SetReshapeFunc, /* 7 */
+    Tkgl_SetTimerFunc, /* 8 */
+};
+
+/* !END!: Do not edit above this line. */
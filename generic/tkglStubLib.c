@@ -0,0 +1,67 @@
+/*
+ * tkglStubLib.c --
+ *
+ *	Stub object that will be statically linked into extensions that
+ *	want to call the functions exported by Tkgl.
+ *
+ * Copyright (C) 2024, Marc Culler, Nathan Dunfield, Matthias Goerner
+ *
+ * This file is part of the TkGL project.  TkGL is licensed under the Tcl
+ * license.  The terms of the license are described in the file
+ * "license.terms" which should be included with this distribution.
+ */
+
+#ifndef USE_TCL_STUBS
+#   define USE_TCL_STUBS
+#endif
+#ifndef USE_TKGL_STUBS
+#   define USE_TKGL_STUBS
+#endif
+#include "tcl.h"
+#include "tkglDecls.h"
+
+const TkglStubs *tkglStubsPtr = NULL;
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Tkgl_InitStubs --
+ *
+ *	Checks that the correct version of Tkgl is loaded and that it
+ *	supports stubs.  It then initialises the stub table pointers.
+ *
+ * Results:
+ *	The actual version of Tkgl that satisfies the request, or NULL to
+ *	indicate that an error occurred.
+ *
+ * Side effects:
+ *	Sets the stub table pointer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#undef Tkgl_InitStubs
+
+const char *
+Tkgl_InitStubs(
+    Tcl_Interp *interp,
+    const char *version,
+    int exact)
+{
+    const char *actualVersion;
+    const TkglStubs *stubsPtr = NULL;
+
+    actualVersion = Tcl_PkgRequireEx(interp, "Tkgl", version, exact,
+	    (void *) &stubsPtr);
+    if (actualVersion == NULL) {
+	return NULL;
+    }
+    if (stubsPtr == NULL || stubsPtr->magic != TCL_STUB_MAGIC) {
+	Tcl_ResetResult(interp);
+	Tcl_AppendResult(interp, "This implementation of Tkgl does not "
+		"support stubs", NULL);
+	return NULL;
+    }
+    tkglStubsPtr = stubsPtr;
+    return actualVersion;
+}
@@ -0,0 +1,372 @@
+/*
+ * tkglTile.c --
+ *
+ *	Rendering images larger than the widget, or than OpenGL's largest
+ *	viewport, in tiles.  Each tile is drawn into a framebuffer object by
+ *	the widget's own reshape and display callbacks, with the widget
+ *	reporting the size of the whole image and the frustum and ortho
+ *	commands narrowing the projection to the tile.  Tiles are read back
+ *	asynchronously, each one while the next is drawn, and are put into a
+ *	photo image or compressed into a PNG file one row of tiles at a time,
+ *	so a file export holds a single row of tiles in memory however large
+ *	the image is.
+ *
+ * Copyright (C) 2024, Marc Culler, Nathan Dunfield, Matthias Goerner
+ *
+ * This file is part of the TkGL project.  TkGL is licensed under the Tcl
+ * license.  The terms of the license are described in the file
+ * "license.terms" which should be included with this distribution.
+ */
+
+#include <string.h>
+#include "tkgl.h"
+
+#ifndef GL_FRAMEBUFFER
+#  define GL_FRAMEBUFFER		0x8D40
+#  define GL_FRAMEBUFFER_BINDING	0x8CA6
+#  define GL_MAX_RENDERBUFFER_SIZE	0x84E8
+#endif
+
+#define DEFAULT_TILE_SIZE 2048
+
+/*
+ * The destination of the image and the readback of the previous tile.
+ */
+
+typedef struct RenderLarge {
+    Tkgl *tkglPtr;
+    Tk_PhotoHandle photo;	/* The destination photo, or NULL. */
+    TkglPNGWriter *png;		/* The destination file, or NULL. */
+    unsigned char *strip;	/* Top-down rows of the current row of
+				 * tiles, for the file. */
+    int pending;		/* Readback of the previous tile, or 0. */
+    TkglTile pendingTile;	/* Where that tile goes in the image. */
+} RenderLarge;
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglTileBounds --
+ *
+ *	Called by the frustum and ortho commands with the bounds of the near
+ *	clipping plane for the whole widget.  While renderlarge is drawing a
+ *	tile, narrows them to the part of the image covered by the tile and
+ *	sets the viewport to the tile, since a viewport for the whole image
+ *	may be larger than OpenGL allows.  Otherwise does nothing.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglTileBounds(
+    const Tkgl *tkglPtr,
+    GLdouble *leftPtr,
+    GLdouble *rightPtr,
+    GLdouble *bottomPtr,
+    GLdouble *topPtr)
+{
+    const TkglTile *tile = tkglPtr->tile;
+    GLdouble width = *rightPtr - *leftPtr, height = *topPtr - *bottomPtr;
+
+    if (tile == NULL) {
+	return;
+    }
+    *rightPtr = *leftPtr + width * (tile->x + tile->width) / tile->imageWidth;
+    *leftPtr += width * tile->x / tile->imageWidth;
+    *topPtr = *bottomPtr
+	+ height * (tile->y + tile->height) / tile->imageHeight;
+    *bottomPtr += height * tile->y / tile->imageHeight;
+    glViewport(0, 0, tile->width, tile->height);
+}
+
+/*
+ * Put the pixels of the pending tile into the photo, or into the strip
+ * for the file, and release its readback.
+ */
+
+static int
+CollectTile(
+    RenderLarge *rlPtr)
+{
+    Tkgl *tkglPtr = rlPtr->tkglPtr;
+    const TkglTile *tile = &rlPtr->pendingTile;
+    const unsigned char *pixels;
+    size_t tileBytes = (size_t) tile->width * 4;
+    size_t stripBytes = (size_t) tile->imageWidth * 4;
+    int width, height, row, result = TCL_OK;
+
+    pixels = TkglReadbackMap(tkglPtr, rlPtr->pending, &width, &height);
+    if (pixels == NULL) {
+	Tcl_SetResult(tkglPtr->interp, "could not read back a tile",
+	    TCL_STATIC);
+	result = TCL_ERROR;
+    } else if (rlPtr->photo) {
+	result = TkglPutPhotoPixels(tkglPtr, rlPtr->photo, pixels, GL_RGBA,
+	    tile->x, tile->imageHeight - tile->y - tile->height,
+	    tile->width, tile->height);
+    } else {
+	for (row = 0; row < tile->height; row++) {
+	    memcpy(rlPtr->strip + (tile->height - 1 - row) * stripBytes
+		+ (size_t) tile->x * 4, pixels + row * tileBytes, tileBytes);
+	}
+    }
+    TkglReadbackRelease(tkglPtr, rlPtr->pending);
+    rlPtr->pending = 0;
+    return result;
+}
+
+/*
+ * Draw one tile with the widget's callbacks and start reading it back.
+ * The previous tile is collected while this one is being drawn.
+ */
+
+static int
+RenderTile(
+    RenderLarge *rlPtr,
+    TkglTile *tile)
+{
+    Tkgl *tkglPtr = rlPtr->tkglPtr;
+    int id;
+
+    tkglPtr->tile = tile;
+    glViewport(0, 0, tile->width, tile->height);
+    if (tkglPtr->reshapeFunc) {
+	tkglPtr->reshapeFunc(tkglPtr, tkglPtr->reshapeData);
+    } else if (tkglPtr->reshapeProc && Tkgl_CallCallback(tkglPtr,
+	    tkglPtr->reshapeProc) != TCL_OK) {
+	goto callbackError;
+    }
+    if (tkglPtr->tkwin == NULL) {
+	goto destroyed;
+    }
+    glViewport(0, 0, tile->width, tile->height);
+    if (tkglPtr->displayFunc) {
+	tkglPtr->displayFunc(tkglPtr, tkglPtr->displayData);
+    } else if (tkglPtr->displayProc && Tkgl_CallCallback(tkglPtr,
+	    tkglPtr->displayProc) != TCL_OK) {
+	goto callbackError;
+    }
+    if (tkglPtr->tkwin == NULL) {
+	goto destroyed;
+    }
+    Tkgl_MakeCurrent(tkglPtr);
+    id = TkglReadbackStart(tkglPtr, 0, 0, tile->width, tile->height);
+    if (id == 0 && rlPtr->pending) {
+	/* Other readbacks hold the rest of the ring. */
+	if (CollectTile(rlPtr) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	id = TkglReadbackStart(tkglPtr, 0, 0, tile->width, tile->height);
+    }
+    if (id == 0) {
+	Tcl_SetResult(tkglPtr->interp, "no readback buffer is available",
+	    TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (rlPtr->pending && CollectTile(rlPtr) != TCL_OK) {
+	TkglReadbackRelease(tkglPtr, id);
+	return TCL_ERROR;
+    }
+    rlPtr->pending = id;
+    rlPtr->pendingTile = *tile;
+    return TCL_OK;
+
+  callbackError:
+    Tcl_SetResult(tkglPtr->interp, "a callback failed while rendering a tile",
+	TCL_STATIC);
+    return TCL_ERROR;
+
+  destroyed:
+    Tcl_SetResult(tkglPtr->interp, "the widget was destroyed while rendering",
+	TCL_STATIC);
+    return TCL_ERROR;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglRenderLargeObjCmd --
+ *
+ *	Implements the renderlarge widget command:
+ *
+ *	    $w renderlarge photo|file width height ?-tile n?
+ *
+ *	Draws an image of the given size with the widget's reshape and
+ *	display callbacks, once per tile of at most n by n pixels, and puts
+ *	it into the photo image with the given name, or writes it to a PNG
+ *	file if there is no such photo.  The callbacks see the size of the
+ *	image as the size of the widget, and must set their projection with
+ *	the frustum or ortho command for each tile to show the right part of
+ *	the scene.  Buffers are not swapped while the tiles are drawn.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglRenderLargeObjCmd(
+    Tkgl *tkglPtr,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[])
+{
+    static const char *const tileOptions[] = {"-tile", NULL};
+    const TkglFramebufferProcs *procs;
+    TkglFramebuffer framebuffer;
+    TkglTile tile;
+    RenderLarge rl;
+    const char *name;
+    int width, height, tileSize = 0, maxTile, saveWidth, saveHeight, option;
+    int result = TCL_OK;
+    GLint dims[2], maxRenderbuffer, oldFramebuffer, viewport[4];
+
+    if (objc != 5 && objc != 7) {
+	Tcl_WrongNumArgs(interp, 2, objv, "photo|file width height ?-tile n?");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIntFromObj(interp, objv[3], &width) != TCL_OK
+	    || Tcl_GetIntFromObj(interp, objv[4], &height) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (objc == 7) {
+	if (Tcl_GetIndexFromObjStruct(interp, objv[5], tileOptions,
+		sizeof(char *), "option", 0, &option) != TCL_OK
+		|| Tcl_GetIntFromObj(interp, objv[6], &tileSize) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+    }
+    if (width <= 0 || height <= 0) {
+	Tcl_SetResult(interp, "the image size must be positive", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (tkglPtr->tile) {
+	Tcl_SetResult(interp, "the widget is already rendering tiles",
+	    TCL_STATIC);
+	return TCL_ERROR;
+    }
+
+    Tkgl_MakeCurrent(tkglPtr);
+    procs = TkglGetFramebufferProcs();
+    if (procs == NULL) {
+	Tcl_SetResult(interp, "framebuffer objects are not supported",
+	    TCL_STATIC);
+	return TCL_ERROR;
+    }
+    glGetIntegerv(GL_MAX_VIEWPORT_DIMS, dims);
+    glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &maxRenderbuffer);
+    maxTile = dims[0] < dims[1] ? dims[0] : dims[1];
+    if (maxRenderbuffer < maxTile) {
+	maxTile = maxRenderbuffer;
+    }
+    if (tileSize == 0) {
+	tileSize = maxTile < DEFAULT_TILE_SIZE ? maxTile : DEFAULT_TILE_SIZE;
+    } else if (tileSize < 1 || tileSize > maxTile) {
+	Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+	    "the tile size must be between 1 and %d", maxTile));
+	return TCL_ERROR;
+    }
+
+    memset(&rl, 0, sizeof(RenderLarge));
+    rl.tkglPtr = tkglPtr;
+    name = Tcl_GetString(objv[2]);
+    rl.photo = Tk_FindPhoto(interp, name);
+    if (rl.photo) {
+	if (Tk_PhotoSetSize(interp, rl.photo, width, height) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+    } else {
+	rl.png = TkglPNGOpen(name, width, height);
+	if (rl.png == NULL) {
+	    Tcl_AppendResult(interp, "couldn't open \"", name, "\": ",
+		Tcl_PosixError(interp), NULL);
+	    return TCL_ERROR;
+	}
+	rl.strip = (unsigned char *)
+	    ckalloc((size_t) width * (height < tileSize ? height : tileSize) * 4);
+    }
+
+    memset(&framebuffer, 0, sizeof(TkglFramebuffer));
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &oldFramebuffer);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    if (TkglFramebufferResize(interp, &framebuffer, tileSize, tileSize)
+	    != TCL_OK) {
+	TkglFramebufferFree(&framebuffer);
+	procs->bindFramebuffer(GL_FRAMEBUFFER, oldFramebuffer);
+	result = TCL_ERROR;
+	goto done;
+    }
+
+    /*
+     * Draw the rows of tiles from the top of the image down, the order in
+     * which the rows of the file are written.
+     */
+
+    Tcl_Preserve(tkglPtr);
+    saveWidth = tkglPtr->width;
+    saveHeight = tkglPtr->height;
+    tkglPtr->width = width;
+    tkglPtr->height = height;
+    tile.imageWidth = width;
+    tile.imageHeight = height;
+    for (tile.y = height; tile.y > 0 && result == TCL_OK; ) {
+	tile.height = tile.y < tileSize ? tile.y : tileSize;
+	tile.y -= tile.height;
+	for (tile.x = 0; tile.x < width && result == TCL_OK;
+		tile.x += tileSize) {
+	    tile.width = width - tile.x < tileSize ? width - tile.x : tileSize;
+	    result = RenderTile(&rl, &tile);
+	}
+	if (result == TCL_OK && rl.png) {
+	    /* The strip is complete once its last tile is collected. */
+	    if (rl.pending) {
+		result = CollectTile(&rl);
+	    }
+	    if (result == TCL_OK
+		    && !TkglPNGWriteRows(rl.png, rl.strip, tile.height)) {
+		Tcl_AppendResult(interp, "error writing \"", name, "\"",
+		    NULL);
+		result = TCL_ERROR;
+	    }
+	}
+    }
+    if (result == TCL_OK && rl.pending) {
+	result = CollectTile(&rl);
+    }
+    tkglPtr->tile = NULL;
+    if (tkglPtr->tkwin != NULL) {
+	tkglPtr->width = saveWidth;
+	tkglPtr->height = saveHeight;
+	Tkgl_MakeCurrent(tkglPtr);
+	if (rl.pending) {
+	    TkglReadbackRelease(tkglPtr, rl.pending);
+	}
+	TkglFramebufferFree(&framebuffer);
+	procs->bindFramebuffer(GL_FRAMEBUFFER, oldFramebuffer);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+	/* Let the callbacks set up the projection for the window again. */
+	tkglPtr->reshapePending = True;
+	Tkgl_PostRedisplay(tkglPtr);
+    }
+    Tcl_Release(tkglPtr);
+
+  done:
+    if (rl.png) {
+	if (!TkglPNGClose(rl.png) && result == TCL_OK) {
+	    Tcl_AppendResult(interp, "error writing \"", name, "\"", NULL);
+	    result = TCL_ERROR;
+	}
+	ckfree(rl.strip);
+    }
+    return result;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * fill-column: 78
+ * End:
+ */
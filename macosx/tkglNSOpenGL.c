@@ -19,6 +19,7 @@
 #include <AppKit/NSView.h>
 #include <tkMacOSXInt.h>              /* for MacDrawable */
 #include <ApplicationServices/ApplicationServices.h>
+#include <dlfcn.h>
 #define Tkgl_MacOSXGetDrawablePort(tkgl) TkMacOSXGetDrawablePort((Drawable) ((TkWindow *) tkgl->TkWin)->privatePtr)
 
 static NSOpenGLPixelFormat *
@@ -281,6 +282,19 @@ const char* Tkgl_GetExtensions(
     return tkglPtr->extensions;
 }
 
+/*
+ * Tkgl_GetProcAddress
+ *
+ *    The OpenGL framework exports every function it implements, so they
+ *    can simply be looked up by name.
+ */
+
+void *Tkgl_GetProcAddress(
+    const char *name)
+{
+    return dlsym(RTLD_DEFAULT, name);
+}
+
 /*
  *  Tkgl_Update
  *
@@ -321,6 +335,30 @@ void Tkgl_Update(const Tkgl *tkglPtr)
     [tkglPtr->context update];  
 }
 
+/*
+ *  Tkgl_ScheduleRedisplay
+ *
+ *    Arranges for TkglDisplay to be called when Tcl is idle.
+ */
+
+void
+Tkgl_ScheduleRedisplay(Tkgl *tkglPtr)
+{
+    Tcl_DoWhenIdle(TkglDisplay, (void *) tkglPtr);
+}
+
+/*
+ *  Tkgl_CancelRedisplay
+ *
+ *    Cancels a call to TkglDisplay scheduled by Tkgl_ScheduleRedisplay.
+ */
+
+void
+Tkgl_CancelRedisplay(Tkgl *tkglPtr)
+{
+    Tcl_CancelIdleCall(TkglDisplay, (void *) tkglPtr);
+}
+
 /* Display reconfiguration callback. Documented as needed by Apple QA1209.
  * Updated for 10.3 (and later) to use 
  * CGDisplayRegisterReconfigurationCallback.
@@ -383,6 +421,12 @@ ReconfigureCB(CGDirectDisplayID display, CGDisplayChangeSummaryFlags flags,
 int
 Tkgl_CreateGLContext(Tkgl *tkglPtr)
 {
+    if (tkglPtr->offscreen != OFFSCREEN_NONE) {
+	Tcl_SetResult(tkglPtr->interp,
+		"-offscreen fbo is not supported on this platform",
+		TCL_STATIC);
+	return TCL_ERROR;
+    }
     if (tkglPtr->context) {
 	return TCL_OK;
     }
@@ -394,7 +438,7 @@ Tkgl_CreateGLContext(Tkgl *tkglPtr)
         if (shareWith) {
 	    tkglPtr->pixelFormat = shareWith->pixelFormat;
             tkglPtr->context = shareWith->context;
-            tkglPtr->contextTag = shareWith->contextTag;
+            TkglGroupJoin(tkglPtr, shareWith);
         } else {
 	    Tcl_SetResult(tkglPtr->interp,
 		"Invalid widget specified in the sharelist option.",
@@ -413,6 +457,7 @@ Tkgl_CreateGLContext(Tkgl *tkglPtr)
 	tkglPtr->pixelFormat = shareWith->pixelFormat;
 	tkglPtr->context = [[NSOpenGLContext alloc]
 	    initWithCGLContextObj: (CGLContextObj) shareWith->context];
+	TkglGroupJoin(tkglPtr, shareWith);
     } else {
 	tkglPtr->context = [NSOpenGLContext alloc];
 	tkglPtr->pixelFormat = tkgl_pixelFormat(tkglPtr);
@@ -702,57 +747,29 @@ int
 Tkgl_TakePhoto(Tkgl *tkglPtr, Tk_PhotoHandle photo)
 {
     GLubyte *buffer;
-    unsigned char *cp;
-    int y, midy, width = tkglPtr->width, height = tkglPtr->height;
+    int result, width = tkglPtr->width, height = tkglPtr->height;
+    GLenum format = tkglPtr->rgbaFlag ? GL_RGBA : GL_COLOR_INDEX;
+    GLenum type = tkglPtr->rgbaFlag ? GL_UNSIGNED_BYTE : GL_UNSIGNED_INT;
     buffer = (GLubyte *) ckalloc(width * height * 4);
-    Tk_PhotoImageBlock photoBlock;
-    photoBlock.pixelPtr = buffer;
-    photoBlock.width = width;
-    photoBlock.height = height;
-    photoBlock.pitch = width * 4;
-    photoBlock.pixelSize = 4;
-    photoBlock.offset[0] = 0;
-    photoBlock.offset[1] = 1;
-    photoBlock.offset[2] = 2;
-    photoBlock.offset[3] = 3;
     glPushAttrib(GL_PIXEL_MODE_BIT);
     if (tkglPtr->doubleFlag) {
         glReadBuffer(GL_FRONT);
     }
-    if (!tkglPtr->rgbaFlag) {
-        glPixelMapfv(GL_PIXEL_MAP_I_TO_R, tkglPtr->mapSize, tkglPtr->redMap);
-        glPixelMapfv(GL_PIXEL_MAP_I_TO_G, tkglPtr->mapSize, tkglPtr->greenMap);
-        glPixelMapfv(GL_PIXEL_MAP_I_TO_B, tkglPtr->mapSize, tkglPtr->blueMap);
-    }
     glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
     glPixelStorei(GL_PACK_ALIGNMENT, 4);        /* guarantee performance */
     glPixelStorei(GL_PACK_SWAP_BYTES, GL_FALSE);
     glPixelStorei(GL_PACK_SKIP_PIXELS, 0);
     glPixelStorei(GL_PACK_ROW_LENGTH, 0);
     glPixelStorei(GL_PACK_SKIP_ROWS, 0);
-    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, buffer);
-    /* OpenGL's origin is bottom-left, Tk Photo image's is top-left, so
-     * reflect around the middle row. */
-    midy = height / 2;
-    cp = buffer;
-    for (y = 0; y < midy; ++y) {
-        int     m_y = height - 1 - y;   /* mirror y */
-        unsigned char *m_cp = buffer + m_y * photoBlock.pitch;
-        int     x;
-
-        for (x = 0; x < photoBlock.pitch; ++x) {
-            unsigned char c = *cp;
-
-            *cp++ = *m_cp;
-            *m_cp++ = c;
-        }
-    }
-    Tk_PhotoPutBlock(tkglPtr->interp, photo, &photoBlock, 0, 0,
-	width, height, TK_PHOTO_COMPOSITE_SET);
+    glReadPixels(0, 0, width, height, format, type, buffer);
+    /* OpenGL's origin is bottom-left, Tk Photo image's is top-left.
+     * TkglPutPhotoPixels hands the rows to Tk in reverse order. */
+    result = TkglPutPhotoPixels(tkglPtr, photo, buffer, format, 0, 0,
+	width, height);
     glPopClientAttrib();
     glPopAttrib();    /* glReadBuffer */
     ckfree((char *) buffer);
-    return TCL_OK;
+    return result;
 }
 
 /* 
@@ -787,13 +804,20 @@ Tkgl_MakeCurrent(const Tkgl *tkglPtr)
 void
 Tkgl_SwapBuffers(const Tkgl *tkglPtr)
 {
-    if (tkglPtr->doubleFlag) {
+    if (tkglPtr->doubleFlag && tkglPtr->tile == NULL) {
         [tkglPtr->context flushBuffer];
     } else {
         glFlush();
     }
 }
 
+int
+Tkgl_BufferAge(const Tkgl *tkglPtr)
+{
+    /* NSOpenGL does not say what the back buffer holds after a flush. */
+    return 0;
+}
+
 int
 Tkgl_CopyContext(const Tkgl *from, const Tkgl *to, unsigned mask)
 {
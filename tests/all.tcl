@@ -0,0 +1,19 @@
+# all.tcl --
+#
+#	This file contains a top-level script to run all of the Tkgl tests.
+#	Execute it by invoking "make test" in the build directory, or
+#	"tclsh all.tcl" when the package can be found with package require.
+#
+# Copyright (C) 2024, Marc Culler, Nathan Dunfield, Matthias Goerner
+#
+# This file is part of the TkGL project.  TkGL is licensed under the Tcl
+# license.  The terms of the license are described in the file
+# "license.terms" which should be included with this distribution.
+
+package prefer latest
+package require Tcl 8.6-
+package require tcltest 2.2
+namespace import tcltest::*
+configure {*}$argv -testdir [file dirname [file normalize [info script]]]
+runAllTests
+proc exit args {}
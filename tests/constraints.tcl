@@ -0,0 +1,68 @@
+# constraints.tcl --
+#
+#	Loads the Tkgl package for a test file, sets the constraints which
+#	the tests share and defines their helpers.  The constraints are:
+#
+#	    headless	the tkgl::render command exists, in builds with EGL
+#	    render	tkgl::render can actually draw
+#	    widget	Tk has a display and an -offscreen fbo widget works
+#	    x11		the widgets are drawn by the GLX frame clock
+#	    shm		shared memory objects appear in /dev/shm
+#
+# Copyright (C) 2024, Marc Culler, Nathan Dunfield, Matthias Goerner
+#
+# This file is part of the TkGL project.  TkGL is licensed under the Tcl
+# license.  The terms of the license are described in the file
+# "license.terms" which should be included with this distribution.
+
+if {"::tcltest" ni [namespace children]} {
+    package require tcltest 2.2
+    namespace import -force ::tcltest::*
+}
+loadTestedCommands
+
+# Tk has to be loaded first for the package to provide widgets.  Without a
+# display only the headless commands of an EGL build are available.
+if {![catch {package require Tk}]} {
+    wm withdraw .
+}
+catch {package require Tkgl}
+testConstraint headless [llength [info commands ::tkgl::render]]
+testConstraint render [expr {[testConstraint headless]
+	&& ![catch {::tkgl::render 1 1 {}}]}]
+testConstraint widget [expr {[llength [info commands ::tkgl]] && ![catch {
+    tkgl .constraint -width 4 -height 4 -offscreen fbo
+    update idletasks
+    destroy .constraint
+}]}]
+testConstraint x11 [expr {[testConstraint widget]
+	&& [tk windowingsystem] eq "x11"}]
+testConstraint shm [file isdirectory /dev/shm]
+
+# Create an offscreen widget which is ready to draw.
+proc offscreenWidget {w args} {
+    tkgl $w -width 8 -height 6 -offscreen fbo {*}$args
+    update idletasks
+    return $w
+}
+
+# Run the event loop for a while, so that frame clocks and timers tick.
+proc runEventLoop {ms} {
+    after $ms [list set ::eventLoopDone 1]
+    vwait ::eventLoopDone
+}
+
+# Callbacks for the -createcommand, -reshapecommand, -displaycommand and
+# -timercommand options, which count their calls in the calls array.
+foreach callback {created reshaped displayed ticked} {
+    proc $callback {w} [list incr ::calls($callback)]
+}
+proc calls {callback} {
+    if {![info exists ::calls($callback)]} {
+	return 0
+    }
+    return $::calls($callback)
+}
+proc resetCalls {} {
+    array unset ::calls
+}
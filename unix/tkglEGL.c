@@ -0,0 +1,1104 @@
+/*
+ * tkglEGL.c --
+ *
+ *	A headless renderer which draws with an EGL context that has no
+ *	window and no X server.  It provides the tkgl::render command, which
+ *	evaluates a display script with the context current and a framebuffer
+ *	object of the requested size bound, and returns the image, and the
+ *	tkgl::devices command, which lists the EGL devices.
+ *
+ *	It also provides the software renderer for widgets, which is used
+ *	when the X server has no GLX, as with many remote X, VNC and container
+ *	setups, or when the -software option is set.  A software widget draws
+ *	with its own surfaceless context into a framebuffer object, and
+ *	swapbuffers copies the image to the window with XShmPutImage, or with
+ *	XPutImage when shared memory cannot be used.  On Mesa the renderer is
+ *	llvmpipe, the same one which OSMesa used.
+ *
+ *	The display is opened with EGL_MESA_platform_surfaceless, which Mesa
+ *	provides with the llvmpipe software renderer, or with
+ *	EGL_EXT_platform_device for one of the devices enumerated by
+ *	EGL_EXT_device_enumeration.  Contexts are made current without a
+ *	surface, which needs EGL_KHR_surfaceless_context.
+ *
+ *	This file is compiled when the package is configured with
+ *	--enable-egl.  If Tk cannot be loaded, for example because there is no
+ *	X server, the package then provides these commands on their own.
+ *
+ *	The OpenGL functions are called through libGL.  With libglvnd, which
+ *	every current Mesa and NVIDIA installation uses, libGL dispatches to
+ *	whichever of the GLX or EGL contexts is current.
+ *
+ * Copyright (C) 2024, Marc Culler, Nathan Dunfield, Matthias Goerner
+ *
+ * This file is part of the TkGL project.  TkGL is licensed under the Tcl
+ * license.  The terms of the license are described in the file
+ * "license.terms" which should be included with this distribution.
+ */
+
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include "tkgl.h"
+#include <X11/extensions/XShm.h>
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#  define EGL_PLATFORM_SURFACELESS_MESA	0x31DD
+#endif
+#ifndef EGL_DRM_RENDER_NODE_FILE_EXT
+#  define EGL_DRM_RENDER_NODE_FILE_EXT	0x3377
+#endif
+#ifndef GL_BGRA
+#  define GL_BGRA			0x80E1
+#endif
+#ifndef GL_PIXEL_PACK_BUFFER
+#  define GL_PIXEL_PACK_BUFFER		0x88EB
+#  define GL_PIXEL_PACK_BUFFER_BINDING	0x88ED
+#endif
+
+#define MAX_DEVICES 32
+
+static const char *const platformStrings[] = {
+    "surfaceless", "device", NULL
+};
+enum platform {
+    PLATFORM_SURFACELESS, PLATFORM_DEVICE
+};
+
+static const char *const profileStrings[] = {
+    "legacy", "3_2", "4_1", "system", NULL
+};
+
+/*
+ * Each thread has its own headless context, which is kept between calls to
+ * tkgl::render and replaced when a call asks for a different platform,
+ * device or profile.  The framebuffer is kept with it and resized in place.
+ */
+
+typedef struct ThreadData {
+    EGLDisplay display;
+    EGLContext context;
+    int platform;
+    int device;
+    int profile;
+    TkglFramebuffer framebuffer;
+    int initialized;		/* The exit handler is registered. */
+} ThreadData;
+
+static Tcl_ThreadDataKey dataKey;
+
+/*
+ * The software renderer of a widget.  The image has the size of the
+ * widget's framebuffer and is recreated when that changes.
+ */
+
+typedef struct TkglSoftware {
+    EGLDisplay display;
+    EGLContext context;
+    XImage *image;
+    XShmSegmentInfo shmInfo;
+    int useShm;			/* Try to use shared memory images. */
+    int putPending;		/* The server may still be reading the
+				 * shared image. */
+    GC gc;
+} TkglSoftware;
+
+static PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = NULL;
+static PFNEGLQUERYDEVICESEXTPROC queryDevices = NULL;
+static PFNEGLQUERYDEVICESTRINGEXTPROC queryDeviceString = NULL;
+
+/*
+ * Check whether an extension is in a space separated list of extensions.
+ */
+
+static int
+HasExtension(
+    const char *extensions,
+    const char *name)
+{
+    size_t length = strlen(name);
+    const char *p = extensions;
+
+    while (p && (p = strstr(p, name)) != NULL) {
+	if ((p == extensions || p[-1] == ' ')
+		&& (p[length] == ' ' || p[length] == '\0')) {
+	    return 1;
+	}
+	p += length;
+    }
+    return 0;
+}
+
+/*
+ * Look up the client extension functions.  Returns 0 if EGL has no
+ * platform support at all.
+ */
+
+static int
+InitClientExtensions(void)
+{
+    const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+
+    if (extensions == NULL || !HasExtension(extensions,
+	    "EGL_EXT_platform_base")) {
+	return 0;
+    }
+    if (getPlatformDisplay == NULL) {
+	getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+		eglGetProcAddress("eglGetPlatformDisplayEXT");
+    }
+    if (queryDevices == NULL
+	    && HasExtension(extensions, "EGL_EXT_device_enumeration")) {
+	queryDevices = (PFNEGLQUERYDEVICESEXTPROC)
+		eglGetProcAddress("eglQueryDevicesEXT");
+    }
+    if (queryDeviceString == NULL
+	    && HasExtension(extensions, "EGL_EXT_device_query")) {
+	queryDeviceString = (PFNEGLQUERYDEVICESTRINGEXTPROC)
+		eglGetProcAddress("eglQueryDeviceStringEXT");
+    }
+    return getPlatformDisplay != NULL;
+}
+
+/*
+ * Open and initialize the EGL display for a platform.  The device index is
+ * only used by the device platform.
+ */
+
+static EGLDisplay
+OpenDisplay(
+    Tcl_Interp *interp,
+    int platform,
+    int device)
+{
+    const char *extensions;
+    EGLDeviceEXT devices[MAX_DEVICES];
+    EGLDisplay display;
+    EGLint count = 0, major, minor;
+
+    if (!InitClientExtensions()) {
+	Tcl_SetResult(interp, "EGL does not support platforms", TCL_STATIC);
+	return EGL_NO_DISPLAY;
+    }
+    extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (platform == PLATFORM_SURFACELESS) {
+	if (!HasExtension(extensions, "EGL_MESA_platform_surfaceless")) {
+	    Tcl_SetResult(interp, "EGL does not support the surfaceless "
+		"platform", TCL_STATIC);
+	    return EGL_NO_DISPLAY;
+	}
+	display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+		EGL_DEFAULT_DISPLAY, NULL);
+    } else {
+	if (queryDevices == NULL
+		|| !HasExtension(extensions, "EGL_EXT_platform_device")) {
+	    Tcl_SetResult(interp, "EGL does not support the device platform",
+		TCL_STATIC);
+	    return EGL_NO_DISPLAY;
+	}
+	if (!queryDevices(MAX_DEVICES, devices, &count)
+		|| device < 0 || device >= count) {
+	    Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+		"no EGL device %d, there are %d", device, (int) count));
+	    return EGL_NO_DISPLAY;
+	}
+	display = getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT,
+		devices[device], NULL);
+    }
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+	Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+	    "could not initialize the EGL display (error 0x%04x)",
+	    (unsigned) eglGetError()));
+	return EGL_NO_DISPLAY;
+    }
+    if (!HasExtension(eglQueryString(display, EGL_EXTENSIONS),
+	    "EGL_KHR_surfaceless_context")) {
+	Tcl_SetResult(interp, "the EGL display does not support contexts "
+	    "without surfaces", TCL_STATIC);
+	return EGL_NO_DISPLAY;
+    }
+    return display;
+}
+
+/*
+ * Create an OpenGL context with the requested profile on an initialized
+ * display, sharing the objects of shareContext unless that is
+ * EGL_NO_CONTEXT.  As for widgets, legacy asks for a 2.1 context and system
+ * takes whatever the implementation gives by default.
+ */
+
+static EGLContext
+CreateContext(
+    Tcl_Interp *interp,
+    EGLDisplay display,
+    int profile,
+    EGLContext shareContext)
+{
+    EGLint attribs[16], configAttribs[] = {
+	EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE
+    };
+    EGLConfig config = (EGLConfig) 0;
+    EGLContext context;
+    EGLint count;
+    int na = 0;
+
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+	Tcl_SetResult(interp, "EGL does not support OpenGL", TCL_STATIC);
+	return EGL_NO_CONTEXT;
+    }
+    if (!HasExtension(eglQueryString(display, EGL_EXTENSIONS),
+	    "EGL_KHR_no_config_context")) {
+	if (!eglChooseConfig(display, configAttribs, &config, 1, &count)
+		|| count < 1) {
+	    Tcl_SetResult(interp, "no EGL config supports OpenGL",
+		TCL_STATIC);
+	    return EGL_NO_CONTEXT;
+	}
+    }
+    switch (profile) {
+    case PROFILE_LEGACY:
+	attribs[na++] = EGL_CONTEXT_MAJOR_VERSION;
+	attribs[na++] = 2;
+	attribs[na++] = EGL_CONTEXT_MINOR_VERSION;
+	attribs[na++] = 1;
+	break;
+    case PROFILE_3_2:
+    case PROFILE_4_1:
+	attribs[na++] = EGL_CONTEXT_MAJOR_VERSION;
+	attribs[na++] = profile == PROFILE_3_2 ? 3 : 4;
+	attribs[na++] = EGL_CONTEXT_MINOR_VERSION;
+	attribs[na++] = profile == PROFILE_3_2 ? 2 : 1;
+	attribs[na++] = EGL_CONTEXT_OPENGL_PROFILE_MASK;
+	attribs[na++] = EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT;
+	break;
+    default:
+	break;
+    }
+    attribs[na++] = EGL_NONE;
+    context = eglCreateContext(display, config, shareContext, attribs);
+    if (context == EGL_NO_CONTEXT) {
+	Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+	    "could not create the EGL context (error 0x%04x)",
+	    (unsigned) eglGetError()));
+    }
+    return context;
+}
+
+/*
+ * Destroy the headless context of the current thread.  The framebuffer
+ * goes away with the context.
+ */
+
+static void
+ReleaseContext(
+    ThreadData *tsdPtr)
+{
+    if (tsdPtr->context != EGL_NO_CONTEXT) {
+	eglMakeCurrent(tsdPtr->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		EGL_NO_CONTEXT);
+	eglDestroyContext(tsdPtr->display, tsdPtr->context);
+	tsdPtr->context = EGL_NO_CONTEXT;
+    }
+    memset(&tsdPtr->framebuffer, 0, sizeof(TkglFramebuffer));
+}
+
+static void
+ThreadExitProc(
+    void *clientData)
+{
+    ThreadData *tsdPtr = (ThreadData *) clientData;
+
+    ReleaseContext(tsdPtr);
+    eglReleaseThread();
+}
+
+/*
+ * Make the headless context of the current thread current, creating it if
+ * there is none or the existing one was made for different settings.
+ */
+
+static int
+MakeCurrent(
+    Tcl_Interp *interp,
+    ThreadData *tsdPtr,
+    int platform,
+    int device,
+    int profile)
+{
+    if (tsdPtr->context != EGL_NO_CONTEXT && (tsdPtr->platform != platform
+	    || tsdPtr->device != device || tsdPtr->profile != profile)) {
+	ReleaseContext(tsdPtr);
+    }
+    if (tsdPtr->context == EGL_NO_CONTEXT) {
+	tsdPtr->display = OpenDisplay(interp, platform, device);
+	if (tsdPtr->display == EGL_NO_DISPLAY) {
+	    return TCL_ERROR;
+	}
+	tsdPtr->context = CreateContext(interp, tsdPtr->display, profile,
+		EGL_NO_CONTEXT);
+	if (tsdPtr->context == EGL_NO_CONTEXT) {
+	    return TCL_ERROR;
+	}
+	tsdPtr->platform = platform;
+	tsdPtr->device = device;
+	tsdPtr->profile = profile;
+	if (!tsdPtr->initialized) {
+	    Tcl_CreateThreadExitHandler(ThreadExitProc, tsdPtr);
+	    tsdPtr->initialized = 1;
+	}
+    }
+    if (!eglMakeCurrent(tsdPtr->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+	    tsdPtr->context)) {
+	Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+	    "could not make the EGL context current (error 0x%04x)",
+	    (unsigned) eglGetError()));
+	return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ * Read the framebuffer into a byte array of top-down RGBA rows.
+ */
+
+static Tcl_Obj *
+ReadPixels(
+    int width,
+    int height)
+{
+    const TkglBufferProcs *procs = TkglGetBufferProcs();
+    size_t rowBytes = (size_t) width * 4;
+    GLint packAlignment, packRowLength, packSkipPixels, packSkipRows;
+    GLint packBuffer = 0;
+    unsigned char *pixels;
+    Tcl_Obj *resultObj;
+
+    glGetIntegerv(GL_PACK_ALIGNMENT, &packAlignment);
+    glGetIntegerv(GL_PACK_ROW_LENGTH, &packRowLength);
+    glGetIntegerv(GL_PACK_SKIP_PIXELS, &packSkipPixels);
+    glGetIntegerv(GL_PACK_SKIP_ROWS, &packSkipRows);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_PACK_SKIP_PIXELS, 0);
+    glPixelStorei(GL_PACK_SKIP_ROWS, 0);
+    if (procs) {
+	glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &packBuffer);
+	if (packBuffer) {
+	    procs->bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+    }
+    resultObj = Tcl_NewByteArrayObj(NULL, 0);
+    pixels = Tcl_SetByteArrayLength(resultObj, rowBytes * height);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    TkglFlipRows(pixels, pixels, rowBytes, height);
+    if (packBuffer) {
+	procs->bindBuffer(GL_PIXEL_PACK_BUFFER, packBuffer);
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, packAlignment);
+    glPixelStorei(GL_PACK_ROW_LENGTH, packRowLength);
+    glPixelStorei(GL_PACK_SKIP_PIXELS, packSkipPixels);
+    glPixelStorei(GL_PACK_SKIP_ROWS, packSkipRows);
+    return resultObj;
+}
+
+/*
+ * Store top-down RGBA rows in a photo image.  Only possible when Tk has
+ * been loaded.
+ */
+
+static int
+PutPhoto(
+    Tcl_Interp *interp,
+    const char *name,
+    unsigned char *pixels,
+    int width,
+    int height)
+{
+    Tk_PhotoHandle photo;
+    Tk_PhotoImageBlock block;
+
+#ifdef USE_TK_STUBS
+    if (tkStubsPtr == NULL) {
+	Tcl_SetResult(interp, "photo images need Tk", TCL_STATIC);
+	return TCL_ERROR;
+    }
+#endif
+    photo = Tk_FindPhoto(interp, name);
+    if (photo == NULL) {
+	Tcl_AppendResult(interp, "image \"", name,
+	    "\" doesn't exist or is not a photo image", NULL);
+	return TCL_ERROR;
+    }
+    block.pixelPtr = pixels;
+    block.width = width;
+    block.height = height;
+    block.pitch = width * 4;
+    block.pixelSize = 4;
+    block.offset[0] = 0;
+    block.offset[1] = 1;
+    block.offset[2] = 2;
+    block.offset[3] = 3;
+    if (Tk_PhotoSetSize(interp, photo, width, height) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    return Tk_PhotoPutBlock(interp, photo, &block, 0, 0, width, height,
+	    TK_PHOTO_COMPOSITE_SET);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RenderObjCmd --
+ *
+ *	Implements the tkgl::render command:
+ *
+ *	    tkgl::render ?-platform surfaceless|device? ?-device index?
+ *		    ?-profile profile? ?-photo image? ?-file fileName?
+ *		    width height script
+ *
+ *	The script is evaluated at the global level with the headless
+ *	context of the thread current, a width x height framebuffer object
+ *	bound and the viewport covering it.  The image it draws is returned
+ *	as a byte array of top-down RGBA rows, or is stored in a photo image
+ *	or written to a PNG file, in which case the result is empty.  The
+ *	platform defaults to surfaceless, and the -device option selects the
+ *	device platform.  Any widget context which was current is current
+ *	again afterwards.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+RenderObjCmd(
+    void *clientData,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[])
+{
+    static const char *const renderOptions[] = {
+	"-platform", "-device", "-profile", "-photo", "-file", NULL
+    };
+    enum {
+	RENDER_PLATFORM, RENDER_DEVICE, RENDER_PROFILE, RENDER_PHOTO,
+	RENDER_FILE
+    };
+    ThreadData *tsdPtr = (ThreadData *)
+	    Tcl_GetThreadData(&dataKey, sizeof(ThreadData));
+    int platform = PLATFORM_SURFACELESS, device = 0, profile = PROFILE_LEGACY;
+    int i, index, width, height, result;
+    const char *photoName = NULL, *fileName = NULL;
+    GLXContext glxContext = glXGetCurrentContext();
+    Display *glxDisplay = glXGetCurrentDisplay();
+    GLXDrawable glxDrawable = glXGetCurrentDrawable();
+    EGLContext eglContext = eglGetCurrentContext();
+    EGLDisplay eglDisplay = eglGetCurrentDisplay();
+    Tcl_Obj *pixelsObj = NULL;
+    TkglPNGWriter *pngPtr;
+
+    (void) clientData;
+    if (objc < 4 || (objc % 2) != 0) {
+	Tcl_WrongNumArgs(interp, 1, objv, "?-option value ...? width height "
+	    "script");
+	return TCL_ERROR;
+    }
+    for (i = 1; i < objc - 3; i += 2) {
+	if (Tcl_GetIndexFromObjStruct(interp, objv[i], renderOptions,
+		sizeof(char *), "option", 0, &index) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	switch (index) {
+	case RENDER_PLATFORM:
+	    if (Tcl_GetIndexFromObjStruct(interp, objv[i + 1],
+		    platformStrings, sizeof(char *), "platform", 0, &platform)
+		    != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    break;
+	case RENDER_DEVICE:
+	    if (Tcl_GetIntFromObj(interp, objv[i + 1], &device) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    platform = PLATFORM_DEVICE;
+	    break;
+	case RENDER_PROFILE:
+	    if (Tcl_GetIndexFromObjStruct(interp, objv[i + 1], profileStrings,
+		    sizeof(char *), "profile", 0, &profile) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    break;
+	case RENDER_PHOTO:
+	    photoName = Tcl_GetString(objv[i + 1]);
+	    break;
+	case RENDER_FILE:
+	    fileName = Tcl_GetString(objv[i + 1]);
+	    break;
+	}
+    }
+    if (Tcl_GetIntFromObj(interp, objv[objc - 3], &width) != TCL_OK
+	    || Tcl_GetIntFromObj(interp, objv[objc - 2], &height) != TCL_OK) {
+	return TCL_ERROR;
+    }
+
+    /*
+     * A thread can only have one current context, of either API, so a
+     * widget context is released while rendering and restored afterwards.
+     */
+
+    if (glxContext) {
+	glXMakeCurrent(glxDisplay, None, NULL);
+    }
+    result = MakeCurrent(interp, tsdPtr, platform, device, profile);
+    if (result == TCL_OK) {
+	result = TkglFramebufferResize(interp, &tsdPtr->framebuffer, width,
+		height);
+    }
+    if (result == TCL_OK) {
+	glViewport(0, 0, width, height);
+	result = Tcl_EvalObjEx(interp, objv[objc - 1], TCL_EVAL_GLOBAL);
+    }
+    if (result == TCL_OK) {
+	/* The script may have made another context current. */
+	result = MakeCurrent(interp, tsdPtr, platform, device, profile);
+    }
+    if (result == TCL_OK) {
+	result = TkglFramebufferResize(interp, &tsdPtr->framebuffer, width,
+		height);
+    }
+    if (result == TCL_OK) {
+	pixelsObj = ReadPixels(width, height);
+	Tcl_IncrRefCount(pixelsObj);
+    }
+    if (eglContext != EGL_NO_CONTEXT) {
+	/* A software widget was current. */
+	eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		eglContext);
+    } else if (tsdPtr->display != EGL_NO_DISPLAY) {
+	eglMakeCurrent(tsdPtr->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		EGL_NO_CONTEXT);
+    }
+    if (glxContext) {
+	glXMakeCurrent(glxDisplay, glxDrawable, glxContext);
+    }
+    if (result != TCL_OK) {
+	return TCL_ERROR;
+    }
+
+    Tcl_ResetResult(interp);
+    if (photoName) {
+	result = PutPhoto(interp, photoName,
+		Tcl_GetByteArrayFromObj(pixelsObj, NULL), width, height);
+    }
+    if (result == TCL_OK && fileName) {
+	pngPtr = TkglPNGOpen(fileName, width, height);
+	if (pngPtr == NULL) {
+	    Tcl_AppendResult(interp, "couldn't open \"", fileName, "\": ",
+		Tcl_PosixError(interp), NULL);
+	    result = TCL_ERROR;
+	} else {
+	    TkglPNGWriteRows(pngPtr, Tcl_GetByteArrayFromObj(pixelsObj, NULL),
+		    height);
+	    if (!TkglPNGClose(pngPtr)) {
+		Tcl_AppendResult(interp, "error writing \"", fileName, "\"",
+		    NULL);
+		result = TCL_ERROR;
+	    }
+	}
+    }
+    if (result == TCL_OK && photoName == NULL && fileName == NULL) {
+	Tcl_SetObjResult(interp, pixelsObj);
+    }
+    Tcl_DecrRefCount(pixelsObj);
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DevicesObjCmd --
+ *
+ *	Implements the tkgl::devices command, which returns a list with an
+ *	element for each EGL device, in the order used by the -device option
+ *	of tkgl::render.  The element is the DRM render node or device file
+ *	of the device, or "software" for a software renderer.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+DevicesObjCmd(
+    void *clientData,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[])
+{
+    EGLDeviceEXT devices[MAX_DEVICES];
+    EGLint count = 0, i;
+    Tcl_Obj *listObj;
+    const char *extensions, *name;
+
+    (void) clientData;
+    if (objc != 1) {
+	Tcl_WrongNumArgs(interp, 1, objv, NULL);
+	return TCL_ERROR;
+    }
+    listObj = Tcl_NewListObj(0, NULL);
+    if (InitClientExtensions() && queryDevices
+	    && queryDevices(MAX_DEVICES, devices, &count)) {
+	for (i = 0; i < count; i++) {
+	    name = NULL;
+	    extensions = queryDeviceString
+		    ? queryDeviceString(devices[i], EGL_EXTENSIONS) : NULL;
+	    if (HasExtension(extensions, "EGL_EXT_device_drm_render_node")) {
+		name = queryDeviceString(devices[i],
+			EGL_DRM_RENDER_NODE_FILE_EXT);
+	    }
+	    if (name == NULL && HasExtension(extensions,
+		    "EGL_EXT_device_drm")) {
+		name = queryDeviceString(devices[i], EGL_DRM_DEVICE_FILE_EXT);
+	    }
+	    if (name == NULL) {
+		name = HasExtension(extensions, "EGL_MESA_device_software")
+			? "software" : "unknown";
+	    }
+	    Tcl_ListObjAppendElement(NULL, listObj,
+		    Tcl_NewStringObj(name, TCL_INDEX_NONE));
+	}
+    }
+    Tcl_SetObjResult(interp, listObj);
+    return TCL_OK;
+}
+
+/*
+ * Check that images of a window can be filled with BGRA pixels as read
+ * by glReadPixels, which is the case for the usual 24 bit TrueColor
+ * visuals on little endian servers.
+ */
+
+static int
+HasBGRAVisual(
+    Tk_Window tkwin)
+{
+    Display *display = Tk_Display(tkwin);
+    Visual *visual = Tk_Visual(tkwin);
+    XPixmapFormatValues *formats;
+    int i, count, bitsPerPixel = 0;
+
+    if (visual->class != TrueColor || visual->red_mask != 0xff0000
+	    || visual->green_mask != 0xff00 || visual->blue_mask != 0xff
+	    || ImageByteOrder(display) != LSBFirst) {
+	return 0;
+    }
+    formats = XListPixmapFormats(display, &count);
+    for (i = 0; i < count; i++) {
+	if (formats[i].depth == Tk_Depth(tkwin)) {
+	    bitsPerPixel = formats[i].bits_per_pixel;
+	}
+    }
+    if (formats) {
+	XFree(formats);
+    }
+    return bitsPerPixel == 32;
+}
+
+static int
+IgnoreXError(
+    void *clientData,
+    XErrorEvent *errEventPtr)
+{
+    *(int *) clientData = 1;
+    return 0;
+}
+
+/*
+ * Free the image of a software widget.
+ */
+
+static void
+FreeImage(
+    Display *display,
+    TkglSoftware *swPtr)
+{
+    if (swPtr->image == NULL) {
+	return;
+    }
+    if (swPtr->putPending) {
+	XSync(display, False);
+	swPtr->putPending = 0;
+    }
+    if (swPtr->shmInfo.shmaddr) {
+	XShmDetach(display, &swPtr->shmInfo);
+	XDestroyImage(swPtr->image);
+	shmdt(swPtr->shmInfo.shmaddr);
+	swPtr->shmInfo.shmaddr = NULL;
+    } else {
+	ckfree(swPtr->image->data);
+	swPtr->image->data = NULL;
+	XDestroyImage(swPtr->image);
+    }
+    swPtr->image = NULL;
+}
+
+/*
+ * Create an image of the given size for a software widget, in shared
+ * memory if the server can attach it.  A server which cannot, for example
+ * because it is remote, is not asked again.
+ */
+
+static void
+CreateImage(
+    Tk_Window tkwin,
+    TkglSoftware *swPtr,
+    int width,
+    int height)
+{
+    Display *display = Tk_Display(tkwin);
+    Tk_ErrorHandler handler;
+    int failed = 0;
+
+    if (swPtr->useShm) {
+	swPtr->image = XShmCreateImage(display, Tk_Visual(tkwin),
+		Tk_Depth(tkwin), ZPixmap, NULL, &swPtr->shmInfo, width,
+		height);
+	if (swPtr->image) {
+	    swPtr->shmInfo.shmid = shmget(IPC_PRIVATE,
+		    (size_t) swPtr->image->bytes_per_line * height,
+		    IPC_CREAT | 0600);
+	}
+	if (swPtr->image && swPtr->shmInfo.shmid >= 0) {
+	    swPtr->shmInfo.shmaddr = swPtr->image->data =
+		    (char *) shmat(swPtr->shmInfo.shmid, NULL, 0);
+	    swPtr->shmInfo.readOnly = True;
+	    handler = Tk_CreateErrorHandler(display, -1, -1, -1,
+		    IgnoreXError, &failed);
+	    if (swPtr->shmInfo.shmaddr == (char *) -1
+		    || !XShmAttach(display, &swPtr->shmInfo)) {
+		failed = 1;
+	    }
+	    XSync(display, False);
+	    Tk_DeleteErrorHandler(handler);
+
+	    /* The segment goes away when both sides have detached. */
+	    shmctl(swPtr->shmInfo.shmid, IPC_RMID, NULL);
+	    if (!failed) {
+		return;
+	    }
+	    if (swPtr->shmInfo.shmaddr != (char *) -1) {
+		shmdt(swPtr->shmInfo.shmaddr);
+	    }
+	}
+	if (swPtr->image) {
+	    swPtr->image->data = NULL;
+	    XDestroyImage(swPtr->image);
+	}
+	swPtr->shmInfo.shmaddr = NULL;
+	swPtr->useShm = 0;
+    }
+    swPtr->image = XCreateImage(display, Tk_Visual(tkwin), Tk_Depth(tkwin),
+	    ZPixmap, 0, NULL, width, height, 32, 0);
+    swPtr->image->data = (char *) ckalloc(
+	    (size_t) swPtr->image->bytes_per_line * height);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglSoftwareCreate --
+ *
+ *	Set up the software renderer for a widget, in place of a GLX context.
+ *	The widget gets a framebuffer which is resized to the widget, as for
+ *	-offscreen fbo, and its window is an ordinary Tk window.
+ *
+ *	If shareWith is not NULL, which must be another software widget, the
+ *	new context shares its objects.  With -sharecontext as well as with
+ *	-sharelist the widget gets a context of its own, since each software
+ *	widget binds its own framebuffer.
+ *
+ * Results:
+ *	A standard Tcl result, with an error message in the interp of the
+ *	widget on failure.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglSoftwareCreate(
+    Tkgl *tkglPtr,
+    Tkgl *shareWith)
+{
+    Tcl_Interp *interp = tkglPtr->interp;
+    EGLDisplay display;
+    EGLContext context;
+    TkglSoftware *swPtr;
+
+    if (tkglPtr->pBufferFlag) {
+	Tcl_SetResult(interp, "the software renderer does not support "
+	    "pbuffers", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (!tkglPtr->rgbaFlag || tkglPtr->stereo == TKGL_STEREO_NATIVE) {
+	Tcl_SetResult(interp, "the software renderer does not support color "
+	    "index or native stereo", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (!HasBGRAVisual(tkglPtr->tkwin)) {
+	Tcl_SetResult(interp, "the software renderer needs a 24 bit "
+	    "TrueColor visual", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (shareWith && shareWith->software == NULL) {
+	Tcl_SetResult(interp, "can't share objects between GLX and software "
+	    "rendered widgets", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    display = OpenDisplay(interp, PLATFORM_SURFACELESS, 0);
+    if (display == EGL_NO_DISPLAY) {
+	return TCL_ERROR;
+    }
+    context = CreateContext(interp, display, tkglPtr->profile,
+	    shareWith ? shareWith->software->context : EGL_NO_CONTEXT);
+    if (context == EGL_NO_CONTEXT) {
+	return TCL_ERROR;
+    }
+    swPtr = (TkglSoftware *) ckalloc(sizeof(TkglSoftware));
+    memset(swPtr, 0, sizeof(TkglSoftware));
+    swPtr->display = display;
+    swPtr->context = context;
+    swPtr->useShm = XShmQueryExtension(tkglPtr->display);
+    tkglPtr->software = swPtr;
+    tkglPtr->softwareFlag = True;
+    tkglPtr->framebuffer = (TkglFramebuffer *)
+	    ckalloc(sizeof(TkglFramebuffer));
+    memset(tkglPtr->framebuffer, 0, sizeof(TkglFramebuffer));
+    TkglSoftwareMakeCurrent(tkglPtr);
+    if (TkglFramebufferInit(interp, tkglPtr->framebuffer, tkglPtr)
+	    != TCL_OK) {
+	TkglSoftwareFree(tkglPtr);
+	return TCL_ERROR;
+    }
+    TkglGroupJoin(tkglPtr, shareWith);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglSoftwareMakeCurrent --
+ *
+ *	Make the context of a software widget current and bind its
+ *	framebuffer.  A GLX context which is current is released first,
+ *	since a thread can only have a current context of one API.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglSoftwareMakeCurrent(
+    const Tkgl *tkglPtr)
+{
+    TkglSoftware *swPtr = tkglPtr->software;
+    Display *glxDisplay = glXGetCurrentDisplay();
+
+    if (glXGetCurrentContext() && glxDisplay) {
+	glXMakeCurrent(glxDisplay, None, NULL);
+    }
+    eglMakeCurrent(swPtr->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+	    swPtr->context);
+    TkglOffscreenBind(tkglPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglSoftwareRelease --
+ *
+ *	Called before a GLX context is made current, to release the context
+ *	of a software widget if one is current.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglSoftwareRelease(void)
+{
+    EGLDisplay display;
+
+    if (eglGetCurrentContext() != EGL_NO_CONTEXT) {
+	display = eglGetCurrentDisplay();
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		EGL_NO_CONTEXT);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglSoftwarePresent --
+ *
+ *	Copy the framebuffer of a software widget, whose context is current,
+ *	to its window.  With shared memory the copy is asynchronous, and the
+ *	next call waits for the server to finish reading the image before
+ *	overwriting it.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglSoftwarePresent(
+    const Tkgl *tkglPtr)
+{
+    TkglSoftware *swPtr = tkglPtr->software;
+    Tk_Window tkwin = tkglPtr->tkwin;
+    Display *display = tkglPtr->display;
+    int width = tkglPtr->framebuffer->width;
+    int height = tkglPtr->framebuffer->height;
+    GLint packAlignment, packRowLength, packSkipPixels, packSkipRows;
+    GLint packBuffer = 0;
+    const TkglBufferProcs *procs = TkglGetBufferProcs();
+    XGCValues values;
+
+    if (tkwin == NULL || !Tk_IsMapped(tkwin) || width <= 0 || height <= 0) {
+	glFlush();
+	return;
+    }
+    if (swPtr->putPending) {
+	XSync(display, False);
+	swPtr->putPending = 0;
+    }
+    if (swPtr->image && (swPtr->image->width != width
+	    || swPtr->image->height != height)) {
+	FreeImage(display, swPtr);
+    }
+    if (swPtr->image == NULL) {
+	CreateImage(tkwin, swPtr, width, height);
+    }
+    if (swPtr->gc == NULL) {
+	values.graphics_exposures = False;
+	swPtr->gc = Tk_GetGC(tkwin, GCGraphicsExposures, &values);
+    }
+
+    glGetIntegerv(GL_PACK_ALIGNMENT, &packAlignment);
+    glGetIntegerv(GL_PACK_ROW_LENGTH, &packRowLength);
+    glGetIntegerv(GL_PACK_SKIP_PIXELS, &packSkipPixels);
+    glGetIntegerv(GL_PACK_SKIP_ROWS, &packSkipRows);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glPixelStorei(GL_PACK_ROW_LENGTH, swPtr->image->bytes_per_line / 4);
+    glPixelStorei(GL_PACK_SKIP_PIXELS, 0);
+    glPixelStorei(GL_PACK_SKIP_ROWS, 0);
+    if (procs) {
+	glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &packBuffer);
+	if (packBuffer) {
+	    procs->bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+    }
+    glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE,
+	    swPtr->image->data);
+    if (packBuffer) {
+	procs->bindBuffer(GL_PIXEL_PACK_BUFFER, packBuffer);
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, packAlignment);
+    glPixelStorei(GL_PACK_ROW_LENGTH, packRowLength);
+    glPixelStorei(GL_PACK_SKIP_PIXELS, packSkipPixels);
+    glPixelStorei(GL_PACK_SKIP_ROWS, packSkipRows);
+
+    /* The image is top-down. */
+    TkglFlipRows((unsigned char *) swPtr->image->data,
+	    (unsigned char *) swPtr->image->data,
+	    (size_t) swPtr->image->bytes_per_line, height);
+    if (swPtr->shmInfo.shmaddr) {
+	XShmPutImage(display, Tk_WindowId(tkwin), swPtr->gc, swPtr->image,
+		0, 0, 0, 0, width, height, False);
+	swPtr->putPending = 1;
+    } else {
+	XPutImage(display, Tk_WindowId(tkwin), swPtr->gc, swPtr->image,
+		0, 0, 0, 0, width, height);
+    }
+    XFlush(display);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglSoftwareFree --
+ *
+ *	Free the software renderer of a widget, including its context and
+ *	framebuffer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TkglSoftwareFree(
+    Tkgl *tkglPtr)
+{
+    TkglSoftware *swPtr = tkglPtr->software;
+
+    if (swPtr == NULL) {
+	return;
+    }
+    if (tkglPtr->framebuffer) {
+	TkglFramebuffer *fbPtr = tkglPtr->framebuffer;
+
+	/*
+	 * Its renderbuffers would outlive the context if another widget
+	 * shares its objects.  The framebuffer is detached first so making
+	 * the context current does not bind it.
+	 */
+
+	tkglPtr->framebuffer = NULL;
+	TkglSoftwareMakeCurrent(tkglPtr);
+	TkglFramebufferFree(fbPtr);
+	ckfree(fbPtr);
+    }
+    if (eglGetCurrentContext() == swPtr->context) {
+	eglMakeCurrent(swPtr->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		EGL_NO_CONTEXT);
+    }
+    eglDestroyContext(swPtr->display, swPtr->context);
+    FreeImage(tkglPtr->display, swPtr);
+    if (swPtr->gc) {
+	Tk_FreeGC(tkglPtr->display, swPtr->gc);
+    }
+    ckfree(swPtr);
+    tkglPtr->software = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglHeadlessInit --
+ *
+ *	Create the tkgl::render and tkgl::devices commands.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglHeadlessInit(
+    Tcl_Interp *interp)
+{
+    if (Tcl_CreateObjCommand(interp, "tkgl::render", RenderObjCmd, NULL,
+	    NULL) == NULL || Tcl_CreateObjCommand(interp, "tkgl::devices",
+	    DevicesObjCmd, NULL, NULL) == NULL) {
+	return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * fill-column: 78
+ * End:
+ */
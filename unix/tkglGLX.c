@@ -14,23 +14,32 @@
   functions declared in tkgl.h.  They comprise the platform interface.
 
 void Tkgl_Update(const Tkgl *tkglPtr);
+void Tkgl_ScheduleRedisplay(Tkgl *tkglPtr);
+void Tkgl_CancelRedisplay(Tkgl *tkglPtr);
 Window Tkgl_MakeWindow(Tk_Window tkwin, Window parent, void* instanceData);
 void Tkgl_MapWidget(void *instanceData);
 void Tkgl_UnmapWidget(void *instanceData);
 void Tkgl_WorldChanged(void* instanceData);
 void Tkgl_MakeCurrent(const Tkgl *tkglPtr);
 void Tkgl_SwapBuffers(const Tkgl *tkglPtr);
+int Tkgl_BufferAge(const Tkgl *tkglPtr);
 int Tkgl_TakePhoto(Tkgl *tkglPtr, Tk_PhotoHandle photo);
 int Tkgl_CopyContext(const Tkgl *from, const Tkgl *to, unsigned mask);
 int Tkgl_CreateGLContext(Tkgl *tkglPtr);
 const char* Tkgl_GetExtensions(Tkgl *TkglPtr);
+void *Tkgl_GetProcAddress(const char *name);
 void Tkgl_FreeResources(Tkgl *TkglPtr);
 */
 
 #include <stdbool.h>
+#include <unistd.h>
 #include "tkgl.h"
 #include "tkglPlatform.h"
 #include "tkInt.h"  /* for TkWindow */
+#ifdef __linux__
+#  include <sys/timerfd.h>
+#  define HAVE_TIMERFD 1
+#endif
 
 static Colormap get_rgb_colormap(Display *dpy, int scrnum,
 		    const XVisualInfo *visinfo, Tk_Window tkwin);
@@ -53,6 +62,18 @@ static const int attributes_4_1[] = {
   None
 };
 
+#ifndef GLX_CONTEXT_RELEASE_BEHAVIOR_ARB
+#define GLX_CONTEXT_RELEASE_BEHAVIOR_ARB 0x2097
+#define GLX_CONTEXT_RELEASE_BEHAVIOR_NONE_ARB 0
+#endif
+#ifndef GLX_BACK_BUFFER_AGE_EXT
+#define GLX_BACK_BUFFER_AGE_EXT 0x20F4
+#endif
+#ifndef GL_FRAMEBUFFER_BINDING
+#define GL_FRAMEBUFFER 0x8D40
+#define GL_FRAMEBUFFER_BINDING 0x8CA6
+#endif
+
 #define ALL_EVENTS_MASK         \
    (KeyPressMask                \
    |KeyReleaseMask              \
@@ -82,6 +103,76 @@ static PFNGLXQUERYDRAWABLEPROC queryPbuffer = NULL;
 static Bool hasMultisampling = False;
 static Bool hasPbuffer = False;
 
+/*
+ * The frame clock.
+ *
+ * Redraws requested by TkglPostRedisplay are not run as idle handlers.
+ * Instead the widget is queued on a frame clock which is shared by all tkgl
+ * widgets on the same X display.  The clock ticks once per refresh
+ * interval, just after the vertical blank, and draws all of the queued
+ * widgets.  So a widget is drawn at most once per displayed frame, and it
+ * is drawn early enough in the interval to make the next vertical blank.
+ * A clock which has been idle for a full interval ticks immediately.
+ *
+ * The refresh rate and the time of the most recent vertical blank come from
+ * GLX_OML_sync_control when the driver provides it.  Without it the clock
+ * assumes a 60 Hz display.  When GLX_INTEL_swap_event is available the
+ * clock also listens for swap completion events.  It does not draw new
+ * frames while a swap is still in flight, since those frames could not be
+ * shown, and it ticks as soon as the last swap completes.  On Linux the
+ * clock is driven by a timerfd, elsewhere by a Tcl timer handler.
+ *
+ * A tick draws the focused widget first, then the mapped ones, then the
+ * offscreen ones, each group by -priority and then by context, so that
+ * widgets sharing a context are drawn one after the other.  Ticks have a
+ * time budget, one refresh interval unless tkgl::framebudget says
+ * otherwise.  When it runs out the remaining widgets are deferred to the
+ * next tick, where they are drawn before any others, so a slow widget can
+ * delay the rest by at most a frame.
+ */
+
+#define DEFAULT_REFRESH_PERIOD 16667	/* microseconds, i.e. 60 Hz */
+
+typedef struct FrameClock {
+    struct FrameClock *next;	/* Next clock in the per-thread list. */
+    Display *display;		/* The display served by this clock. */
+    int refCount;		/* Number of widgets using this clock. */
+    Tkgl *queueHead;		/* Widgets waiting for the next tick. */
+    Tkgl *queueTail;
+    Tkgl *runHead;		/* Widgets still to be drawn by this tick. */
+    Tcl_WideInt period;		/* Refresh interval in microseconds. */
+    Tcl_WideInt lastVblank;	/* Time of a recent vertical blank. */
+    Tcl_WideInt lastTick;	/* Time when the clock last ticked. */
+    Tcl_WideInt deadline;	/* Time of the next scheduled tick. */
+    Tcl_WideInt swapTime;	/* Time of the most recent buffer swap. */
+    int swapsInFlight;		/* Swaps not yet reported as complete. */
+    int armed;			/* True if a tick has been scheduled. */
+    int hasSyncControl;		/* GLX_OML_sync_control is available. */
+    int hasSwapEvent;		/* GLX_INTEL_swap_event is available. */
+    int hasBufferAge;		/* GLX_EXT_buffer_age is available. */
+    int hasCopySubBuffer;	/* GLX_MESA_copy_sub_buffer is available. */
+    int glxEventBase;		/* First GLX event code on the display. */
+    int timerFd;		/* The timerfd driving the clock, or -1. */
+    Tcl_TimerToken timerToken;	/* The timer driving the clock otherwise. */
+} FrameClock;
+
+typedef struct {
+    FrameClock *clockList;	/* All frame clocks in this thread. */
+    Tcl_WideInt budget;		/* Time a tick may spend drawing, in
+				 * microseconds.  0 means one refresh
+				 * interval and a negative value no limit. */
+} FrameClockData;
+
+static Tcl_ThreadDataKey frameClockKey;
+static PFNGLXGETSYNCVALUESOMLPROC getSyncValues = NULL;
+static PFNGLXGETMSCRATEOMLPROC getMscRate = NULL;
+static void (*copySubBuffer)(Display *dpy, GLXDrawable drawable, int x,
+	int y, int width, int height) = NULL;
+
+static FrameClock *AcquireFrameClock(Display *display);
+static void ReleaseFrameClock(FrameClock *clockPtr);
+static void ArmFrameClock(FrameClock *clockPtr);
+
 struct FBInfo
 {
     int     acceleration;
@@ -89,6 +180,17 @@ struct FBInfo
     int     depth;
     int     colors;
     GLXFBConfig fbcfg;
+    /* The remaining attributes are reported by tkgl::pixelformats. */
+    int     id;
+    int     visualId;
+    int     renderType;
+    int     drawableType;
+    int     doubleBuffer;
+    int     stereo;
+    int     red, green, blue, alpha;
+    int     stencil;
+    int     accumRed, accumGreen, accumBlue, accumAlpha;
+    int     aux;
 };
 typedef struct FBInfo FBInfo;
 
@@ -99,13 +201,32 @@ static void getFBInfo(
 {
     info->fbcfg = cfg;
     /* GLX_NONE < GLX_SLOW_CONFIG < GLX_NON_CONFORMANT_CONFIG */
-    getFBConfigAttrib(display, cfg, GLX_CONFIG_CAVEAT, &info->acceleration);
+    glXGetFBConfigAttrib(display, cfg, GLX_CONFIG_CAVEAT, &info->acceleration);
     /* Number of bits per color */
-    getFBConfigAttrib(display, cfg, GLX_BUFFER_SIZE, &info->colors);
+    glXGetFBConfigAttrib(display, cfg, GLX_BUFFER_SIZE, &info->colors);
     /* Number of bits per depth value. */
-    getFBConfigAttrib(display, cfg, GLX_DEPTH_SIZE, &info->depth);
+    glXGetFBConfigAttrib(display, cfg, GLX_DEPTH_SIZE, &info->depth);
     /* Number of samples per pixesl when multisampling. */
-    getFBConfigAttrib(display, cfg, GLX_SAMPLES, &info->samples);
+    glXGetFBConfigAttrib(display, cfg, GLX_SAMPLES, &info->samples);
+    glXGetFBConfigAttrib(display, cfg, GLX_FBCONFIG_ID, &info->id);
+    glXGetFBConfigAttrib(display, cfg, GLX_VISUAL_ID, &info->visualId);
+    glXGetFBConfigAttrib(display, cfg, GLX_RENDER_TYPE, &info->renderType);
+    glXGetFBConfigAttrib(display, cfg, GLX_DRAWABLE_TYPE,
+	    &info->drawableType);
+    glXGetFBConfigAttrib(display, cfg, GLX_DOUBLEBUFFER, &info->doubleBuffer);
+    glXGetFBConfigAttrib(display, cfg, GLX_STEREO, &info->stereo);
+    glXGetFBConfigAttrib(display, cfg, GLX_RED_SIZE, &info->red);
+    glXGetFBConfigAttrib(display, cfg, GLX_GREEN_SIZE, &info->green);
+    glXGetFBConfigAttrib(display, cfg, GLX_BLUE_SIZE, &info->blue);
+    glXGetFBConfigAttrib(display, cfg, GLX_ALPHA_SIZE, &info->alpha);
+    glXGetFBConfigAttrib(display, cfg, GLX_STENCIL_SIZE, &info->stencil);
+    glXGetFBConfigAttrib(display, cfg, GLX_ACCUM_RED_SIZE, &info->accumRed);
+    glXGetFBConfigAttrib(display, cfg, GLX_ACCUM_GREEN_SIZE,
+	    &info->accumGreen);
+    glXGetFBConfigAttrib(display, cfg, GLX_ACCUM_BLUE_SIZE, &info->accumBlue);
+    glXGetFBConfigAttrib(display, cfg, GLX_ACCUM_ALPHA_SIZE,
+	    &info->accumAlpha);
+    glXGetFBConfigAttrib(display, cfg, GLX_AUX_BUFFERS, &info->aux);
 }
 
 static Bool isBetterFB(
@@ -124,6 +245,353 @@ static Bool isBetterFB(
     return false;
 }
 
+/*
+ * The -formatpolicy option decides among the configs which meet the
+ * requested minimums.  best-quality uses isBetterFB.  cheapest-sufficient
+ * takes the config with the fewest bits per pixel, as given by FBCost,
+ * which is roughly the memory and bandwidth the config uses.  weighted
+ * counts each bit of a buffer which was asked for as one and each bit of
+ * a buffer which was not asked for as minus WASTE_WEIGHT.  A config which
+ * is slow or non-conformant always loses, as it does for isBetterFB.
+ */
+
+#define WASTE_WEIGHT 2
+
+static int
+FBCost(
+    const FBInfo *x)
+{
+    int buffers = (x->doubleBuffer ? 2 : 1) * (x->stereo ? 2 : 1) + x->aux;
+    int samples = x->samples > 1 ? x->samples : 1;
+
+    return (buffers * x->colors + x->depth + x->stencil) * samples
+	    + x->accumRed + x->accumGreen + x->accumBlue + x->accumAlpha;
+}
+
+static Bool
+IsRequested(
+    const int *attribs,
+    int name)
+{
+    int i;
+
+    for (i = 0; attribs[i] != None; i += 2) {
+	if (attribs[i] == name) {
+	    return True;
+	}
+    }
+    return False;
+}
+
+/*
+ * Return the bits per pixel of the buffers in a config which the attribute
+ * list did not ask for.  If listPtr is not NULL the names of those buffers
+ * are appended to it.
+ */
+
+static int
+FBWaste(
+    const FBInfo *x,
+    const int *attribs,
+    Tcl_Obj *listPtr)
+{
+    int samples = x->samples > 1 ? x->samples : 1;
+    int buffers = (x->doubleBuffer ? 2 : 1) * (x->stereo ? 2 : 1) + x->aux;
+    int waste = 0;
+
+#define WASTED(name, bits) \
+    waste += (bits); \
+    if (listPtr) { \
+	Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj(name, -1)); \
+    }
+
+    if (x->depth && !IsRequested(attribs, GLX_DEPTH_SIZE)) {
+	WASTED("depth", x->depth * samples);
+    }
+    if (x->stencil && !IsRequested(attribs, GLX_STENCIL_SIZE)) {
+	WASTED("stencil", x->stencil * samples);
+    }
+    if (x->accumRed && !IsRequested(attribs, GLX_ACCUM_RED_SIZE)) {
+	WASTED("accum", x->accumRed + x->accumGreen + x->accumBlue
+		+ x->accumAlpha);
+    }
+    if (x->aux && !IsRequested(attribs, GLX_AUX_BUFFERS)) {
+	WASTED("aux", x->aux * x->colors * samples);
+    }
+    if (x->stereo && !IsRequested(attribs, GLX_STEREO)) {
+	WASTED("stereo", (x->doubleBuffer ? 2 : 1) * x->colors * samples);
+    }
+    if (samples > 1 && !IsRequested(attribs, GLX_SAMPLE_BUFFERS_ARB)) {
+	WASTED("multisample", (samples - 1)
+		* (buffers * x->colors + x->depth + x->stencil));
+    }
+#undef WASTED
+    return waste;
+}
+
+static int
+FBScore(
+    const FBInfo *x,
+    const int *attribs)
+{
+    int waste = FBWaste(x, attribs, NULL);
+
+    return FBCost(x) - waste - WASTE_WEIGHT * waste;
+}
+
+/* True if x is preferred to y under a -formatpolicy. */
+
+static Bool
+isPreferredFB(
+    const FBInfo *x,
+    const FBInfo *y,
+    enum formatPolicy policy,
+    const int *attribs)
+{
+    int a, b;
+
+    if (x->acceleration != y->acceleration) {
+	return (x->acceleration < y->acceleration);
+    }
+    switch (policy) {
+    case FORMAT_POLICY_CHEAPEST:
+	a = FBCost(y);
+	b = FBCost(x);
+	break;
+    case FORMAT_POLICY_WEIGHTED:
+	a = FBScore(x, attribs);
+	b = FBScore(y, attribs);
+	break;
+    default:
+	a = b = 0;
+	break;
+    }
+    if (a != b) {
+	return (a > b);
+    }
+    return isBetterFB(x, y);
+}
+
+/*
+ * The framebuffer configurations of each screen are read once, when the
+ * first widget is created on it, together with the GLX version and
+ * extensions.  The config which tkgl_pixelFormat chooses for a list of
+ * attributes is remembered as well, keyed by the attribute list padded
+ * with zeros and followed by the -formatpolicy, so widgets with the same
+ * options reuse the choice.
+ */
+
+#define FB_KEY_SIZE 64		/* ints in an attribute list */
+
+typedef struct FBConfigTable {
+    struct FBConfigTable *next;	/* Next table in the per-thread list. */
+    Display *display;
+    int screen;
+    int major, minor;		/* GLX version */
+    const char *extensions;	/* GLX extensions of the screen */
+    int count;			/* Number of configs */
+    FBInfo *configs;		/* Attributes of each config */
+    Tcl_HashTable chosen;	/* Attribute list and policy -> index of
+				 * the preferred matching config, or -1 */
+} FBConfigTable;
+
+typedef struct {
+    FBConfigTable *tableList;	/* All config tables in this thread. */
+} FBConfigData;
+
+static Tcl_ThreadDataKey fbConfigKey;
+
+static void
+FreeFBConfigTables(
+    void *clientData)
+{
+    FBConfigData *dataPtr = (FBConfigData *) clientData;
+    FBConfigTable *tablePtr;
+
+    while ((tablePtr = dataPtr->tableList) != NULL) {
+	dataPtr->tableList = tablePtr->next;
+	Tcl_DeleteHashTable(&tablePtr->chosen);
+	ckfree(tablePtr->configs);
+	ckfree(tablePtr);
+    }
+}
+
+/*
+ * Return the config table of a screen, reading it the first time.  Returns
+ * NULL if the display does not support GLX.
+ */
+
+static FBConfigTable *
+GetFBConfigTable(
+    Display *display,
+    int screen)
+{
+    FBConfigData *dataPtr = (FBConfigData *)
+	Tcl_GetThreadData(&fbConfigKey, sizeof(FBConfigData));
+    FBConfigTable *tablePtr;
+    GLXFBConfig *cfgs;
+    int i, count = 0, dummy;
+
+    for (tablePtr = dataPtr->tableList; tablePtr; tablePtr = tablePtr->next) {
+	if (tablePtr->display == display && tablePtr->screen == screen) {
+	    return tablePtr;
+	}
+    }
+    if (!glXQueryExtension(display, &dummy, &dummy)) {
+	return NULL;
+    }
+    if (dataPtr->tableList == NULL) {
+	Tcl_CreateThreadExitHandler(FreeFBConfigTables, dataPtr);
+    }
+    tablePtr = (FBConfigTable *) ckalloc(sizeof(FBConfigTable));
+    memset(tablePtr, 0, sizeof(FBConfigTable));
+    tablePtr->display = display;
+    tablePtr->screen = screen;
+    glXQueryVersion(display, &tablePtr->major, &tablePtr->minor);
+    tablePtr->extensions = glXQueryExtensionsString(display, screen);
+    if (tablePtr->extensions == NULL) {
+	tablePtr->extensions = "";
+    }
+    cfgs = glXGetFBConfigs(display, screen, &count);
+    tablePtr->configs = (FBInfo *) ckalloc(sizeof(FBInfo) * (count + 1));
+    for (i = 0; i < count; i++) {
+	getFBInfo(display, cfgs[i], &tablePtr->configs[i]);
+    }
+    tablePtr->count = count;
+    if (cfgs) {
+	XFree(cfgs);
+    }
+    Tcl_InitHashTable(&tablePtr->chosen, FB_KEY_SIZE + 1);
+    tablePtr->next = dataPtr->tableList;
+    dataPtr->tableList = tablePtr;
+    return tablePtr;
+}
+
+/*
+ * Return the index of the best config in a table among those which have a
+ * given visual, or -1 if there are none.
+ */
+
+static int
+FindConfigForVisual(
+    const FBConfigTable *tablePtr,
+    int visualId)
+{
+    int i, best = -1;
+
+    for (i = 0; i < tablePtr->count; i++) {
+	if (tablePtr->configs[i].visualId == visualId && (best < 0
+		|| isBetterFB(&tablePtr->configs[i],
+		    &tablePtr->configs[best]))) {
+	    best = i;
+	}
+    }
+    return best;
+}
+
+/*
+ * Return the index of the config in a table which the policy prefers among
+ * those chosen by glXChooseFBConfig for an attribute list, or -1 if there
+ * are none.  The result is remembered for the next widget with the same
+ * attributes and policy.
+ */
+
+static int
+ChooseConfig(
+    FBConfigTable *tablePtr,
+    const int *attribs,
+    enum formatPolicy policy)
+{
+    Tcl_HashEntry *entryPtr;
+    GLXFBConfig *cfgs;
+    int key[FB_KEY_SIZE + 1];
+    int i, j, id, isNew, count = 0, best = -1;
+
+    memcpy(key, attribs, sizeof(int) * FB_KEY_SIZE);
+    key[FB_KEY_SIZE] = (int) policy;
+    entryPtr = Tcl_CreateHashEntry(&tablePtr->chosen, (const char *) key,
+	    &isNew);
+    if (!isNew) {
+	return (int) (intptr_t) Tcl_GetHashValue(entryPtr);
+    }
+    cfgs = chooseFBConfig(tablePtr->display, tablePtr->screen, attribs,
+	    &count);
+    for (i = 0; i < count; i++) {
+	getFBConfigAttrib(tablePtr->display, cfgs[i], GLX_FBCONFIG_ID, &id);
+	for (j = 0; j < tablePtr->count; j++) {
+	    if (tablePtr->configs[j].id == id) {
+		break;
+	    }
+	}
+	if (j < tablePtr->count && (best < 0 || isPreferredFB(
+		&tablePtr->configs[j], &tablePtr->configs[best], policy,
+		attribs))) {
+	    best = j;
+	}
+    }
+    if (cfgs) {
+	XFree(cfgs);
+    }
+    Tcl_SetHashValue(entryPtr, (void *) (intptr_t) best);
+    return best;
+}
+
+/*
+ * Build the dict reported by the formatinfo widget command, which says
+ * which config was chosen and why.  The attribute list is NULL when the
+ * config was named by -pixelformat.
+ */
+
+static Tcl_Obj *
+DescribeChoice(
+    const FBInfo *info,
+    const int *attribs,
+    enum formatPolicy policy)
+{
+    static const char *const policyNames[] = {
+	"best-quality", "cheapest-sufficient", "weighted"
+    };
+    Tcl_Obj *dictPtr = Tcl_NewDictObj();
+    Tcl_Obj *unrequestedPtr = Tcl_NewListObj(0, NULL);
+    Tcl_Obj *reasonPtr;
+    int cost = FBCost(info);
+
+#define PUT(key, value) \
+    Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj(key, -1), value)
+
+    if (attribs == NULL) {
+	reasonPtr = Tcl_NewStringObj(
+		"the best config with the visual given by -pixelformat", -1);
+    } else {
+	(void) FBWaste(info, attribs, unrequestedPtr);
+	switch (policy) {
+	case FORMAT_POLICY_CHEAPEST:
+	    reasonPtr = Tcl_ObjPrintf("the fewest bits per pixel (%d) among"
+		    " the configs which meet the requested sizes", cost);
+	    break;
+	case FORMAT_POLICY_WEIGHTED:
+	    reasonPtr = Tcl_ObjPrintf("the highest score (%d), counting %d"
+		    " for each bit of an unrequested buffer",
+		    FBScore(info, attribs), -WASTE_WEIGHT);
+	    break;
+	default:
+	    reasonPtr = Tcl_NewStringObj("the most color bits, then depth"
+		    " bits, then samples among the configs which meet the"
+		    " requested sizes", -1);
+	    break;
+	}
+    }
+    PUT("policy", Tcl_NewStringObj(attribs ? policyNames[policy]
+	    : "pixelformat", -1));
+    PUT("pixelformat", Tcl_NewIntObj(info->visualId));
+    PUT("fbconfig", Tcl_NewIntObj(info->id));
+    PUT("bits", Tcl_NewIntObj(cost));
+    PUT("unrequested", unrequestedPtr);
+    PUT("reason", reasonPtr);
+#undef PUT
+    return dictPtr;
+}
+
 static Tcl_ThreadDataKey tkgl_XError;
 struct ErrorData
 {
@@ -160,15 +628,25 @@ tkgl_CheckForXError(const Tkgl *tkglPtr)
     return data->error_code;
 }
 
+/*
+ * Create a pbuffer of the given size.  For -pbuffer widgets the pbuffer is
+ * what the widget draws into; for -offscreen fbo widgets it is a 1x1
+ * drawable which is only used to make the context current.
+ */
+
 static GLXPbuffer
-tkgl_createPbuffer(Tkgl *tkglPtr)
+tkgl_createPbuffer(
+    Tkgl *tkglPtr,
+    int width,
+    int height)
 {
     int     attribs[32];
     int     na = 0;
+    Bool    largest = tkglPtr->pBufferFlag && tkglPtr->largestPbufferFlag;
     GLXPbuffer pbuf;
 
     tkgl_SetupXErrorHandler();
-    if (tkglPtr->largestPbufferFlag) {
+    if (largest) {
         attribs[na++] = GLX_LARGEST_PBUFFER;
         attribs[na++] = True;
     }
@@ -176,22 +654,22 @@ tkgl_createPbuffer(Tkgl *tkglPtr)
     attribs[na++] = True;
     if (createPbuffer) {
         attribs[na++] = GLX_PBUFFER_WIDTH;
-        attribs[na++] = tkglPtr->width;
+        attribs[na++] = width;
         attribs[na++] = GLX_PBUFFER_HEIGHT;
-        attribs[na++] = tkglPtr->width;
+        attribs[na++] = height;
         attribs[na++] = None;
         pbuf = createPbuffer(tkglPtr->display, tkglPtr->fbcfg, attribs);
     } else {
         attribs[na++] = None;
         pbuf = createPbufferSGIX(tkglPtr->display, tkglPtr->fbcfg,
-		   tkglPtr->width, tkglPtr->height, attribs);
+		   width, height, attribs);
     }
     if (tkgl_CheckForXError(tkglPtr) || pbuf == None) {
         Tcl_SetResult(tkglPtr->interp,
                       "unable to allocate pbuffer", TCL_STATIC);
         return None;
     }
-    if (pbuf && tkglPtr->largestPbufferFlag) {
+    if (pbuf && largest) {
         unsigned int     tmp;
 
         queryPbuffer(tkglPtr->display, pbuf, GLX_WIDTH, &tmp);
@@ -204,23 +682,36 @@ tkgl_createPbuffer(Tkgl *tkglPtr)
     return pbuf;
 }
 
+static void
+SetFormatInfo(
+    Tkgl *tkglPtr,
+    Tcl_Obj *infoPtr)
+{
+    Tcl_IncrRefCount(infoPtr);
+    if (tkglPtr->formatInfo) {
+	Tcl_DecrRefCount(tkglPtr->formatInfo);
+    }
+    tkglPtr->formatInfo = infoPtr;
+}
+
 static XVisualInfo *
 tkgl_pixelFormat(
     Tkgl *tkglPtr,
     int scrnum)
 {
-    int attribs[256];
+    int attribs[FB_KEY_SIZE];
     int na = 0;
-    int i;
-    XVisualInfo *visinfo;
-    int dummy, major, minor;
+    int best;
+    XVisualInfo *visinfo = NULL;
+    FBConfigTable *tablePtr;
     const char *extensions;
 
     /*
      * Make sure OpenGL's GLX extension is supported.
      */
 
-    if (!glXQueryExtension(tkglPtr->display, &dummy, &dummy)) {
+    tablePtr = GetFBConfigTable(tkglPtr->display, scrnum);
+    if (tablePtr == NULL) {
       Tcl_SetResult(tkglPtr->interp,
                     "X server is missing OpenGL GLX extension",
                     TCL_STATIC);
@@ -231,10 +722,9 @@ tkgl_pixelFormat(
     (void) XSetErrorHandler(fatal_error);
 #endif
 
-    glXQueryVersion(tkglPtr->display, &major, &minor);
-    extensions = glXQueryExtensionsString(tkglPtr->display, scrnum);
+    extensions = tablePtr->extensions;
 
-    if (major == 1 && minor < 4) {
+    if (tablePtr->major == 1 && tablePtr->minor < 4) {
 	Tcl_SetResult(tkglPtr->interp,
 	    "Tkgl 3.0 requires GLX 1.4 or newer.", TCL_STATIC);
 	return NULL;
@@ -268,10 +758,20 @@ tkgl_pixelFormat(
         return NULL;
     }
 
-    if (chooseFBConfig) {
-        int     count;
-        GLXFBConfig *cfgs;
-
+    if (tkglPtr->pixelFormat) {
+	/* The -pixelformat option names the visual of a config. */
+	best = FindConfigForVisual(tablePtr, (int) tkglPtr->pixelFormat);
+	if (best < 0) {
+	    Tcl_SetObjResult(tkglPtr->interp, Tcl_ObjPrintf(
+		"no pixel format has visual id %lu", tkglPtr->pixelFormat));
+	    return NULL;
+	}
+	tkglPtr->fbcfg = tablePtr->configs[best].fbcfg;
+	visinfo = getVisualFromFBConfig(tkglPtr->display, tkglPtr->fbcfg);
+	SetFormatInfo(tkglPtr, DescribeChoice(&tablePtr->configs[best], NULL,
+		tkglPtr->formatPolicy));
+    } else if (chooseFBConfig) {
+	memset(attribs, 0, sizeof(attribs));
         attribs[na++] = GLX_RENDER_TYPE;
         if (tkglPtr->rgbaFlag) {
             /* RGB[A] mode */
@@ -326,7 +826,8 @@ tkgl_pixelFormat(
             attribs[na++] = GLX_SAMPLES_ARB;
             attribs[na++] = 2;
         }
-        if (tkglPtr->pBufferFlag) {
+        if (tkglPtr->pBufferFlag
+		|| (tkglPtr->offscreen == OFFSCREEN_FBO && hasPbuffer)) {
             attribs[na++] = GLX_DRAWABLE_TYPE;
             attribs[na++] = GLX_WINDOW_BIT | GLX_PBUFFER_BIT;
         }
@@ -336,33 +837,20 @@ tkgl_pixelFormat(
         }
         attribs[na++] = None;
 
-        cfgs = chooseFBConfig(tkglPtr->display, scrnum, attribs, &count);
-        if (cfgs == NULL || count == 0) {
-            Tcl_SetResult(tkglPtr->interp, "Couldn't choose pixel format.",
-			  TCL_STATIC);
-            return NULL;
-        }
-
         /*
          * Pick the best available pixel format.
          */
 
-	FBInfo bestFB, nextFB;
-	getFBInfo(tkglPtr->display, cfgs[0], &bestFB);
-	for (i=1; i < count; i++) {
-	    getFBInfo(tkglPtr->display, cfgs[i], &nextFB);
-	    if (isBetterFB(&nextFB, &bestFB)) {
-		bestFB = nextFB;
-	    }
-	}
-#if 0
-	printf(" acc: %d ", bestFB.acceleration);
-	printf(" colors: %d ", bestFB.colors);
-	printf(" depth: %d ", bestFB.depth);
-	printf(" samples: %d\n", bestFB.samples);
-#endif
-	tkglPtr->fbcfg = bestFB.fbcfg;
-	visinfo = getVisualFromFBConfig(tkglPtr->display, bestFB.fbcfg);
+	best = ChooseConfig(tablePtr, attribs, tkglPtr->formatPolicy);
+        if (best < 0) {
+            Tcl_SetResult(tkglPtr->interp, "Couldn't choose pixel format.",
+			  TCL_STATIC);
+            return NULL;
+        }
+	tkglPtr->fbcfg = tablePtr->configs[best].fbcfg;
+	visinfo = getVisualFromFBConfig(tkglPtr->display, tkglPtr->fbcfg);
+	SetFormatInfo(tkglPtr, DescribeChoice(&tablePtr->configs[best],
+		attribs, tkglPtr->formatPolicy));
     }
     if (visinfo == NULL) {
         Tcl_SetResult(tkglPtr->interp,
@@ -404,50 +892,132 @@ tkgl_describePixelFormat(Tkgl *tkglPtr)
 }
 
 /*
- * Tkgl_CreateGLContext
+ * The binding which Tkgl_MakeCurrent last made in this thread.  Making the
+ * same display, drawable and context current again is skipped, since it
+ * would cost a flush and nothing else.  libGL is asked for the current
+ * context and drawable as well, in case other code has changed them since.
+ * The widget is remembered for -pool, see below.
+ */
+
+typedef struct {
+    Display *display;
+    GLXDrawable drawable;
+    GLXContext context;
+    Tkgl *widget;
+} CurrentBinding;
+
+static Tcl_ThreadDataKey currentKey;
+
+/*
+ * Pooled widgets render with one context, so the state which belongs to a
+ * widget rather than to the context is saved when a pooled widget stops
+ * being current and restored when it becomes current again: the bound
+ * framebuffer, the draw and read buffers and the viewport.  A widget which
+ * has not been current yet gets the state which a context of its own would
+ * start with.  The framebuffer functions of the context are looked up the
+ * first time, rather than on every switch.
+ */
+
+static const TkglFramebufferProcs *
+PoolFramebufferProcs(
+    const Tkgl *tkglPtr)
+{
+    /* The cache is bookkeeping, which the const does not cover. */
+    Tkgl *statePtr = (Tkgl *) tkglPtr;
+
+    if (!tkglPtr->poolProcsKnown) {
+	statePtr->poolProcs = TkglGetFramebufferProcs();
+	statePtr->poolProcsKnown = True;
+    }
+    return tkglPtr->poolProcs;
+}
+
+static void
+SavePoolState(
+    Tkgl *tkglPtr)
+{
+    GLint framebuffer = 0;
+
+    if (PoolFramebufferProcs(tkglPtr)) {
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+    }
+    tkglPtr->poolFramebuffer = framebuffer;
+    glGetIntegerv(GL_DRAW_BUFFER, &tkglPtr->poolDrawBuffer);
+    glGetIntegerv(GL_READ_BUFFER, &tkglPtr->poolReadBuffer);
+    glGetIntegerv(GL_VIEWPORT, tkglPtr->poolViewport);
+    tkglPtr->poolStateSaved = True;
+}
+
+static void
+RestorePoolState(
+    const Tkgl *tkglPtr)
+{
+    const TkglFramebufferProcs *procs = PoolFramebufferProcs(tkglPtr);
+    GLenum buffer = tkglPtr->doubleFlag ? GL_BACK : GL_FRONT;
+
+    if (!tkglPtr->poolStateSaved) {
+	if (procs) {
+	    procs->bindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+	glDrawBuffer(buffer);
+	glReadBuffer(buffer);
+	glViewport(0, 0, tkglPtr->width, tkglPtr->height);
+	return;
+    }
+    if (procs) {
+	procs->bindFramebuffer(GL_FRAMEBUFFER, tkglPtr->poolFramebuffer);
+    }
+    glDrawBuffer(tkglPtr->poolDrawBuffer);
+    glReadBuffer(tkglPtr->poolReadBuffer);
+    glViewport(tkglPtr->poolViewport[0], tkglPtr->poolViewport[1],
+	    tkglPtr->poolViewport[2], tkglPtr->poolViewport[3]);
+}
+
+/*
+ * Called before code other than Tkgl_MakeCurrent changes the current
+ * context of the thread, or a widget goes away.  The state of a pooled
+ * widget is saved while its context is still current.
+ */
+
+static void
+ForgetBinding(void)
+{
+    CurrentBinding *bindPtr = (CurrentBinding *)
+	    Tcl_GetThreadData(&currentKey, sizeof(CurrentBinding));
+
+    if (bindPtr->widget && bindPtr->widget->poolFlag
+	    && glXGetCurrentContext() == bindPtr->context) {
+	SavePoolState(bindPtr->widget);
+    }
+    memset(bindPtr, 0, sizeof(CurrentBinding));
+}
+
+/*
+ * CreateSurface
  *
- * Creates an OpenGL rendering context for the Tkgl widget.  This is called
- * when the widget is created, before it is mapped. Creating a rendering
- * context also requires creating the rendering surface.  For GLX The surface
- * is an an X "window" (i.e. an X widget) managed by the Tkgl widget.  The
- * visual id of the visualInfo, which plays the role of a pixel format, is
- * saved in the pixelFormat field of the widget record.
+ * Creates the rendering surface for the context of a Tkgl widget.  For GLX
+ * the surface is an X window, a child of the parent of the Tk window,
+ * which Tkgl_MakeWindow hands to Tk as the window of the widget.  It has
+ * the visual of the context, whose id plays the role of a pixel format and
+ * is saved in the pixelFormat field of the widget record.  For -pbuffer and
+ * -offscreen fbo widgets the surface is a pbuffer, and the parent is not
+ * needed.
  *
- * This function is called as an idle task, or as a timer handler.
+ * Returns a standard Tcl result, with an error message in the interp of the
+ * widget on failure.
  */
 
-static void CreateRenderingSurface(
-     void *clientData)
+static int
+CreateSurface(
+    Tkgl *tkglPtr,
+    Window parent)
 {
-    Tkgl *tkglPtr = (Tkgl *) clientData;
     Tk_Window tkwin = tkglPtr->tkwin;
     Display *dpy;
     Colormap cmap;
     int     scrnum;
-    Window parent = Tk_WindowId(Tk_Parent(tkwin)); 
     Window  window = None;
     XSetWindowAttributes swa;
- 
-    /*
-     * We can't create the rendering surface until the parent window exists.
-     */
-
-    if (parent == None) {
-	/* Reschedule this idle task to run again later. */
-	if (tkglPtr->timerToken) {
-	    Tcl_DeleteTimerHandler(tkglPtr->timerToken);
-	    tkglPtr->timerToken = None;
-	}
-	tkglPtr->timerToken = Tcl_CreateTimerHandler(20,
-		    CreateRenderingSurface, clientData);
-	tkglPtr->badWindow++;
-	return;
-    }
-    if (tkglPtr->badWindow > 5) {
-	/* Still no parent after 5 attempts.  Give up. */
-        tkglPtr->surface = Tk_MakeWindow(tkwin, parent);
-	return;
-    }
 
     /* for color index mode photos */
     if (tkglPtr->redMap) {
@@ -492,47 +1062,6 @@ static void CreateRenderingSurface(
         if (tkglPtr->visInfo == NULL)
             goto error;
     }
-    if (tkglPtr->shareList) {
-        /* We are sharing resourcess of an existing tkgl widget */
-        Tkgl   *shareWith = FindTkgl(tkglPtr, tkglPtr->shareList);
-        GLXContext shareCtx;
-        int     error_code;
-
-        if (shareWith) {
-            shareCtx = shareWith->context;
-            tkglPtr->contextTag = shareWith->contextTag;
-        } else {
-            shareCtx = None;
-        }
-        if (shareCtx) {
-            tkgl_SetupXErrorHandler();
-        }
-        if (shareCtx && (error_code = tkgl_CheckForXError(tkglPtr))) {
-            char    buf[256];
-
-            tkglPtr->context = NULL;
-            XGetErrorText(dpy, error_code, buf, sizeof buf);
-            Tcl_AppendResult(tkglPtr->interp,
-                    "unable to share display lists: ", buf, NULL);
-            goto error;
-        }
-    } else {
-        if (tkglPtr->shareContext && FindTkgl(tkglPtr, tkglPtr->shareContext)) {
-            /* We are using the OpenGL context of an existing Tkgl widget */
-            Tkgl   *shareWith = FindTkgl(tkglPtr, tkglPtr->shareContext);
-
-            if (tkglPtr->visInfo->visualid != shareWith->visInfo->visualid) {
-                Tcl_SetResult(tkglPtr->interp,
-                        "Unable to share the requested OpenGL context.",
-                        TCL_STATIC);
-                goto error;
-            }
-            tkglPtr->context = shareWith->context;
-        } else {
-            /* We can't share the context so clear the flag. */
-            tkglPtr->shareContext = False;
-	}
-    }
     if (tkglPtr->context == NULL) {
         Tcl_SetResult(tkglPtr->interp,
                 "could not create rendering context", TCL_STATIC);
@@ -540,13 +1069,46 @@ static void CreateRenderingSurface(
     }
     if (tkglPtr->pBufferFlag) {
         /* Don't need a colormap, nor overlay, nor be displayed */
-        tkglPtr->pbuf = tkgl_createPbuffer(tkglPtr);
+        tkglPtr->pbuf = tkgl_createPbuffer(tkglPtr, tkglPtr->width,
+		tkglPtr->height);
         if (!tkglPtr->pbuf) {
             /* A Tcl result will have been set in tkgl_createPbuffer */
             goto error;
         }
         tkglPtr->surface = window;
-	return;
+	return TCL_OK;
+    }
+    if (tkglPtr->offscreen == OFFSCREEN_FBO) {
+	/*
+	 * Draw into a framebuffer object.  The context is made current on a
+	 * 1x1 pbuffer, or on no drawable at all if there are no pbuffers,
+	 * which OpenGL 3.0 and later contexts allow.
+	 */
+
+	if (hasPbuffer) {
+	    tkglPtr->pbuf = tkgl_createPbuffer(tkglPtr, 1, 1);
+	    if (!tkglPtr->pbuf) {
+		goto error;
+	    }
+	}
+	tkglPtr->framebuffer = (TkglFramebuffer *)
+		ckalloc(sizeof(TkglFramebuffer));
+	memset(tkglPtr->framebuffer, 0, sizeof(TkglFramebuffer));
+	ForgetBinding();
+	tkgl_SetupXErrorHandler();
+	if (!glXMakeCurrent(dpy, tkglPtr->pbuf, tkglPtr->context)
+		|| tkgl_CheckForXError(tkglPtr)) {
+	    Tcl_SetResult(tkglPtr->interp,
+		    "framebuffer objects are not supported", TCL_STATIC);
+	    goto error;
+	}
+	if (TkglFramebufferInit(tkglPtr->interp, tkglPtr->framebuffer,
+		tkglPtr) != TCL_OK) {
+	    goto error;
+	}
+	tkglPtr->surface = window;
+	Tkgl_PostRedisplay(tkglPtr);
+	return TCL_OK;
     }
 
     /*
@@ -602,6 +1164,14 @@ static void CreateRenderingSurface(
     
     (void) XSetWMColormapWindows(dpy, window, &window, 1);
 
+    /*
+     * Let the frame clock know when our buffer swaps complete.
+     */
+
+    if (tkglPtr->frameClock && tkglPtr->frameClock->hasSwapEvent) {
+	glXSelectEvent(dpy, window, GLX_BUFFER_SWAP_COMPLETE_INTEL_MASK);
+    }
+
     /*
      * See if we requested single buffering but had to accept a double
      * buffered visual.  If so, set the GL draw buffer to be the front buffer
@@ -613,6 +1183,7 @@ static void CreateRenderingSurface(
 
         if (glXGetConfig(dpy, tkglPtr->visInfo, GLX_DOUBLEBUFFER, &dbl_flag)) {
             if (dbl_flag) {
+                ForgetBinding();
                 glXMakeCurrent(dpy, window, tkglPtr->context);
                 glDrawBuffer(GL_FRONT);
                 glReadBuffer(GL_FRONT);
@@ -669,52 +1240,297 @@ static void CreateRenderingSurface(
 #endif
 
     tkglPtr->surface = window;
-    return;
+    return TCL_OK;
 
   error:
     tkglPtr->badWindow = True;
+    return TCL_ERROR;
 }
 
-int
-Tkgl_CreateGLContext(
-    Tkgl *tkglPtr)
+/*
+ * CreateRenderingSurface
+ *
+ * Called when Tcl is idle after the context has been created.  A window
+ * surface needs the parent window, which Tk may not have made yet.  Then
+ * Tkgl_MakeWindow creates the surface, since Tk makes the parent before
+ * the window of the widget.  It also does so when Tk makes the window
+ * before Tcl is idle, for example for winfo id.
+ */
+
+static void
+CreateRenderingSurface(
+    void *clientData)
 {
-    GLXContext context = NULL;
-    GLXContext shareCtx = NULL;
-    Bool direct = true;  /* If this is false, GLX reports GLXBadFBConfig. */
+    Tkgl *tkglPtr = (Tkgl *) clientData;
+    Tk_Window tkwin = tkglPtr->tkwin;
+    Window parent = Tk_WindowId(Tk_Parent(tkwin));
 
-    if (tkglPtr->fbcfg == NULL) {
-	int scrnum = Tk_ScreenNumber(tkglPtr->tkwin);
-	tkglPtr->visInfo = tkgl_pixelFormat(tkglPtr, scrnum);
+    if (!TkglIsOffscreen(tkglPtr)
+	    && (parent == None || Tk_WindowId(tkwin) != None)) {
+	return;
     }
-    switch(tkglPtr->profile) {
-    case PROFILE_LEGACY:
-	context = glXCreateContextAttribsARB(tkglPtr->display, tkglPtr->fbcfg,
-	    shareCtx, direct, attributes_2_1);
-	break;
-    case PROFILE_3_2:
-	context = glXCreateContextAttribsARB(tkglPtr->display, tkglPtr->fbcfg,
-	    shareCtx, direct, attributes_3_2);
-	break;
-    case PROFILE_4_1:
-	context = glXCreateContextAttribsARB(tkglPtr->display, tkglPtr->fbcfg,
-	    shareCtx, direct, attributes_4_1);
-	break;
-    default:
-	context = glXCreateContext(tkglPtr->display, tkglPtr->visInfo,
-	    shareCtx, direct);
-	break;
+    if (CreateSurface(tkglPtr, parent) != TCL_OK) {
+	Tcl_BackgroundError(tkglPtr->interp);
     }
-    if (context == NULL) {
+}
+
+
+/*
+ * Return the attributes for glXCreateContextAttribsARB, copied into
+ * attribs with a request for contexts which are not flushed when they are
+ * released, if the driver supports GLX_ARB_context_flush_control.  Then
+ * switching between the contexts of several widgets costs no implicit
+ * flushes.  Each frame is still submitted by the buffer swap, or by the
+ * glFlush of Tkgl_SwapBuffers for single buffered widgets.
+ */
+
+static const int *
+ContextAttributes(
+    Tkgl *tkglPtr,
+    const int *base,
+    int *attribs)
+{
+    FBConfigTable *tablePtr = GetFBConfigTable(tkglPtr->display,
+	    Tk_ScreenNumber(tkglPtr->tkwin));
+    int na = 0;
+
+    if (tablePtr == NULL || strstr(tablePtr->extensions,
+	    "GLX_ARB_context_flush_control") == NULL) {
+	return base;
+    }
+    while (base[na] != None) {
+	attribs[na] = base[na];
+	na++;
+    }
+    attribs[na++] = GLX_CONTEXT_RELEASE_BEHAVIOR_ARB;
+    attribs[na++] = GLX_CONTEXT_RELEASE_BEHAVIOR_NONE_ARB;
+    attribs[na] = None;
+    return attribs;
+}
+
+/*
+ * The context of a -lazy widget is created when Tk is about to make its
+ * window, or when the widget is first used, so its surface is needed right
+ * away rather than when Tcl is idle.
+ */
+
+static void
+ScheduleRenderingSurface(
+    Tkgl *tkglPtr)
+{
+    if (tkglPtr->lazyFlag) {
+	CreateRenderingSurface(tkglPtr);
+    } else {
+	Tcl_DoWhenIdle(CreateRenderingSurface, (void *)tkglPtr);
+    }
+}
+
+/*
+ * Widgets with -pool true which have the same FBConfig and profile render
+ * with one context, as if each had -sharecontext naming the first of them.
+ * The pool table of a thread maps the config and profile to a widget which
+ * uses the context.  When that widget goes away another user takes its
+ * place, so the entry lives as long as the context.
+ */
+
+typedef struct {
+    GLXFBConfig fbcfg;
+    int profile;
+} PoolKey;
+
+typedef struct {
+    int initialized;
+    Tcl_HashTable table;	/* PoolKey -> Tkgl * */
+} PoolData;
+
+static Tcl_ThreadDataKey poolKey;
+
+static void
+FreePoolTable(
+    void *clientData)
+{
+    PoolData *dataPtr = (PoolData *) clientData;
+
+    Tcl_DeleteHashTable(&dataPtr->table);
+    dataPtr->initialized = 0;
+}
+
+static Tcl_HashEntry *
+PoolEntry(
+    const Tkgl *tkglPtr,
+    int create)
+{
+    PoolData *dataPtr = (PoolData *)
+	    Tcl_GetThreadData(&poolKey, sizeof(PoolData));
+    PoolKey key;
+    int isNew;
+
+    if (!dataPtr->initialized) {
+	Tcl_InitHashTable(&dataPtr->table, sizeof(PoolKey) / sizeof(int));
+	Tcl_CreateThreadExitHandler(FreePoolTable, dataPtr);
+	dataPtr->initialized = 1;
+    }
+    memset(&key, 0, sizeof(key));
+    key.fbcfg = tkglPtr->fbcfg;
+    key.profile = tkglPtr->profile;
+    if (create) {
+	return Tcl_CreateHashEntry(&dataPtr->table, (const char *) &key,
+		&isNew);
+    }
+    return Tcl_FindHashEntry(&dataPtr->table, (const char *) &key);
+}
+
+/*
+ * Called when a pooled widget releases its context.  The entry is handed to
+ * another user of the context, or removed with the context.
+ */
+
+static void
+PoolRelease(
+    Tkgl *tkglPtr,
+    Tkgl *sharingPtr)
+{
+    Tcl_HashEntry *entryPtr = PoolEntry(tkglPtr, 0);
+
+    if (entryPtr == NULL || Tcl_GetHashValue(entryPtr) != tkglPtr) {
+	return;
+    }
+    if (sharingPtr) {
+	Tcl_SetHashValue(entryPtr, sharingPtr);
+    } else {
+	Tcl_DeleteHashEntry(entryPtr);
+    }
+}
+
+int
+Tkgl_CreateGLContext(
+    Tkgl *tkglPtr)
+{
+    GLXContext context = NULL;
+    GLXContext shareCtx = NULL;
+    Tkgl *shareWith;
+    Tcl_HashEntry *entryPtr;
+    Bool direct = true;  /* If this is false, GLX reports GLXBadFBConfig. */
+    int errorBase, eventBase, errorCode;
+    int attribs[16];
+
+    if (tkglPtr->frameClock == NULL) {
+	tkglPtr->frameClock = AcquireFrameClock(tkglPtr->display);
+    }
+    if (TkglGroupPartner(tkglPtr, &shareWith) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (shareWith && shareWith->contextPending
+	    && TkglCreateLazyContext(shareWith) != TCL_OK) {
+	/* A -lazy partner needs its context now. */
+	return TCL_ERROR;
+    }
+    if (tkglPtr->softwareFlag
+	    || !glXQueryExtension(tkglPtr->display, &errorBase, &eventBase)) {
+#ifdef TKGL_USE_EGL
+	return TkglSoftwareCreate(tkglPtr, shareWith);
+#else
+	Tcl_SetResult(tkglPtr->interp, tkglPtr->softwareFlag
+		? "software rendering needs a build with --enable-egl"
+		: "the X server does not support GLX", TCL_STATIC);
+	return TCL_ERROR;
+#endif
+    }
+    if (shareWith && shareWith->context == NULL) {
+	Tcl_SetResult(tkglPtr->interp, "can't share objects between GLX "
+		"and software rendered widgets", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (tkglPtr->fbcfg == NULL) {
+	int scrnum = Tk_ScreenNumber(tkglPtr->tkwin);
+	tkglPtr->visInfo = tkgl_pixelFormat(tkglPtr, scrnum);
+	if (tkglPtr->visInfo == NULL) {
+	    return TCL_ERROR;
+	}
+    }
+    if (shareWith == NULL && tkglPtr->poolFlag) {
+	entryPtr = PoolEntry(tkglPtr, 0);
+	if (entryPtr) {
+	    Tkgl *ownerPtr = (Tkgl *) Tcl_GetHashValue(entryPtr);
+
+	    tkglPtr->context = ownerPtr->context;
+	    TkglGroupJoin(tkglPtr, ownerPtr);
+	    ScheduleRenderingSurface(tkglPtr);
+	    return TCL_OK;
+	}
+    }
+    if (shareWith && tkglPtr->shareContext) {
+	/* We are using the OpenGL context of an existing Tkgl widget. */
+	if (tkglPtr->fbcfg != shareWith->fbcfg) {
+	    Tcl_SetResult(tkglPtr->interp,
+		    "Unable to share the requested OpenGL context.",
+		    TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	tkglPtr->context = shareWith->context;
+	TkglGroupJoin(tkglPtr, shareWith);
+	ScheduleRenderingSurface(tkglPtr);
+	return TCL_OK;
+    }
+    if (shareWith) {
+	/* The new context shares the objects of the existing one. */
+	shareCtx = shareWith->context;
+	tkgl_SetupXErrorHandler();
+    }
+    switch(tkglPtr->profile) {
+    case PROFILE_LEGACY:
+	context = glXCreateContextAttribsARB(tkglPtr->display, tkglPtr->fbcfg,
+	    shareCtx, direct,
+	    ContextAttributes(tkglPtr, attributes_2_1, attribs));
+	break;
+    case PROFILE_3_2:
+	context = glXCreateContextAttribsARB(tkglPtr->display, tkglPtr->fbcfg,
+	    shareCtx, direct,
+	    ContextAttributes(tkglPtr, attributes_3_2, attribs));
+	break;
+    case PROFILE_4_1:
+	context = glXCreateContextAttribsARB(tkglPtr->display, tkglPtr->fbcfg,
+	    shareCtx, direct,
+	    ContextAttributes(tkglPtr, attributes_4_1, attribs));
+	break;
+    default:
+	context = glXCreateContext(tkglPtr->display, tkglPtr->visInfo,
+	    shareCtx, direct);
+	break;
+    }
+    if (shareWith && (errorCode = tkgl_CheckForXError(tkglPtr))) {
+	char buf[256];
+
+	if (context) {
+	    glXDestroyContext(tkglPtr->display, context);
+	}
+	XGetErrorText(tkglPtr->display, errorCode, buf, sizeof buf);
+	Tcl_ResetResult(tkglPtr->interp);
+	Tcl_AppendResult(tkglPtr->interp, "unable to share objects with \"",
+		Tk_PathName(shareWith->tkwin), "\": ", buf, NULL);
+	return TCL_ERROR;
+    }
+    if (context == NULL) {
+#ifdef TKGL_USE_EGL
+	/* GLX is too limited, e.g. indirect rendering on a remote server. */
+	if (tkglPtr->profile != PROFILE_SYSTEM && shareWith == NULL) {
+	    Tcl_ResetResult(tkglPtr->interp);
+	    return TkglSoftwareCreate(tkglPtr, NULL);
+	}
+#endif
 	Tcl_SetResult(tkglPtr->interp,
             "Failed to create GL rendering context", TCL_STATIC);
 	return TCL_ERROR;
     }
     tkglPtr->context = context;
-    Tcl_DoWhenIdle(CreateRenderingSurface, (void *)tkglPtr);
+    TkglGroupJoin(tkglPtr, shareWith);
+    if (tkglPtr->poolFlag && shareWith == NULL) {
+	Tcl_SetHashValue(PoolEntry(tkglPtr, 1), tkglPtr);
+    }
+    ScheduleRenderingSurface(tkglPtr);
     return TCL_OK;
 }
-
+
 
 /*
  * Tkgl_MakeWindow
@@ -725,7 +1541,9 @@ Tkgl_CreateGLContext(
  * to fail.  It must return a valid X window identifier.  If something
  * goes wrong, it sets the badWindow flag in the widget record,
  * which is passed as the instanceData.  The actual work of creating
- * the window has already been done in TkglCreateGLContext.
+ * the window has usually been done when Tcl was idle after
+ * Tkgl_CreateGLContext, unless the parent window did not exist then or
+ * Tk makes the window before Tcl is idle.
  */
 
 Window
@@ -735,7 +1553,17 @@ Tkgl_MakeWindow(
     void* instanceData)
 {
     Tkgl *tkglPtr = (Tkgl *) instanceData;
-    Window result = tkglPtr->surface;
+    Window result;
+
+    if (tkglPtr->context && tkglPtr->surface == None
+	    && !TkglIsOffscreen(tkglPtr)) {
+	Tcl_CancelIdleCall(CreateRenderingSurface, tkglPtr);
+	if (CreateSurface(tkglPtr, parent) != TCL_OK) {
+	    /* Tk needs a window anyway, so the error is reported this way. */
+	    Tcl_BackgroundError(tkglPtr->interp);
+	}
+    }
+    result = tkglPtr->surface;
     if (result == None) {
 	result = Tk_MakeWindow(tkwin, parent);
     }
@@ -755,6 +1583,17 @@ void
 Tkgl_MakeCurrent(
     const Tkgl *tkglPtr)
 {
+    CurrentBinding *bindPtr;
+    TkglStats *statsPtr;
+
+#ifdef TKGL_USE_EGL
+    if (tkglPtr->software) {
+	ForgetBinding();
+	TkglSoftwareMakeCurrent(tkglPtr);
+	return;
+    }
+    TkglSoftwareRelease();
+#endif
     if (!tkglPtr->context) {
 	return;
     }
@@ -766,35 +1605,675 @@ Tkgl_MakeCurrent(
 
     if (!tkglPtr) {
 	drawable = None;	
-    } else if (tkglPtr->pBufferFlag) {
+    } else if (TkglIsOffscreen(tkglPtr)) {
 	drawable = tkglPtr->pbuf;
     } else if (tkglPtr->tkwin) {
 	drawable = Tk_WindowId(tkglPtr->tkwin);
     } else {
-	drawable = None;
+	/*
+	 * A widget which is being destroyed has lost its Tk window, but its
+	 * X window lives until Tk has run the DestroyNotify handlers, so its
+	 * objects can still be deleted in its context.
+	 */
+
+	drawable = tkglPtr->surface;
+    }
+    bindPtr = (CurrentBinding *)
+	    Tcl_GetThreadData(&currentKey, sizeof(CurrentBinding));
+    /* The counters are bookkeeping, which the const does not cover. */
+    statsPtr = (TkglStats *) &tkglPtr->stats;
+    if (bindPtr->context == tkglPtr->context && bindPtr->display == display
+	    && bindPtr->drawable == drawable
+	    && (bindPtr->widget == tkglPtr || !tkglPtr->poolFlag)
+	    && glXGetCurrentContext() == tkglPtr->context
+	    && glXGetCurrentDrawable() == drawable) {
+	statsPtr->elidedSwitches++;
+    } else {
+	ForgetBinding();
+	if (tkglPtr->tkwin == NULL && !TkglIsOffscreen(tkglPtr)) {
+	    /* The X window may have been destroyed by someone else. */
+	    int failed;
+
+	    tkgl_SetupXErrorHandler();
+	    failed = !glXMakeCurrent(display, drawable, tkglPtr->context);
+	    if (tkgl_CheckForXError(tkglPtr) || failed) {
+		(void) glXMakeCurrent(display, None, NULL);
+		return;
+	    }
+	} else {
+	    (void) glXMakeCurrent(display, drawable, tkglPtr->context);
+	}
+	bindPtr->display = display;
+	bindPtr->drawable = drawable;
+	bindPtr->context = tkglPtr->context;
+	bindPtr->widget = (Tkgl *) tkglPtr;
+	statsPtr->contextSwitches++;
+	if (tkglPtr->poolFlag) {
+	    RestorePoolState(tkglPtr);
+	}
+    }
+    if (tkglPtr->framebuffer) {
+	TkglOffscreenBind(tkglPtr);
     }
-    (void) glXMakeCurrent(display, drawable, tkglPtr->context);
 }
 
 
+/*
+ * GLX_OML_sync_control reports UST values in microseconds, which on Linux
+ * come from the same clock as TkglMonotonicTime.  Drivers are not required
+ * to use that clock though, so we only trust values within a second of it.
+ */
+
+static int
+IsPlausibleUST(
+    Tcl_WideInt ust,
+    Tcl_WideInt now)
+{
+    return ust > 0 && ust > now - 1000000 && ust < now + 1000000;
+}
+
+/*
+ * Query the refresh rate and the time of the latest vertical blank from
+ * the driver, using the window of a queued widget.
+ */
+
+static void
+UpdateRefreshTiming(
+    FrameClock *clockPtr,
+    Tcl_WideInt now)
+{
+    Tkgl *tkglPtr = clockPtr->queueHead;
+    Window drawable;
+    int64_t ust, msc, sbc;
+    int32_t numerator, denominator;
+
+    if (!clockPtr->hasSyncControl || tkglPtr == NULL
+	    || tkglPtr->tkwin == NULL || TkglIsOffscreen(tkglPtr)
+	    || tkglPtr->software) {
+	return;
+    }
+    drawable = Tk_WindowId(tkglPtr->tkwin);
+    if (drawable == None) {
+	return;
+    }
+    if (getMscRate(clockPtr->display, drawable, &numerator, &denominator)
+	    && numerator > 0 && denominator > 0) {
+	clockPtr->period = (Tcl_WideInt) 1000000 * denominator / numerator;
+    }
+    if (getSyncValues(clockPtr->display, drawable, &ust, &msc, &sbc)
+	    && IsPlausibleUST(ust, now)) {
+	clockPtr->lastVblank = ust;
+    }
+}
+
+/*
+ * The order in which a tick draws its widgets, see above.  Widgets which
+ * compare equal keep the order in which they were queued.
+ */
+
+typedef struct {
+    Tkgl *tkglPtr;
+    int rank;
+    int sequence;
+} FrameEntry;
+
+static int
+CompareFrameEntries(
+    const void *a,
+    const void *b)
+{
+    const FrameEntry *x = (const FrameEntry *) a;
+    const FrameEntry *y = (const FrameEntry *) b;
+    uintptr_t cx = (uintptr_t) x->tkglPtr->context;
+    uintptr_t cy = (uintptr_t) y->tkglPtr->context;
+
+    if (x->rank != y->rank) {
+	return y->rank - x->rank;
+    }
+    if (x->tkglPtr->priority != y->tkglPtr->priority) {
+	return y->tkglPtr->priority > x->tkglPtr->priority ? 1 : -1;
+    }
+    if (cx != cy) {
+	return cx < cy ? -1 : 1;
+    }
+    return x->sequence - y->sequence;
+}
+
+static int
+FrameRank(
+    const Tkgl *tkglPtr)
+{
+    int rank = 0;
+
+    if (tkglPtr->frameDeferred) {
+	rank += 4;
+    }
+    if (tkglPtr->hasFocus) {
+	rank += 2;
+    }
+    if (!TkglIsOffscreen(tkglPtr) && tkglPtr->tkwin
+	    && Tk_IsMapped(tkglPtr->tkwin)) {
+	rank += 1;
+    }
+    return rank;
+}
+
+/*
+ * Sort the widgets which the tick is about to draw.
+ */
+
+static void
+SortFrameQueue(
+    FrameClock *clockPtr)
+{
+    FrameEntry staticEntries[32], *entries = staticEntries;
+    Tkgl *tkglPtr, **linkPtr;
+    int i, count = 0;
+
+    for (tkglPtr = clockPtr->runHead; tkglPtr; tkglPtr = tkglPtr->nextFrame) {
+	count++;
+    }
+    if (count < 2) {
+	return;
+    }
+    if (count > 32) {
+	entries = (FrameEntry *) ckalloc(count * sizeof(FrameEntry));
+    }
+    for (i = 0, tkglPtr = clockPtr->runHead; tkglPtr;
+	     i++, tkglPtr = tkglPtr->nextFrame) {
+	entries[i].tkglPtr = tkglPtr;
+	entries[i].rank = FrameRank(tkglPtr);
+	entries[i].sequence = i;
+    }
+    qsort(entries, count, sizeof(FrameEntry), CompareFrameEntries);
+    linkPtr = &clockPtr->runHead;
+    for (i = 0; i < count; i++) {
+	*linkPtr = entries[i].tkglPtr;
+	linkPtr = &entries[i].tkglPtr->nextFrame;
+    }
+    *linkPtr = NULL;
+    if (entries != staticEntries) {
+	ckfree(entries);
+    }
+}
+
+/*
+ * Put the widgets which a tick did not get to at the front of the queue,
+ * ahead of the widgets which were queued while it was drawing.
+ */
+
+static void
+DeferFrames(
+    FrameClock *clockPtr)
+{
+    Tkgl *tkglPtr, *lastPtr = NULL;
+
+    for (tkglPtr = clockPtr->runHead; tkglPtr; tkglPtr = tkglPtr->nextFrame) {
+	tkglPtr->frameDeferred = True;
+	tkglPtr->stats.deferredFrames++;
+	lastPtr = tkglPtr;
+    }
+    if (lastPtr == NULL) {
+	return;
+    }
+    lastPtr->nextFrame = clockPtr->queueHead;
+    if (clockPtr->queueHead == NULL) {
+	clockPtr->queueTail = lastPtr;
+    }
+    clockPtr->queueHead = clockPtr->runHead;
+    clockPtr->runHead = NULL;
+}
+
+static void
+FrameClockTick(
+    FrameClock *clockPtr)
+{
+    FrameClockData *dataPtr = (FrameClockData *)
+	Tcl_GetThreadData(&frameClockKey, sizeof(FrameClockData));
+    Tkgl *tkglPtr;
+    Tcl_WideInt now = TkglMonotonicTime();
+    Tcl_WideInt budget;
+    int drawn = 0;
+
+    clockPtr->armed = 0;
+    if (clockPtr->swapsInFlight > 0
+	    && now - clockPtr->swapTime < 2 * clockPtr->period) {
+	/* Woken early; the previous frame is not on the screen yet. */
+	ArmFrameClock(clockPtr);
+	return;
+    }
+    clockPtr->swapsInFlight = 0;
+    clockPtr->lastTick = now;
+
+    /*
+     * Draw the widgets which are queued now.  Widgets which are queued
+     * while this is happening will be drawn on the next tick.
+     */
+
+    clockPtr->runHead = clockPtr->queueHead;
+    clockPtr->queueHead = clockPtr->queueTail = NULL;
+    SortFrameQueue(clockPtr);
+
+    /*
+     * A callback may destroy the last widget using the clock, so the tick
+     * holds a reference of its own until it is done.
+     */
+
+    clockPtr->refCount++;
+    budget = dataPtr->budget ? dataPtr->budget : clockPtr->period;
+    while ((tkglPtr = clockPtr->runHead) != NULL) {
+	/* Widgets deferred by the previous tick are not deferred again. */
+	if (budget > 0 && drawn > 0 && !tkglPtr->frameDeferred
+		&& TkglMonotonicTime() - now >= budget) {
+	    DeferFrames(clockPtr);
+	    break;
+	}
+	drawn++;
+	clockPtr->runHead = tkglPtr->nextFrame;
+	tkglPtr->nextFrame = NULL;
+	tkglPtr->frameDeferred = False;
+	TkglDisplay(tkglPtr);
+    }
+    if (clockPtr->refCount > 1 && clockPtr->queueHead) {
+	ArmFrameClock(clockPtr);
+    }
+    ReleaseFrameClock(clockPtr);
+}
+
+#ifdef HAVE_TIMERFD
+static void
+FrameClockFileProc(
+    void *clientData,
+    int mask)
+{
+    FrameClock *clockPtr = (FrameClock *) clientData;
+    uint64_t expirations;
+
+    if (read(clockPtr->timerFd, &expirations, sizeof(expirations)) < 0) {
+	return;  /* EAGAIN: the deadline was moved after it expired. */
+    }
+    FrameClockTick(clockPtr);
+}
+#endif
+
+static void
+FrameClockTimerProc(
+    void *clientData)
+{
+    FrameClock *clockPtr = (FrameClock *) clientData;
+
+    clockPtr->timerToken = NULL;
+    FrameClockTick(clockPtr);
+}
+
+/*
+ * Schedule a tick at the given time, unless one is already scheduled
+ * earlier.
+ */
+
+static void
+ArmFrameClockAt(
+    FrameClock *clockPtr,
+    Tcl_WideInt when,
+    Tcl_WideInt now)
+{
+    if (clockPtr->armed && clockPtr->deadline <= when) {
+	return;
+    }
+    clockPtr->armed = 1;
+    clockPtr->deadline = when;
+#ifdef HAVE_TIMERFD
+    if (clockPtr->timerFd >= 0) {
+	struct itimerspec spec;
+
+	/* An absolute deadline in the past expires immediately. */
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = when / 1000000;
+	spec.it_value.tv_nsec = (when % 1000000) * 1000;
+	if (timerfd_settime(clockPtr->timerFd, TFD_TIMER_ABSTIME,
+		&spec, NULL) == 0) {
+	    return;
+	}
+    }
+#endif
+    if (clockPtr->timerToken) {
+	Tcl_DeleteTimerHandler(clockPtr->timerToken);
+    }
+    clockPtr->timerToken = Tcl_CreateTimerHandler(
+	when > now ? (int) ((when - now + 999) / 1000) : 0,
+	FrameClockTimerProc, clockPtr);
+}
+
+/*
+ * Schedule the next tick: immediately if the clock has been idle for a
+ * full interval, otherwise at the next vertical blank.  If a swap is in
+ * flight the swap event will trigger the tick, and the timer is only a
+ * safeguard against lost events.
+ */
+
+static void
+ArmFrameClock(
+    FrameClock *clockPtr)
+{
+    Tcl_WideInt now = TkglMonotonicTime(), next, period;
+
+    if (clockPtr->swapsInFlight > 0
+	    && now - clockPtr->swapTime < 2 * clockPtr->period) {
+	ArmFrameClockAt(clockPtr, clockPtr->swapTime + 2 * clockPtr->period,
+	    now);
+	return;
+    }
+    UpdateRefreshTiming(clockPtr, now);
+    period = clockPtr->period;
+    if (now - clockPtr->lastTick >= period) {
+	next = now;
+    } else {
+	if (clockPtr->lastVblank > now) {
+	    clockPtr->lastVblank -= period;
+	}
+	next = clockPtr->lastVblank
+	    + ((now - clockPtr->lastVblank) / period + 1) * period;
+	while (next - clockPtr->lastTick < period / 2) {
+	    next += period;
+	}
+    }
+    ArmFrameClockAt(clockPtr, next, now);
+}
+
+/*
+ * Generic event handler which receives the GLX_BufferSwapComplete events
+ * requested when the rendering surface was created.
+ */
+
+static int
+FrameClockEventProc(
+    void *clientData,
+    XEvent *eventPtr)
+{
+    FrameClock *clockPtr = (FrameClock *) clientData;
+    GLXBufferSwapComplete *swapPtr = (GLXBufferSwapComplete *) eventPtr;
+    Tcl_WideInt now;
+
+    if (eventPtr->type != clockPtr->glxEventBase + GLX_BufferSwapComplete
+	    || eventPtr->xany.display != clockPtr->display) {
+	return 0;
+    }
+    now = TkglMonotonicTime();
+    if (IsPlausibleUST(swapPtr->ust, now)) {
+	clockPtr->lastVblank = swapPtr->ust;
+    }
+    if (clockPtr->swapsInFlight > 0 && --clockPtr->swapsInFlight == 0
+	    && clockPtr->queueHead) {
+	/* Our last frame is on the screen.  Start the next one now. */
+	ArmFrameClockAt(clockPtr, now, now);
+    }
+    return 1;
+}
+
+/*
+ * Return the frame clock for a display, creating it if necessary.  Each
+ * call must be balanced by a call to ReleaseFrameClock.
+ */
+
+static FrameClock *
+AcquireFrameClock(
+    Display *display)
+{
+    FrameClockData *dataPtr = (FrameClockData *)
+	Tcl_GetThreadData(&frameClockKey, sizeof(FrameClockData));
+    FrameClock *clockPtr;
+    const char *extensions;
+    int errorBase;
+
+    for (clockPtr = dataPtr->clockList; clockPtr; clockPtr = clockPtr->next) {
+	if (clockPtr->display == display) {
+	    clockPtr->refCount++;
+	    return clockPtr;
+	}
+    }
+    clockPtr = (FrameClock *) ckalloc(sizeof(FrameClock));
+    memset(clockPtr, 0, sizeof(FrameClock));
+    clockPtr->display = display;
+    clockPtr->refCount = 1;
+    clockPtr->period = DEFAULT_REFRESH_PERIOD;
+    clockPtr->timerFd = -1;
+    extensions = glXQueryExtensionsString(display, DefaultScreen(display));
+    if (extensions && strstr(extensions, "GLX_OML_sync_control")) {
+	if (getSyncValues == NULL) {
+	    getSyncValues = (PFNGLXGETSYNCVALUESOMLPROC) glXGetProcAddressARB(
+		(const GLubyte *) "glXGetSyncValuesOML");
+	    getMscRate = (PFNGLXGETMSCRATEOMLPROC) glXGetProcAddressARB(
+		(const GLubyte *) "glXGetMscRateOML");
+	}
+	clockPtr->hasSyncControl = (getSyncValues && getMscRate);
+    }
+    if (extensions && strstr(extensions, "GLX_EXT_buffer_age")) {
+	clockPtr->hasBufferAge = 1;
+    }
+    if (extensions && strstr(extensions, "GLX_MESA_copy_sub_buffer")) {
+	if (copySubBuffer == NULL) {
+	    copySubBuffer = (void (*)(Display *, GLXDrawable, int, int, int,
+		    int)) glXGetProcAddressARB(
+		(const GLubyte *) "glXCopySubBufferMESA");
+	}
+	clockPtr->hasCopySubBuffer = (copySubBuffer != NULL);
+    }
+    if (extensions && strstr(extensions, "GLX_INTEL_swap_event")
+	    && glXQueryExtension(display, &errorBase,
+		   &clockPtr->glxEventBase)) {
+	clockPtr->hasSwapEvent = 1;
+	Tk_CreateGenericHandler(FrameClockEventProc, clockPtr);
+    }
+#ifdef HAVE_TIMERFD
+    clockPtr->timerFd = timerfd_create(CLOCK_MONOTONIC,
+	TFD_NONBLOCK | TFD_CLOEXEC);
+    if (clockPtr->timerFd >= 0) {
+	Tcl_CreateFileHandler(clockPtr->timerFd, TCL_READABLE,
+	    FrameClockFileProc, clockPtr);
+    }
+#endif
+    clockPtr->next = dataPtr->clockList;
+    dataPtr->clockList = clockPtr;
+    return clockPtr;
+}
+
+static void
+ReleaseFrameClock(
+    FrameClock *clockPtr)
+{
+    FrameClockData *dataPtr = (FrameClockData *)
+	Tcl_GetThreadData(&frameClockKey, sizeof(FrameClockData));
+    FrameClock **linkPtr;
+
+    if (--clockPtr->refCount > 0) {
+	return;
+    }
+    for (linkPtr = &dataPtr->clockList; *linkPtr;
+	     linkPtr = &(*linkPtr)->next) {
+	if (*linkPtr == clockPtr) {
+	    *linkPtr = clockPtr->next;
+	    break;
+	}
+    }
+#ifdef HAVE_TIMERFD
+    if (clockPtr->timerFd >= 0) {
+	Tcl_DeleteFileHandler(clockPtr->timerFd);
+	close(clockPtr->timerFd);
+    }
+#endif
+    if (clockPtr->timerToken) {
+	Tcl_DeleteTimerHandler(clockPtr->timerToken);
+    }
+    if (clockPtr->hasSwapEvent) {
+	Tk_DeleteGenericHandler(FrameClockEventProc, clockPtr);
+    }
+    ckfree(clockPtr);
+}
+
+/*
+ * Tkgl_ScheduleRedisplay
+ *
+ * Queues the widget on the frame clock of its display.  A widget which does
+ * not have a rendering context yet has no clock, so an idle handler is used.
+ */
+
+void
+Tkgl_ScheduleRedisplay(
+    Tkgl *tkglPtr)
+{
+    FrameClock *clockPtr = tkglPtr->frameClock;
+
+    if (clockPtr == NULL) {
+	Tcl_DoWhenIdle(TkglDisplay, (void *) tkglPtr);
+	return;
+    }
+    tkglPtr->nextFrame = NULL;
+    if (clockPtr->queueTail) {
+	clockPtr->queueTail->nextFrame = tkglPtr;
+    } else {
+	clockPtr->queueHead = tkglPtr;
+    }
+    clockPtr->queueTail = tkglPtr;
+    ArmFrameClock(clockPtr);
+}
+
+/*
+ * Tkgl_CancelRedisplay
+ *
+ * Removes the widget from the queue of its frame clock, or from the list
+ * of widgets being drawn by the current tick.
+ */
+
+void
+Tkgl_CancelRedisplay(
+    Tkgl *tkglPtr)
+{
+    FrameClock *clockPtr = tkglPtr->frameClock;
+    Tkgl **linkPtr, *prev = NULL;
+
+    Tcl_CancelIdleCall(TkglDisplay, (void *) tkglPtr);
+    if (clockPtr == NULL) {
+	return;
+    }
+    for (linkPtr = &clockPtr->queueHead; *linkPtr;
+	     prev = *linkPtr, linkPtr = &(*linkPtr)->nextFrame) {
+	if (*linkPtr == tkglPtr) {
+	    *linkPtr = tkglPtr->nextFrame;
+	    if (clockPtr->queueTail == tkglPtr) {
+		clockPtr->queueTail = prev;
+	    }
+	    tkglPtr->nextFrame = NULL;
+	    return;
+	}
+    }
+    for (linkPtr = &clockPtr->runHead; *linkPtr;
+	     linkPtr = &(*linkPtr)->nextFrame) {
+	if (*linkPtr == tkglPtr) {
+	    *linkPtr = tkglPtr->nextFrame;
+	    tkglPtr->nextFrame = NULL;
+	    return;
+	}
+    }
+}
+
 /*
  * Tkgl_SwapBuffers
  *
  * Called by the GL Client after updating the image.  If the Tkgl
  * is double-buffered it interchanges the front and back framebuffers.
- * otherwise it calls GLFlush.
+ * otherwise it calls GLFlush.  When the redraw in progress only repairs
+ * some rectangles of the widget, and GLX_MESA_copy_sub_buffer is
+ * available, just those rectangles are copied to the front buffer.
  */
 
 void
 Tkgl_SwapBuffers(
     const Tkgl *tkglPtr){
-    if (tkglPtr->doubleFlag) {
+    /* The bookkeeping is not covered by the const. */
+    Tkgl *statePtr = (Tkgl *) tkglPtr;
+
+#ifdef TKGL_USE_EGL
+    if (tkglPtr->software) {
+	if (tkglPtr->tile == NULL && tkglPtr->offscreen == OFFSCREEN_NONE) {
+	    TkglSoftwarePresent(tkglPtr);
+	} else {
+	    glFlush();
+	}
+	return;
+    }
+#endif
+    if (tkglPtr->doubleFlag && tkglPtr->tile == NULL
+	    && tkglPtr->offscreen == OFFSCREEN_NONE) {
+	if (tkglPtr->poolFlag) {
+	    /*
+	     * The pooled context is flushed by the swap only if the window
+	     * is its current drawable.
+	     */
+
+	    Tkgl_MakeCurrent(tkglPtr);
+	}
+	if (tkglPtr->drawing && tkglPtr->frameDamage.count > 0
+		&& tkglPtr->frameClock && tkglPtr->frameClock->hasCopySubBuffer
+		&& tkglPtr->stereo != TKGL_STEREO_NATIVE) {
+	    const TkglDamage *damagePtr = &tkglPtr->frameDamage;
+	    int i;
+
+	    for (i = 0; i < damagePtr->count; i++) {
+		copySubBuffer(Tk_Display(tkglPtr->tkwin),
+		    Tk_WindowId(tkglPtr->tkwin), damagePtr->rects[i][0],
+		    damagePtr->rects[i][1], damagePtr->rects[i][2],
+		    damagePtr->rects[i][3]);
+	    }
+	    statePtr->partialPresent = True;
+	    statePtr->stats.partialPresents++;
+	    return;
+	}
+	statePtr->partialPresent = False;
         glXSwapBuffers(Tk_Display(tkglPtr->tkwin),
 		       Tk_WindowId(tkglPtr->tkwin));
+	if (tkglPtr->frameClock && tkglPtr->frameClock->hasSwapEvent) {
+	    tkglPtr->frameClock->swapsInFlight++;
+	    tkglPtr->frameClock->swapTime = TkglMonotonicTime();
+	}
     } else {
         glFlush();
     }
 }
+
+/*
+ * Tkgl_BufferAge
+ *
+ * Returns the age of the back buffer.  After a partial present only the
+ * damaged rectangles of the screen match the back buffer, so its age is
+ * unknown.  The framebuffers of offscreen and software widgets keep their
+ * contents.  The query needs the widget to be current, and is answered
+ * with 0 rather than changing the current context behind the caller.
+ */
+
+int
+Tkgl_BufferAge(
+    const Tkgl *tkglPtr)
+{
+    unsigned int age = 0;
+
+    if (tkglPtr->framebuffer) {
+	return 1;
+    }
+    if (!tkglPtr->doubleFlag || TkglIsOffscreen(tkglPtr)
+	    || tkglPtr->tkwin == NULL || tkglPtr->context == NULL
+	    || tkglPtr->frameClock == NULL) {
+	return 0;
+    }
+    if (tkglPtr->partialPresent || !tkglPtr->frameClock->hasBufferAge
+	    || Tk_WindowId(tkglPtr->tkwin) == None
+	    || glXGetCurrentContext() != tkglPtr->context
+	    || glXGetCurrentDrawable() != Tk_WindowId(tkglPtr->tkwin)) {
+	return 0;
+    }
+    glXQueryDrawable(tkglPtr->display, Tk_WindowId(tkglPtr->tkwin),
+	    GLX_BACK_BUFFER_AGE_EXT, &age);
+    return (int) age;
+}
 
 /*
  * TkglUpdate
@@ -823,19 +2302,79 @@ const char* Tkgl_GetExtensions(
     Tkgl *tkglPtr)
 {
     int scrnum = Tk_ScreenNumber(tkglPtr->tkwin);
+#ifdef TKGL_USE_EGL
+    if (tkglPtr->software) {
+	return "";
+    }
+#endif
     return glXQueryExtensionsString(tkglPtr->display, scrnum);
 }
+
+void *Tkgl_GetProcAddress(
+    const char *name)
+{
+    return (void *) glXGetProcAddressARB((const GLubyte *) name);
+}
 
 void Tkgl_FreeResources(
     Tkgl *tkglPtr)
 {
+    Tkgl *sharingPtr = FindTkglWithSameContext(tkglPtr);
+    const TkglBufferProcs *procs;
+
+    Tcl_CancelIdleCall(CreateRenderingSurface, tkglPtr);
+
+#ifdef TKGL_USE_EGL
+    if (tkglPtr->software) {
+	/* Its buffers go away with its context. */
+	tkglPtr->photoPbo = 0;
+	TkglSoftwareFree(tkglPtr);
+	if (tkglPtr->frameClock) {
+	    ReleaseFrameClock(tkglPtr->frameClock);
+	    tkglPtr->frameClock = NULL;
+	}
+	return;
+    }
+#endif
+    if (tkglPtr->photoPbo && sharingPtr) {
+	/*
+	 * The context outlives this widget, so its photo buffer has to be
+	 * deleted explicitly.  Otherwise it goes away with the context.
+	 */
+
+	Tkgl_MakeCurrent(sharingPtr);
+	procs = TkglGetBufferProcs();
+	if (procs) {
+	    procs->deleteBuffers(1, &tkglPtr->photoPbo);
+	}
+    }
+    tkglPtr->photoPbo = 0;
+    if (tkglPtr->framebuffer) {
+	if (sharingPtr) {
+	    Tkgl_MakeCurrent(sharingPtr);
+	} else {
+	    (void) glXMakeCurrent(tkglPtr->display, tkglPtr->pbuf,
+		tkglPtr->context);
+	}
+	TkglOffscreenFree(tkglPtr);
+    }
+    ForgetBinding();
     (void) glXMakeCurrent(tkglPtr->display, None, NULL);
+    if (tkglPtr->poolFlag) {
+	PoolRelease(tkglPtr, sharingPtr);
+    }
+    if (tkglPtr->frameClock) {
+	ReleaseFrameClock(tkglPtr->frameClock);
+	tkglPtr->frameClock = NULL;
+    }
     if (tkglPtr->context) {
 	if (FindTkglWithSameContext(tkglPtr) == NULL) {
 	    glXDestroyContext(tkglPtr->display, tkglPtr->context);
+	}
+	if (tkglPtr->visInfo) {
 	    XFree(tkglPtr->visInfo);
 	}
-	if (tkglPtr->pBufferFlag && tkglPtr->pbuf) {
+	if (tkglPtr->pbuf) {
 	    glXDestroyPbuffer(tkglPtr->display, tkglPtr->pbuf);
 	    tkglPtr->pbuf = 0;
 	}
@@ -858,6 +2397,158 @@ void Tkgl_FreeResources(
 #  endif
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglPixelFormatsObjCmd --
+ *
+ *	Implements the tkgl::pixelformats command:
+ *
+ *	    tkgl::pixelformats ?window?
+ *
+ *	Returns a list with a dict for each framebuffer configuration of the
+ *	screen of the window, "." by default, which can be used for windows.
+ *	The pixelformat key holds the visual id to pass as -pixelformat.  The
+ *	other keys are fbconfig, caveat (none, slow or nonconformant), rgba,
+ *	double, stereo, red, green, blue, alpha, depth, stencil, accum (a
+ *	list of the red, green, blue and alpha sizes), samples, aux and
+ *	pbuffer.  The list comes from the table which widget creation uses,
+ *	so it costs no server requests after the first widget.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglPixelFormatsObjCmd(
+    void *clientData,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[])
+{
+    Tk_Window tkwin = Tk_MainWindow(interp);
+    FBConfigTable *tablePtr;
+    const FBInfo *info;
+    Tcl_Obj *listObj, *dictObj, *accum[4];
+    const char *caveat;
+    int i;
+
+    (void) clientData;
+    if (objc > 2) {
+	Tcl_WrongNumArgs(interp, 1, objv, "?window?");
+	return TCL_ERROR;
+    }
+    if (tkwin && objc == 2) {
+	tkwin = Tk_NameToWindow(interp, Tcl_GetString(objv[1]), tkwin);
+    }
+    if (tkwin == NULL) {
+	return TCL_ERROR;
+    }
+    tablePtr = GetFBConfigTable(Tk_Display(tkwin), Tk_ScreenNumber(tkwin));
+    if (tablePtr == NULL) {
+	Tcl_SetResult(interp, "X server is missing OpenGL GLX extension",
+	    TCL_STATIC);
+	return TCL_ERROR;
+    }
+    listObj = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < tablePtr->count; i++) {
+	info = &tablePtr->configs[i];
+	if (info->visualId == 0 || !(info->drawableType & GLX_WINDOW_BIT)) {
+	    continue;
+	}
+	switch (info->acceleration) {
+	case GLX_SLOW_CONFIG:
+	    caveat = "slow";
+	    break;
+	case GLX_NON_CONFORMANT_CONFIG:
+	    caveat = "nonconformant";
+	    break;
+	default:
+	    caveat = "none";
+	    break;
+	}
+	accum[0] = Tcl_NewIntObj(info->accumRed);
+	accum[1] = Tcl_NewIntObj(info->accumGreen);
+	accum[2] = Tcl_NewIntObj(info->accumBlue);
+	accum[3] = Tcl_NewIntObj(info->accumAlpha);
+	dictObj = Tcl_NewDictObj();
+#define PUT(key, valueObj) \
+	Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj(key, TCL_INDEX_NONE), \
+	    valueObj)
+	PUT("pixelformat", Tcl_NewIntObj(info->visualId));
+	PUT("fbconfig", Tcl_NewIntObj(info->id));
+	PUT("caveat", Tcl_NewStringObj(caveat, TCL_INDEX_NONE));
+	PUT("rgba", Tcl_NewBooleanObj(info->renderType & GLX_RGBA_BIT));
+	PUT("double", Tcl_NewBooleanObj(info->doubleBuffer));
+	PUT("stereo", Tcl_NewBooleanObj(info->stereo));
+	PUT("red", Tcl_NewIntObj(info->red));
+	PUT("green", Tcl_NewIntObj(info->green));
+	PUT("blue", Tcl_NewIntObj(info->blue));
+	PUT("alpha", Tcl_NewIntObj(info->alpha));
+	PUT("depth", Tcl_NewIntObj(info->depth));
+	PUT("stencil", Tcl_NewIntObj(info->stencil));
+	PUT("accum", Tcl_NewListObj(4, accum));
+	PUT("samples", Tcl_NewIntObj(info->samples));
+	PUT("aux", Tcl_NewIntObj(info->aux));
+	PUT("pbuffer", Tcl_NewBooleanObj(info->drawableType
+	    & GLX_PBUFFER_BIT));
+#undef PUT
+	Tcl_ListObjAppendElement(NULL, listObj, dictObj);
+    }
+    Tcl_SetObjResult(interp, listObj);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TkglFrameBudgetObjCmd --
+ *
+ *	Implements the tkgl::framebudget command:
+ *
+ *	    tkgl::framebudget ?microseconds?
+ *
+ *	Sets the time which a tick of a frame clock may spend drawing
+ *	widgets in this thread, or returns it if no argument is given.  0,
+ *	the default, means one refresh interval of the display and a negative
+ *	value means no limit.  The widgets which do not fit are drawn first
+ *	on the next tick, and are counted as deferredframes by the stats
+ *	subcommand.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TkglFrameBudgetObjCmd(
+    void *clientData,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[])
+{
+    FrameClockData *dataPtr = (FrameClockData *)
+	Tcl_GetThreadData(&frameClockKey, sizeof(FrameClockData));
+    Tcl_WideInt budget;
+
+    (void) clientData;
+    if (objc > 2) {
+	Tcl_WrongNumArgs(interp, 1, objv, "?microseconds?");
+	return TCL_ERROR;
+    }
+    if (objc == 2) {
+	if (Tcl_GetWideIntFromObj(interp, objv[1], &budget) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	dataPtr->budget = budget < 0 ? -1 : budget;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(dataPtr->budget));
+    return TCL_OK;
+}
+
 /* 
  * Tkgl_MapWidget
  *
@@ -888,15 +2579,91 @@ Tkgl_WorldChanged(
 #endif
 }
 
+/*
+ * Tkgl_TakePhoto
+ *
+ *   Copy the contents of the widget into a photo image.  The caller has
+ *   made the widget current and selected its read buffer.  The pixels
+ *   are read as RGBA, which is the layout of a Tk photo, so that
+ *   Tk_PhotoPutBlock can copy whole rows, or as color indices which
+ *   TkglPutPhotoPixels expands.
+ *
+ *   When the context supports pixel pack buffers the pixels are read into
+ *   a buffer object which is kept in the widget record and reused by later
+ *   calls, and the photo is filled directly from the mapped buffer.
+ *   Otherwise they are read into a temporary buffer in client memory.
+ */
+
 int
 Tkgl_TakePhoto(
     Tkgl *tkglPtr,
     Tk_PhotoHandle photo)
 {
-#if 0
-    printf("TakePhoto\n");
-#endif
-    return TCL_OK;
+    int width = tkglPtr->width, height = tkglPtr->height;
+    size_t size = (size_t) width * height * 4;
+    GLint packAlignment, packRowLength, packSkipPixels, packSkipRows;
+    GLint packBuffer = 0;
+    const TkglBufferProcs *procs;
+    GLubyte *buffer = NULL, *pixels;
+    GLenum format = tkglPtr->rgbaFlag ? GL_RGBA : GL_COLOR_INDEX;
+    GLenum type = tkglPtr->rgbaFlag ? GL_UNSIGNED_BYTE : GL_UNSIGNED_INT;
+    Bool hasPbo, usePbo;
+    int result;
+
+    if (width <= 0 || height <= 0) {
+	return TCL_OK;
+    }
+    procs = TkglGetBufferProcs();
+    hasPbo = usePbo = procs != NULL;
+    glGetIntegerv(GL_PACK_ALIGNMENT, &packAlignment);
+    glGetIntegerv(GL_PACK_ROW_LENGTH, &packRowLength);
+    glGetIntegerv(GL_PACK_SKIP_PIXELS, &packSkipPixels);
+    glGetIntegerv(GL_PACK_SKIP_ROWS, &packSkipRows);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_PACK_SKIP_PIXELS, 0);
+    glPixelStorei(GL_PACK_SKIP_ROWS, 0);
+    if (hasPbo) {
+	glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &packBuffer);
+	if (tkglPtr->photoPbo == 0) {
+	    procs->genBuffers(1, &tkglPtr->photoPbo);
+	    tkglPtr->photoPboSize = 0;
+	}
+	procs->bindBuffer(GL_PIXEL_PACK_BUFFER, tkglPtr->photoPbo);
+	if (tkglPtr->photoPboSize != size) {
+	    procs->bufferData(GL_PIXEL_PACK_BUFFER, size, NULL,
+		GL_STREAM_READ);
+	    tkglPtr->photoPboSize = size;
+	}
+	glReadPixels(0, 0, width, height, format, type, 0);
+	pixels = (GLubyte *) procs->mapBuffer(GL_PIXEL_PACK_BUFFER,
+	    GL_READ_ONLY);
+	if (pixels == NULL) {
+	    /* The buffer could not be mapped; read into client memory. */
+	    procs->bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	    usePbo = False;
+	}
+    }
+    if (!usePbo) {
+	buffer = (GLubyte *) ckalloc(size);
+	glReadPixels(0, 0, width, height, format, type, buffer);
+	pixels = buffer;
+    }
+    result = TkglPutPhotoPixels(tkglPtr, photo, pixels, format, 0, 0,
+	width, height);
+    if (usePbo) {
+	procs->unmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+	ckfree(buffer);
+    }
+    if (hasPbo) {
+	procs->bindBuffer(GL_PIXEL_PACK_BUFFER, packBuffer);
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, packAlignment);
+    glPixelStorei(GL_PACK_ROW_LENGTH, packRowLength);
+    glPixelStorei(GL_PACK_SKIP_PIXELS, packSkipPixels);
+    glPixelStorei(GL_PACK_SKIP_ROWS, packSkipRows);
+    return result;
 }
 
 int
@@ -14,16 +14,20 @@
   tkgl.h.  They comprise the platform interface.
 
 void Tkgl_Update(const Tkgl *tkglPtr);
+void Tkgl_ScheduleRedisplay(Tkgl *tkglPtr);
+void Tkgl_CancelRedisplay(Tkgl *tkglPtr);
 Window Tkgl_MakeWindow(Tk_Window tkwin, Window parent, void* instanceData);
 void Tkgl_MapWidget(void *instanceData);
 void Tkgl_UnmapWidget(void *instanceData);
 void Tkgl_WorldChanged(void* instanceData);
 void Tkgl_MakeCurrent(const Tkgl *tkglPtr);
 void Tkgl_SwapBuffers(const Tkgl *tkglPtr);
+int Tkgl_BufferAge(const Tkgl *tkglPtr);
 int Tkgl_TakePhoto(Tkgl *tkglPtr, Tk_PhotoHandle photo);
 int Tkgl_CopyContext(const Tkgl *from, const Tkgl *to, unsigned mask);
 int Tkgl_CreateGLContext(Tkgl *tkglPtr);
 const char* Tkgl_GetExtensions(Tkgl *TkglPtr);
+void *Tkgl_GetProcAddress(const char *name);
 void Tkgl_FreeResources(Tkgl *TkglPtr);
 */
 
@@ -470,6 +474,7 @@ tkglCreateChildWindow(
             goto error;
         }
         tkglPtr->context = shareWith->context;
+        TkglGroupJoin(tkglPtr, shareWith);
     } else {
 	int *attributes = NULL;
 	switch(tkglPtr->profile) {
@@ -505,7 +510,7 @@ tkglCreateChildWindow(
                         "unable to share display lists", TCL_STATIC);
                 goto error;
             }
-            tkglPtr->contextTag = shareWith->contextTag;
+            TkglGroupJoin(tkglPtr, shareWith);
         }
     }
     if (tkglPtr->context == NULL) {
@@ -556,6 +561,12 @@ Tkgl_CreateGLContext(
     int   pixelFormat;
     UINT  numFormats;
 
+    if (tkglPtr->offscreen != OFFSCREEN_NONE) {
+	Tcl_SetResult(tkglPtr->interp,
+		"-offscreen fbo is not supported on this platform",
+		TCL_STATIC);
+	return TCL_ERROR;
+    }
     dummy = tkglCreateDummyWindow();
     if (dummy == NULL) {
 	Tcl_SetResult(tkglPtr->interp,
@@ -860,7 +871,7 @@ void
 Tkgl_SwapBuffers(
     const Tkgl *tkglPtr)
 {
-    if (tkglPtr->doubleFlag) {
+    if (tkglPtr->doubleFlag && tkglPtr->tile == NULL) {
         int result = SwapBuffers(tkglPtr->deviceContext);
 	if (!result) {
 	    fprintf(stderr, "SwapBuffers failed\n");
@@ -869,6 +880,20 @@ Tkgl_SwapBuffers(
 	glFlush();
     }
 }
+
+/*
+ * Tkgl_BufferAge
+ *
+ * WGL has no way to query the age of the back buffer, whose contents are
+ * undefined after SwapBuffers.
+ */
+
+int
+Tkgl_BufferAge(
+    const Tkgl *tkglPtr)
+{
+    return 0;
+}
 
 
 /*
@@ -884,6 +909,33 @@ void
 Tkgl_Update(
     const Tkgl *tkglPtr) {
 }
+
+
+/*
+ * Tkgl_ScheduleRedisplay
+ *
+ * Arranges for TkglDisplay to be called when Tcl is idle.
+ */
+
+void
+Tkgl_ScheduleRedisplay(
+    Tkgl *tkglPtr)
+{
+    Tcl_DoWhenIdle(TkglDisplay, (void *) tkglPtr);
+}
+
+/*
+ * Tkgl_CancelRedisplay
+ *
+ * Cancels a call to TkglDisplay scheduled by Tkgl_ScheduleRedisplay.
+ */
+
+void
+Tkgl_CancelRedisplay(
+    Tkgl *tkglPtr)
+{
+    Tcl_CancelIdleCall(TkglDisplay, (void *) tkglPtr);
+}
 
 
 /*
@@ -905,6 +957,24 @@ const char* Tkgl_GetExtensions(
 
     return tkglPtr->extensions;
 }
+
+void *Tkgl_GetProcAddress(
+    const char *name)
+{
+    /*
+     * wglGetProcAddress does not return the OpenGL 1.1 functions which are
+     * exported by opengl32.dll, and some drivers return small integers
+     * instead of NULL for unknown names.
+     */
+
+    PROC proc = wglGetProcAddress(name);
+
+    if (proc == NULL || proc == (PROC) 1 || proc == (PROC) 2
+	    || proc == (PROC) 3 || proc == (PROC) -1) {
+	proc = GetProcAddress(GetModuleHandleA("opengl32.dll"), name);
+    }
+    return (void *) proc;
+}
 
 /* 
  * Tkgl_MapWidget